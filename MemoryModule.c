@@ -38,8 +38,11 @@
 #include <stdlib.h>
 #endif
 #include <tchar.h>
-#ifdef DEBUG_OUTPUT
+#include <tlhelp32.h>
 #include <stdio.h>
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_STREAMING_COPY
 #endif
 
 #if _MSC_VER
@@ -58,6 +61,10 @@
 #define IMAGE_SIZEOF_BASE_RELOCATION (sizeof(IMAGE_BASE_RELOCATION))
 #endif
 
+#ifndef ERROR_INVALID_IMAGE_HASH
+#define ERROR_INVALID_IMAGE_HASH 577
+#endif
+
 #ifdef _WIN64
 #define HOST_MACHINE IMAGE_FILE_MACHINE_AMD64
 #else
@@ -74,14 +81,30 @@ struct ExportNameEntry {
 typedef BOOL (WINAPI *DllEntryProc)(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpReserved);
 typedef int (WINAPI *ExeEntryProc)(void);
 
-#ifdef _WIN64
-typedef struct POINTER_LIST {
-    struct POINTER_LIST *next;
-    void *address;
-} POINTER_LIST;
-#endif
-
-typedef struct {
+// Parsed EXE/DLL, see MemoryParseImage. LoadModule also uses it on the stack
+// for images that are loaded directly, only the layout is filled then and
+// "refCount" is 0.
+typedef struct MEMORYIMAGE {
+    volatile LONG refCount;
+    const unsigned char *data;
+    size_t size;
+    PIMAGE_NT_HEADERS headers;
+    size_t alignedImageSize;
+    DWORD pageSize;
+    DWORD allocationGranularity;
+    MEMORYPROTECTIONRANGE *protectionMap;
+    DWORD numProtectionRanges;
+    // RVAs of the 32bit addresses to relocate, followed by the RVAs of the
+    // 64bit addresses
+    DWORD *relocations;
+    DWORD numRelocations;
+    DWORD numRelocations64;
+    DWORD numImports;
+    // names point into "data"
+    struct ExportNameEntry *nameExports;
+} MEMORYIMAGE, *PMEMORYIMAGE;
+
+typedef struct MEMORYMODULE {
     PIMAGE_NT_HEADERS headers;
     unsigned char *codeBase;
     HCUSTOMMODULE *modules;
@@ -94,25 +117,65 @@ typedef struct {
     CustomLoadLibraryFunc loadLibrary;
     CustomGetProcAddressFunc getProcAddress;
     CustomFreeLibraryFunc freeLibrary;
-    struct ExportNameEntry *nameExportsTable;
+    struct ExportNameEntry * volatile nameExportsTable;
+    struct EXPORT_HASH_TABLE * volatile hashExportsTable;
+    // slots bound by MemoryBindProc, guarded by "procSlotsLock"
+    MEMORYPROCSLOT *procSlots;
     void *userdata;
+    PMEMORYIMAGE image;
     ExeEntryProc exeEntry;
     DWORD pageSize;
-#ifdef _WIN64
-    POINTER_LIST *blockedMemory;
+    DWORD flags;
+    DWORD placement;
+    ptrdiff_t locationDelta;
+    DWORD numRelocations;
+    MEMORYPROTECTIONRANGE *protectionMap;
+    DWORD numProtectionRanges;
+    BOOL trimmed;
+    SIZE_T trimmedBytes;
+    // compact copy of the loader data that is still used after trimming,
+    // see KeepLoaderData
+    BOOL loaderDataKept;
+    DWORD *relocations;
+    DWORD numRelocations32;
+    DWORD numRelocations64;
+    struct RVARANGE *importThunks;
+    DWORD numImportThunks;
+    struct HIBERNATIONDATA *hibernation;
+    volatile LONG hibernationLock;
+    DWORD tlsIndex;
+    volatile BOOL tlsReady;
+    volatile BOOL threadNotifications;
+    // DLL_PROCESS_ATTACH has been sent to the TLS callbacks
+    BOOL started;
+    // modules loaded with MEMORY_LOAD_SHARED, guarded by "sharedModulesLock"
+    BOOL shared;
+    LONG refCount;
+    struct MEMORYMODULE *nextShared;
+    DWORD headerHash;
+    size_t imageSize;
+    MEMORYIMAGEHASH imageHash;
+    // MEMORY_LOAD_TRAMPOLINES, moved to the new module by MemoryReloadModule
+    struct TRAMPOLINES * volatile trampolines;
+    // index of the trampolines while they pointed into this module
+    struct TRAMPOLINE_INDEX *retiredIndex;
+#ifdef LOADSTATS
+    MEMORYLOADSTATS loadStats;
+    LARGE_INTEGER phaseStart;
 #endif
 } MEMORYMODULE, *PMEMORYMODULE;
 
-typedef struct {
-    LPVOID address;
-    LPVOID alignedAddress;
-    SIZE_T size;
-    DWORD characteristics;
-    BOOL last;
-} SECTIONFINALIZEDATA, *PSECTIONFINALIZEDATA;
-
 #define GET_HEADER_DICTIONARY(module, idx)  &(module)->headers->OptionalHeader.DataDirectory[idx]
 
+#ifdef LOADSTATS
+// Each phase ends where the next one starts.
+#define LOADSTATS_END_PHASE(module, phase)      EndLoadPhase((module), (phase))
+#define LOADSTATS_ADD(module, counter, value)   ((module)->loadStats.counter += (value))
+#else
+#define LOADSTATS_END_PHASE(module, phase)      ((void) 0)
+#define LOADSTATS_ADD(module, counter, value)   ((void) 0)
+#endif
+
 static inline uintptr_t
 AlignValueDown(uintptr_t value, uintptr_t alignment) {
     return value & ~(alignment - 1);
@@ -151,804 +214,6027 @@ OutputLastError(const char *msg)
 #endif
 }
 
-#ifdef _WIN64
+// Minimal lock for rarely contended global state that doesn't require any
+// initialization.
+static inline void
+AcquireSpinLock(volatile LONG *lock)
+{
+    while (InterlockedCompareExchange(lock, 1, 0) != 0) {
+        Sleep(0);
+    }
+}
+
+static inline void
+ReleaseSpinLock(volatile LONG *lock)
+{
+    InterlockedExchange(lock, 0);
+}
+
+#ifdef LOADSTATS
+static MEMORYLOADSTATS processLoadStats;
+static volatile LONG processLoadStatsLock = 0;
+
+static void
+EndLoadPhase(PMEMORYMODULE module, int phase)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    module->loadStats.phaseTicks[phase] += now.QuadPart - module->phaseStart.QuadPart;
+    module->phaseStart = now;
+}
+
 static void
-FreePointerList(POINTER_LIST *head, CustomFreeFunc freeMemory, void *userdata)
+AccumulateLoadStats(const MEMORYLOADSTATS *stats)
 {
-    POINTER_LIST *node = head;
-    while (node) {
-        POINTER_LIST *next;
-        freeMemory(node->address, 0, MEM_RELEASE, userdata);
-        next = node->next;
-        free(node);
-        node = next;
+    int i;
+    AcquireSpinLock(&processLoadStatsLock);
+    for (i=0; i<MEMORY_LOAD_PHASE_COUNT; i++) {
+        processLoadStats.phaseTicks[i] += stats->phaseTicks[i];
     }
+    processLoadStats.numLoads += stats->numLoads;
+    processLoadStats.bytesCopied += stats->bytesCopied;
+    processLoadStats.relocations += stats->relocations;
+    processLoadStats.importsResolved += stats->importsResolved;
+    processLoadStats.protectCalls += stats->protectCalls;
+    processLoadStats.pagesDecommitted += stats->pagesDecommitted;
+    ReleaseSpinLock(&processLoadStatsLock);
 }
 #endif
 
-static BOOL
-CheckSize(size_t size, size_t expected) {
-    if (size < expected) {
-        SetLastError(ERROR_INVALID_DATA);
-        return FALSE;
+// Callback and userdata are published together so an event is never
+// delivered to a callback with the userdata of another one. Sinks are not
+// freed as a removed callback may still be running, installing the same
+// pair again reuses the existing sink.
+typedef struct EVENT_SINK {
+    struct EVENT_SINK *next;
+    MemoryEventCallback callback;
+    void *userdata;
+} EVENT_SINK;
+
+// Installed event sink, checked before any event is built.
+static EVENT_SINK * volatile eventSink = NULL;
+static EVENT_SINK *eventSinks = NULL;
+static volatile LONG eventSinksLock = 0;
+
+// Deliver an event to "sink". Events that belong together (like the begin
+// and end of a load) are delivered to the same sink, even if another one is
+// installed in between.
+static void
+EmitSinkEvent(EVENT_SINK *sink, DWORD type, HMEMORYMODULE module, LPCSTR name, ULONG_PTR value, LPCVOID address, DWORD status)
+{
+    MEMORYEVENT event;
+    LARGE_INTEGER now;
+    DWORD lastError = GetLastError();
+    if (sink == NULL) {
+        return;
     }
 
-    return TRUE;
+    QueryPerformanceCounter(&now);
+    event.type = type;
+    event.threadId = GetCurrentThreadId();
+    event.timestamp = now.QuadPart;
+    event.module = module;
+    event.name = name;
+    event.value = value;
+    event.address = address;
+    event.status = status;
+    sink->callback(&event, sink->userdata);
+    // sinks must not change the error reported to the caller
+    SetLastError(lastError);
 }
 
-static BOOL
-CopySections(const unsigned char *data, size_t size, PIMAGE_NT_HEADERS old_headers, PMEMORYMODULE module)
+static void
+EmitEvent(DWORD type, HMEMORYMODULE module, LPCSTR name, ULONG_PTR value, LPCVOID address, DWORD status)
 {
-    int i, section_size;
-    unsigned char *codeBase = module->codeBase;
-    unsigned char *dest;
-    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(module->headers);
-    for (i=0; i<module->headers->FileHeader.NumberOfSections; i++, section++) {
-        if (section->SizeOfRawData == 0) {
-            // section doesn't contain data in the dll itself, but may define
-            // uninitialized data
-            section_size = old_headers->OptionalHeader.SectionAlignment;
-            if (section_size > 0) {
-                dest = (unsigned char *)module->alloc(codeBase + section->VirtualAddress,
-                    section_size,
-                    MEM_COMMIT,
-                    PAGE_READWRITE,
-                    module->userdata);
-                if (dest == NULL) {
-                    return FALSE;
-                }
+    EmitSinkEvent(eventSink, type, module, name, value, address, status);
+}
 
-                // Always use position from file to support alignments smaller
-                // than page size (allocation above will align to page size).
-                dest = codeBase + section->VirtualAddress;
-                // NOTE: On 64bit systems we truncate to 32bit here but expand
-                // again later when "PhysicalAddress" is used.
-                section->Misc.PhysicalAddress = (DWORD) ((uintptr_t) dest & 0xffffffff);
-                memset(dest, 0, section_size);
-            }
+// Memory blocks for images may not span 4 GB boundaries on 64bit.
+static inline BOOL
+CrossesImageBoundary(uintptr_t address, size_t size)
+{
+#ifdef _WIN64
+    return (address >> 32) != ((address + size - 1) >> 32);
+#else
+    UNREFERENCED_PARAMETER(address);
+    UNREFERENCED_PARAMETER(size);
+    return FALSE;
+#endif
+}
 
-            // section is empty
-            continue;
+#ifdef _WIN64
+// Scan the address space for a free range of "size" bytes that doesn't cross
+// a 4 GB boundary, starting at "start" and wrapping around once.
+static unsigned char *
+FindImageMemory(uintptr_t start, size_t size, DWORD allocationType, size_t alignment,
+    CustomAllocFunc allocMemory, CustomFreeFunc freeMemory, void *userdata)
+{
+    SYSTEM_INFO sysInfo;
+    MEMORY_BASIC_INFORMATION mbi;
+    uintptr_t minAddress, maxAddress;
+    uintptr_t address = start;
+    BOOL wrapped = FALSE;
+
+    GetNativeSystemInfo(&sysInfo);
+    minAddress = (uintptr_t) sysInfo.lpMinimumApplicationAddress;
+    maxAddress = (uintptr_t) sysInfo.lpMaximumApplicationAddress;
+    for (;;) {
+        uintptr_t regionEnd;
+        if (address < minAddress || address >= maxAddress) {
+            if (wrapped) {
+                break;
+            }
+            address = minAddress;
+            wrapped = TRUE;
+        }
+        if (wrapped && address >= start) {
+            break;
         }
 
-        if (!CheckSize(size, section->PointerToRawData + section->SizeOfRawData)) {
-            return FALSE;
+        if (!VirtualQuery((LPCVOID) address, &mbi, sizeof(mbi))) {
+            break;
         }
 
-        // commit memory block and copy data from dll
-        dest = (unsigned char *)module->alloc(codeBase + section->VirtualAddress,
-                            section->SizeOfRawData,
-                            MEM_COMMIT,
-                            PAGE_READWRITE,
-                            module->userdata);
-        if (dest == NULL) {
-            return FALSE;
+        regionEnd = (uintptr_t) mbi.BaseAddress + mbi.RegionSize;
+        if (mbi.State == MEM_FREE) {
+            uintptr_t candidate = AlignValueUp((uintptr_t) mbi.BaseAddress, alignment);
+            if (CrossesImageBoundary(candidate, size)) {
+                candidate = ((candidate >> 32) + 1) << 32;
+            }
+            if (candidate + size > candidate && candidate + size <= regionEnd) {
+                unsigned char *code = (unsigned char *)allocMemory((LPVOID) candidate,
+                    size,
+                    allocationType,
+                    PAGE_READWRITE,
+                    userdata);
+                if (code != NULL) {
+                    if (!CrossesImageBoundary((uintptr_t) code, size)) {
+                        return code;
+                    }
+                    // custom allocator didn't respect the address
+                    freeMemory(code, 0, MEM_RELEASE, userdata);
+                }
+            }
+        }
+        if (regionEnd <= address) {
+            break;
         }
+        address = regionEnd;
+    }
+    return NULL;
+}
+#endif
 
-        // Always use position from file to support alignments smaller
-        // than page size (allocation above will align to page size).
-        dest = codeBase + section->VirtualAddress;
-        memcpy(dest, data + section->PointerToRawData, section->SizeOfRawData);
-        // NOTE: On 64bit systems we truncate to 32bit here but expand
-        // again later when "PhysicalAddress" is used.
-        section->Misc.PhysicalAddress = (DWORD) ((uintptr_t) dest & 0xffffffff);
+// Get the address inside the free range "start" to "end" that is closest to
+// "target" and can hold "size" bytes, or 0 if the range is too small.
+static uintptr_t
+FitNearby(uintptr_t start, uintptr_t end, uintptr_t target, size_t size, size_t alignment)
+{
+    uintptr_t lowest, highest, result;
+    if (end - start < size) {
+        return 0;
     }
 
-    return TRUE;
-}
+    lowest = AlignValueUp(start, alignment);
+    highest = AlignValueDown(end - size, alignment);
+    if (lowest == 0 || lowest > highest) {
+        return 0;
+    }
 
-// Protection flags for memory pages (Executable, Readable, Writeable)
-static int ProtectionFlags[2][2][2] = {
-    {
-        // not executable
-        {PAGE_NOACCESS, PAGE_WRITECOPY},
-        {PAGE_READONLY, PAGE_READWRITE},
-    }, {
-        // executable
-        {PAGE_EXECUTE, PAGE_EXECUTE_WRITECOPY},
-        {PAGE_EXECUTE_READ, PAGE_EXECUTE_READWRITE},
-    },
-};
+    result = AlignValueDown(target, alignment);
+    if (result < lowest) {
+        result = lowest;
+    } else if (result > highest) {
+        result = highest;
+    }
 
-static SIZE_T
-GetRealSectionSize(PMEMORYMODULE module, PIMAGE_SECTION_HEADER section) {
-    DWORD size = section->SizeOfRawData;
-    if (size == 0) {
-        if (section->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA) {
-            size = module->headers->OptionalHeader.SizeOfInitializedData;
-        } else if (section->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
-            size = module->headers->OptionalHeader.SizeOfUninitializedData;
+#ifdef _WIN64
+    if (CrossesImageBoundary(result, size)) {
+        // move below or above the 4 GB boundary, whatever is closer
+        uintptr_t boundary = ((result + size - 1) >> 32) << 32;
+        uintptr_t below = (boundary - size >= lowest) ? AlignValueDown(boundary - size, alignment) : 0;
+        uintptr_t above = (boundary <= highest) ? boundary : 0;
+        if (below != 0 && (below < lowest || CrossesImageBoundary(below, size))) {
+            below = 0;
+        }
+        if (above != 0 && CrossesImageBoundary(above, size)) {
+            above = 0;
+        }
+        if (below == 0) {
+            result = above;
+        } else if (above == 0) {
+            result = below;
+        } else {
+            result = (target - below < above - target) ? below : above;
         }
     }
-    return (SIZE_T) size;
+#endif
+    return result;
 }
 
-static BOOL
-FinalizeSection(PMEMORYMODULE module, PSECTIONFINALIZEDATA sectionData) {
-    DWORD protect, oldProtect;
-    BOOL executable;
-    BOOL readable;
-    BOOL writeable;
+#ifdef _WIN64
+// Images can be reached with rel32 displacements from the host if they are
+// at most this far away.
+#define REL32_RANGE ((uintptr_t) 0x7fff0000)
+#endif
 
-    if (sectionData->size == 0) {
-        return TRUE;
+// Reserve the free range closest to "target". On 64bit, only ranges within
+// rel32 range of "host" (the executable if 0) are used.
+static unsigned char *
+FindNearbyImageMemory(uintptr_t target, uintptr_t host, size_t size, DWORD allocationType, size_t alignment,
+    CustomAllocFunc allocMemory, CustomFreeFunc freeMemory, void *userdata)
+{
+    SYSTEM_INFO sysInfo;
+    MEMORY_BASIC_INFORMATION mbi;
+    uintptr_t low, high, address;
+    uintptr_t best = 0;
+    uintptr_t bestDistance = (uintptr_t) -1;
+    unsigned char *code;
+
+    GetNativeSystemInfo(&sysInfo);
+    low = (uintptr_t) sysInfo.lpMinimumApplicationAddress;
+    high = (uintptr_t) sysInfo.lpMaximumApplicationAddress;
+#ifdef _WIN64
+    if (host == 0) {
+        host = (uintptr_t) GetModuleHandle(NULL);
+    }
+    if (host > low + REL32_RANGE) {
+        low = host - REL32_RANGE;
     }
+    if (host + REL32_RANGE < high) {
+        high = host + REL32_RANGE;
+    }
+    if (target < low || target >= high) {
+        target = host;
+    }
+#else
+    UNREFERENCED_PARAMETER(host);
+#endif
 
-    if (sectionData->characteristics & IMAGE_SCN_MEM_DISCARDABLE) {
-        // section is not needed any more and can safely be freed
-        if (sectionData->address == sectionData->alignedAddress &&
-            (sectionData->last ||
-             module->headers->OptionalHeader.SectionAlignment == module->pageSize ||
-             (sectionData->size % module->pageSize) == 0)
-           ) {
-            // Only allowed to decommit whole pages
-            module->free(sectionData->address, sectionData->size, MEM_DECOMMIT, module->userdata);
+    address = low;
+    while (address < high) {
+        uintptr_t start, end;
+        if (!VirtualQuery((LPCVOID) address, &mbi, sizeof(mbi))) {
+            break;
         }
-        return TRUE;
-    }
 
-    // determine protection flags based on characteristics
-    executable = (sectionData->characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
-    readable =   (sectionData->characteristics & IMAGE_SCN_MEM_READ) != 0;
-    writeable =  (sectionData->characteristics & IMAGE_SCN_MEM_WRITE) != 0;
-    protect = ProtectionFlags[executable][readable][writeable];
-    if (sectionData->characteristics & IMAGE_SCN_MEM_NOT_CACHED) {
-        protect |= PAGE_NOCACHE;
+        start = (uintptr_t) mbi.BaseAddress;
+        end = start + mbi.RegionSize;
+        if (start < low) {
+            start = low;
+        }
+        if (end > high) {
+            end = high;
+        }
+        if (start > target && start - target >= bestDistance) {
+            // all following ranges are further away
+            break;
+        }
+
+        if (mbi.State == MEM_FREE && end > start) {
+            uintptr_t candidate = FitNearby(start, end, target, size, alignment);
+            if (candidate != 0) {
+                uintptr_t distance = (candidate > target) ? candidate - target : target - candidate;
+                if (distance < bestDistance) {
+                    best = candidate;
+                    bestDistance = distance;
+                }
+            }
+        }
+        if (end <= address) {
+            break;
+        }
+        address = end;
     }
 
-    // change memory access flags
-    if (VirtualProtect(sectionData->address, sectionData->size, protect, &oldProtect) == 0) {
-        OutputLastError("Error protecting memory page");
-        return FALSE;
+    if (best == 0) {
+        return NULL;
     }
 
-    return TRUE;
+    code = (unsigned char *)allocMemory((LPVOID) best,
+        size,
+        allocationType,
+        PAGE_READWRITE,
+        userdata);
+    if (code != NULL && CrossesImageBoundary((uintptr_t) code, size)) {
+        // custom allocator didn't respect the address
+        freeMemory(code, 0, MEM_RELEASE, userdata);
+        code = NULL;
+    }
+    return code;
 }
 
-static BOOL
-FinalizeSections(PMEMORYMODULE module)
+// Reserve memory for an image. The preferred address is tried first, then
+// the strategies enabled in "options", then any address.
+static unsigned char *
+AllocImageMemory(uintptr_t preferred, size_t size, DWORD allocationType, size_t alignment,
+    const MEMORYLOADOPTIONS *options, DWORD *placement,
+    CustomAllocFunc allocMemory, CustomFreeFunc freeMemory, void *userdata)
 {
-    int i;
-    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(module->headers);
-#ifdef _WIN64
-    // "PhysicalAddress" might have been truncated to 32bit above, expand to
-    // 64bits again.
-    uintptr_t imageOffset = ((uintptr_t) module->headers->OptionalHeader.ImageBase & 0xffffffff00000000);
-#else
-    static const uintptr_t imageOffset = 0;
-#endif
-    SECTIONFINALIZEDATA sectionData;
-    sectionData.address = (LPVOID)((uintptr_t)section->Misc.PhysicalAddress | imageOffset);
-    sectionData.alignedAddress = AlignAddressDown(sectionData.address, module->pageSize);
-    sectionData.size = GetRealSectionSize(module, section);
-    sectionData.characteristics = section->Characteristics;
-    sectionData.last = FALSE;
-    section++;
-
-    // loop through all sections and change access flags
-    for (i=1; i<module->headers->FileHeader.NumberOfSections; i++, section++) {
-        LPVOID sectionAddress = (LPVOID)((uintptr_t)section->Misc.PhysicalAddress | imageOffset);
-        LPVOID alignedAddress = AlignAddressDown(sectionAddress, module->pageSize);
-        SIZE_T sectionSize = GetRealSectionSize(module, section);
-        // Combine access flags of all sections that share a page
-        // TODO(fancycode): We currently share flags of a trailing large section
-        //   with the page of a first small section. This should be optimized.
-        if (sectionData.alignedAddress == alignedAddress || (uintptr_t) sectionData.address + sectionData.size > (uintptr_t) alignedAddress) {
-            // Section shares page with previous
-            if ((section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE) == 0 || (sectionData.characteristics & IMAGE_SCN_MEM_DISCARDABLE) == 0) {
-                sectionData.characteristics = (sectionData.characteristics | section->Characteristics) & ~IMAGE_SCN_MEM_DISCARDABLE;
-            } else {
-                sectionData.characteristics |= section->Characteristics;
+    unsigned char *code = NULL;
+    *placement = MEMORY_PLACEMENT_PREFERRED;
+    if ((preferred & (alignment - 1)) == 0 && !CrossesImageBoundary(preferred, size)) {
+        code = (unsigned char *)allocMemory((LPVOID) preferred,
+            size,
+            allocationType,
+            PAGE_READWRITE,
+            userdata);
+    }
+
+    if (code == NULL && options != NULL && (options->flags & MEMORY_LOAD_PLACE_NEARBY)) {
+        *placement = MEMORY_PLACEMENT_NEARBY;
+        code = FindNearbyImageMemory(preferred, (uintptr_t) options->nearAddress, size, allocationType, alignment,
+            allocMemory, freeMemory, userdata);
+    }
+
+    if (code == NULL && options != NULL && options->candidateBases != NULL) {
+        DWORD i;
+        *placement = MEMORY_PLACEMENT_CANDIDATE;
+        for (i=0; code == NULL && i<options->numCandidateBases; i++) {
+            uintptr_t candidate = (uintptr_t) options->candidateBases[i];
+            if (candidate == 0 || (candidate & (alignment - 1)) != 0 || CrossesImageBoundary(candidate, size)) {
+                continue;
             }
-            sectionData.size = (((uintptr_t)sectionAddress) + ((uintptr_t) sectionSize)) - (uintptr_t) sectionData.address;
-            continue;
-        }
 
-        if (!FinalizeSection(module, &sectionData)) {
-            return FALSE;
+            code = (unsigned char *)allocMemory((LPVOID) candidate,
+                size,
+                allocationType,
+                PAGE_READWRITE,
+                userdata);
         }
-        sectionData.address = sectionAddress;
-        sectionData.alignedAddress = alignedAddress;
-        sectionData.size = sectionSize;
-        sectionData.characteristics = section->Characteristics;
     }
-    sectionData.last = TRUE;
-    if (!FinalizeSection(module, &sectionData)) {
+
+    if (code == NULL) {
+        // try to allocate memory at arbitrary position
+        *placement = MEMORY_PLACEMENT_ANY;
+        code = (unsigned char *)allocMemory(NULL,
+            size,
+            allocationType,
+            PAGE_READWRITE,
+            userdata);
+    }
+
+#ifdef _WIN64
+    if (code != NULL && CrossesImageBoundary((uintptr_t) code, size)) {
+        // Search for a free range near the block the allocator returned
+        // instead of keeping blocks reserved until one fits.
+        uintptr_t start = (uintptr_t) code;
+        freeMemory(code, 0, MEM_RELEASE, userdata);
+        code = FindImageMemory(start, size, allocationType, alignment, allocMemory, freeMemory, userdata);
+    }
+#else
+    UNREFERENCED_PARAMETER(freeMemory);
+#endif
+    return code;
+}
+
+static BOOL
+CheckSize(size_t size, size_t expected) {
+    if (size < expected) {
+        SetLastError(ERROR_INVALID_DATA);
         return FALSE;
     }
+
     return TRUE;
 }
 
-static BOOL
-ExecuteTLS(PMEMORYMODULE module)
+// Returns the size of large pages or 0 if they can't be used by the process.
+static SIZE_T
+GetLargePageSize(void)
 {
-    unsigned char *codeBase = module->codeBase;
-    PIMAGE_TLS_DIRECTORY tls;
-    PIMAGE_TLS_CALLBACK* callback;
+    // 0: not checked yet, 1: available, 2: not available
+    static volatile LONG state = 0;
+    static SIZE_T largePageSize = 0;
+    HANDLE token;
+    TOKEN_PRIVILEGES privileges;
+    SIZE_T size;
+    BOOL enabled = FALSE;
 
-    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_TLS);
-    if (directory->VirtualAddress == 0) {
-        return TRUE;
+    if (state != 0) {
+        return (state == 1) ? largePageSize : 0;
     }
 
-    tls = (PIMAGE_TLS_DIRECTORY) (codeBase + directory->VirtualAddress);
-    callback = (PIMAGE_TLS_CALLBACK *) tls->AddressOfCallBacks;
-    if (callback) {
-        while (*callback) {
-            (*callback)((LPVOID) codeBase, DLL_PROCESS_ATTACH, NULL);
-            callback++;
+    size = GetLargePageMinimum();
+    if (size != 0 && OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        // Allocating large pages requires "SeLockMemoryPrivilege" to be
+        // enabled, which only succeeds if it has been granted to the user.
+        // It is left enabled as documented for MEMORY_LOAD_LARGE_PAGES.
+        privileges.PrivilegeCount = 1;
+        privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+            GetLastError() == ERROR_SUCCESS) {
+            enabled = TRUE;
         }
+        CloseHandle(token);
     }
+
+    largePageSize = size;
+    InterlockedExchange(&state, enabled ? 1 : 2);
+    return enabled ? largePageSize : 0;
+}
+
+// Sections larger than this are copied with non-temporal stores, they would
+// only evict other data from the caches.
+#define STREAMING_COPY_THRESHOLD    (1024 * 1024)
+// Sections larger than this are split into chunks that are copied by the
+// thread pool and the loading thread.
+#define PARALLEL_COPY_THRESHOLD     (4 * 1024 * 1024)
+#define PARALLEL_COPY_CHUNK         (1024 * 1024)
+
+#ifdef HAVE_STREAMING_COPY
+static BOOL
+CanStreamCopy(void)
+{
+#ifdef _WIN64
     return TRUE;
+#else
+    // 0: not checked yet, 1: available, 2: not available
+    static volatile LONG state = 0;
+    if (state == 0) {
+        InterlockedExchange(&state, IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? 1 : 2);
+    }
+    return state == 1;
+#endif
+}
+
+static void
+StreamCopy(unsigned char *dest, const unsigned char *src, size_t size)
+{
+    size_t head = (16 - ((uintptr_t) dest & 15)) & 15;
+    size_t blocks;
+    if (head > size) {
+        head = size;
+    }
+    memcpy(dest, src, head);
+    dest += head;
+    src += head;
+    size -= head;
+
+    for (blocks = size / 64; blocks > 0; blocks--, dest += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+        _mm_stream_si128((__m128i *) dest, a);
+        _mm_stream_si128((__m128i *) (dest + 16), b);
+        _mm_stream_si128((__m128i *) (dest + 32), c);
+        _mm_stream_si128((__m128i *) (dest + 48), d);
+    }
+    memcpy(dest, src, size & 63);
+    // make the stores visible to other threads before the copy is reported
+    // as done
+    _mm_sfence();
 }
+#endif
 
 static BOOL
-PerformBaseRelocation(PMEMORYMODULE module, ptrdiff_t delta)
+UseStreamCopy(size_t size)
 {
-    unsigned char *codeBase = module->codeBase;
-    PIMAGE_BASE_RELOCATION relocation;
+#ifdef HAVE_STREAMING_COPY
+    return size >= STREAMING_COPY_THRESHOLD && CanStreamCopy();
+#else
+    UNREFERENCED_PARAMETER(size);
+    return FALSE;
+#endif
+}
 
-    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_BASERELOC);
-    if (directory->Size == 0) {
-        return (delta == 0);
+static void
+CopyData(unsigned char *dest, const unsigned char *src, size_t size, BOOL stream)
+{
+#ifdef HAVE_STREAMING_COPY
+    if (stream) {
+        StreamCopy(dest, src, size);
+        return;
     }
+#else
+    UNREFERENCED_PARAMETER(stream);
+#endif
+    memcpy(dest, src, size);
+}
 
-    relocation = (PIMAGE_BASE_RELOCATION) (codeBase + directory->VirtualAddress);
-    for (; relocation->VirtualAddress > 0; ) {
-        DWORD i;
-        unsigned char *dest = codeBase + relocation->VirtualAddress;
-        unsigned short *relInfo = (unsigned short*) OffsetPointer(relocation, IMAGE_SIZEOF_BASE_RELOCATION);
-        for (i=0; i<((relocation->SizeOfBlock-IMAGE_SIZEOF_BASE_RELOCATION) / 2); i++, relInfo++) {
-            // the upper 4 bits define the type of relocation
-            int type = *relInfo >> 12;
-            // the lower 12 bits define the offset
-            int offset = *relInfo & 0xfff;
+typedef struct {
+    DWORD state[8];
+    ULONGLONG length;
+    unsigned char buffer[64];
+    DWORD used;
+} SHA256CONTEXT;
+
+static const DWORD Sha256Constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
 
-            switch (type)
-            {
-            case IMAGE_REL_BASED_ABSOLUTE:
-                // skip relocation
-                break;
+#define SHA256_ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
 
-            case IMAGE_REL_BASED_HIGHLOW:
-                // change complete 32 bit address
+static void
+Sha256Init(SHA256CONTEXT *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void
+Sha256Block(SHA256CONTEXT *ctx, const unsigned char *block)
+{
+    DWORD w[64];
+    DWORD a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i=0; i<16; i++, block+=4) {
+        w[i] = ((DWORD) block[0] << 24) | ((DWORD) block[1] << 16) | ((DWORD) block[2] << 8) | block[3];
+    }
+    for (; i<64; i++) {
+        DWORD s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        DWORD s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = ctx->state[0];
+    b = ctx->state[1];
+    c = ctx->state[2];
+    d = ctx->state[3];
+    e = ctx->state[4];
+    f = ctx->state[5];
+    g = ctx->state[6];
+    h = ctx->state[7];
+    for (i=0; i<64; i++) {
+        DWORD t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) +
+            ((e & f) ^ (~e & g)) + Sha256Constants[i] + w[i];
+        DWORD t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+static void
+Sha256Update(SHA256CONTEXT *ctx, const unsigned char *data, size_t size)
+{
+    ctx->length += size;
+    if (ctx->used > 0) {
+        size_t count = 64 - ctx->used;
+        if (count > size) {
+            count = size;
+        }
+        memcpy(ctx->buffer + ctx->used, data, count);
+        ctx->used += (DWORD) count;
+        data += count;
+        size -= count;
+        if (ctx->used < 64) {
+            return;
+        }
+        Sha256Block(ctx, ctx->buffer);
+        ctx->used = 0;
+    }
+    for (; size >= 64; size -= 64, data += 64) {
+        Sha256Block(ctx, data);
+    }
+    memcpy(ctx->buffer, data, size);
+    ctx->used = (DWORD) size;
+}
+
+static void
+Sha256Final(SHA256CONTEXT *ctx, unsigned char *hash)
+{
+    ULONGLONG bits = ctx->length * 8;
+    int i;
+
+    ctx->buffer[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->buffer + ctx->used, 0, 64 - ctx->used);
+        Sha256Block(ctx, ctx->buffer);
+        ctx->used = 0;
+    }
+    memset(ctx->buffer + ctx->used, 0, 56 - ctx->used);
+    for (i=0; i<8; i++) {
+        ctx->buffer[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+    }
+    Sha256Block(ctx, ctx->buffer);
+
+    for (i=0; i<32; i++) {
+        hash[i] = (unsigned char) (ctx->state[i / 4] >> (24 - (i % 4) * 8));
+    }
+}
+
+// Integrity checks computed while the sections are copied, every byte of the
+// file is processed once and in order.
+typedef struct {
+    BOOL checksum;
+    BOOL hash;
+    // file offset of the "CheckSum" field, which counts as zero
+    size_t checksumOffset;
+    ULONGLONG checksumSum;
+    BOOL checksumOdd;
+    SHA256CONTEXT sha;
+    unsigned char digest[MEMORY_SHA256_SIZE];
+    // file offset up to which the data has been processed
+    size_t verified;
+} VERIFYSTATE;
+
+// Add data to the PE checksum, a sum of 16bit words with end-around carry.
+static void
+UpdateChecksum(VERIFYSTATE *verify, const unsigned char *data, size_t size)
+{
+    ULONGLONG sum = verify->checksumSum;
+    if (size > 0 && verify->checksumOdd) {
+        // high byte of the word started by the previous data
+        sum += (ULONGLONG) data[0] << 8;
+        data++;
+        size--;
+        verify->checksumOdd = FALSE;
+    }
+    for (; size >= 2; size -= 2, data += 2) {
+        sum += (ULONGLONG) (data[0] | (data[1] << 8));
+    }
+    if (size > 0) {
+        sum += data[0];
+        verify->checksumOdd = TRUE;
+    }
+    verify->checksumSum = sum;
+}
+
+// Process the file data from "verify->verified" to "end", "src" points to
+// the data at "verify->verified". Sections in file order are processed from
+// their copy in the image while it is still in the cache, the headers, gaps
+// and sections out of file order from the caller's data. The result only
+// applies to the loaded module if the caller's data doesn't change during
+// the load.
+static void
+VerifyRange(VERIFYSTATE *verify, const unsigned char *src, size_t end)
+{
+    static const unsigned char zero[4] = {0, 0, 0, 0};
+    size_t start = verify->verified;
+    if (end <= start) {
+        return;
+    }
+
+    if (verify->hash) {
+        Sha256Update(&verify->sha, src, end - start);
+    }
+    if (verify->checksum) {
+        size_t field = verify->checksumOffset;
+        if (start < field + 4 && end > field) {
+            size_t first = (start > field) ? start : field;
+            size_t last = (end < field + 4) ? end : field + 4;
+            UpdateChecksum(verify, src, first - start);
+            UpdateChecksum(verify, zero, last - first);
+            UpdateChecksum(verify, src + (last - start), end - last);
+        } else {
+            UpdateChecksum(verify, src, end - start);
+        }
+    }
+    verify->verified = end;
+}
+
+static BOOL
+IsHashAllowed(const unsigned char *hash, const MEMORYLOADOPTIONS *options)
+{
+    DWORD i;
+    for (i=0; i<options->numAllowedHashes; i++) {
+        if (memcmp(options->allowedHashes[i].hash, hash, MEMORY_SHA256_SIZE) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL
+FinishVerification(VERIFYSTATE *verify, const unsigned char *data, size_t size,
+    PIMAGE_NT_HEADERS headers, const MEMORYLOADOPTIONS *options)
+{
+    VerifyRange(verify, data + verify->verified, size);
+    if (verify->checksum) {
+        ULONGLONG sum = verify->checksumSum;
+        while (sum >> 16) {
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        // images without checksum can't be verified
+        if (headers->OptionalHeader.CheckSum == 0 ||
+            (DWORD) (sum + size) != headers->OptionalHeader.CheckSum) {
+            SetLastError(ERROR_INVALID_IMAGE_HASH);
+            return FALSE;
+        }
+    }
+    if (verify->hash) {
+        Sha256Final(&verify->sha, verify->digest);
+        if (options != NULL && options->numAllowedHashes > 0 &&
+            !IsHashAllowed(verify->digest, options)) {
+            SetLastError(ERROR_INVALID_IMAGE_HASH);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Data is verified in chunks right after they have been copied, while they
+// are still in the cache.
+#define VERIFY_CHUNK    (64 * 1024)
+
+// State of a range copied by the thread pool. It is shared by the loading
+// thread and the queued workers, the last one to release it frees it. The
+// loading thread never waits for workers that have not started yet: they
+// find no chunks left when they run late, so loads under the loader lock or
+// with a busy pool don't depend on them.
+typedef struct {
+    volatile LONG refCount;
+    unsigned char *dest;
+    const unsigned char *src;
+    size_t size;
+    BOOL stream;
+    LONG numChunks;
+    volatile LONG nextChunk;
+    // one flag per chunk, set once the chunk has been copied
+    volatile LONG copied[1];
+} PARALLEL_COPY;
+
+static void
+ReleaseParallelCopy(PARALLEL_COPY *copy)
+{
+    if (InterlockedDecrement(&copy->refCount) == 0) {
+        HeapFree(GetProcessHeap(), 0, copy);
+    }
+}
+
+// Copy the next unclaimed chunk, returns FALSE if all chunks are claimed.
+static BOOL
+CopyNextChunk(PARALLEL_COPY *copy)
+{
+    LONG chunk = InterlockedIncrement(&copy->nextChunk) - 1;
+    size_t offset, size;
+    if (chunk >= copy->numChunks) {
+        return FALSE;
+    }
+
+    offset = (size_t) chunk * PARALLEL_COPY_CHUNK;
+    size = copy->size - offset;
+    if (size > PARALLEL_COPY_CHUNK) {
+        size = PARALLEL_COPY_CHUNK;
+    }
+    CopyData(copy->dest + offset, copy->src + offset, size, copy->stream);
+    InterlockedExchange(&copy->copied[chunk], 1);
+    return TRUE;
+}
+
+static DWORD WINAPI
+CopyChunksWorker(LPVOID param)
+{
+    PARALLEL_COPY *copy = (PARALLEL_COPY *) param;
+    while (CopyNextChunk(copy)) {
+    }
+    ReleaseParallelCopy(copy);
+    return 0;
+}
+
+// Verify the chunks following "*next" that have been copied already, or
+// wait for them if "wait" is TRUE. Only chunks claimed by running workers
+// are waited for.
+static void
+VerifyCopiedChunks(PARALLEL_COPY *copy, LONG *next, VERIFYSTATE *verify, size_t offset, BOOL wait)
+{
+    while (*next < copy->numChunks) {
+        size_t end;
+        if (!copy->copied[*next]) {
+            if (!wait) {
+                break;
+            }
+            SwitchToThread();
+            continue;
+        }
+
+        MemoryBarrier();
+        end = (size_t) (*next + 1) * PARALLEL_COPY_CHUNK;
+        if (end > copy->size) {
+            end = copy->size;
+        }
+        if (verify != NULL) {
+            VerifyRange(verify, copy->dest + (size_t) *next * PARALLEL_COPY_CHUNK, offset + end);
+        }
+        (*next)++;
+    }
+}
+
+// Copy "size" bytes from file offset "offset" to "dest" and verify them if
+// "verify" is not NULL. Large ranges are copied with help of the thread
+// pool, the calling thread copies as well and verifies the chunks in order
+// as soon as they are complete.
+static void
+CopyRange(unsigned char *dest, const unsigned char *data, size_t offset, size_t size, VERIFYSTATE *verify)
+{
+    PARALLEL_COPY *copy = NULL;
+    SYSTEM_INFO sysInfo;
+    LONG numChunks = (LONG) ((size + PARALLEL_COPY_CHUNK - 1) / PARALLEL_COPY_CHUNK);
+    LONG numWorkers = 0;
+    LONG next = 0;
+    LONG i;
+
+    if (size >= PARALLEL_COPY_THRESHOLD) {
+        GetSystemInfo(&sysInfo);
+        // the calling thread copies as well
+        numWorkers = (LONG) sysInfo.dwNumberOfProcessors - 1;
+        if (numWorkers > numChunks - 1) {
+            numWorkers = numChunks - 1;
+        }
+        if (numWorkers > 0) {
+            copy = (PARALLEL_COPY *) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                FIELD_OFFSET(PARALLEL_COPY, copied) + numChunks * sizeof(LONG));
+        }
+    }
+
+    if (copy == NULL) {
+        BOOL stream = UseStreamCopy(size);
+        size_t pos, count;
+        if (verify == NULL) {
+            CopyData(dest, data + offset, size, stream);
+            return;
+        }
+
+        for (pos=0; pos<size; pos+=count) {
+            count = size - pos;
+            if (count > VERIFY_CHUNK) {
+                count = VERIFY_CHUNK;
+            }
+            CopyData(dest + pos, data + offset + pos, count, stream);
+            VerifyRange(verify, dest + pos, offset + pos + count);
+        }
+        return;
+    }
+
+    copy->dest = dest;
+    copy->src = data + offset;
+    copy->size = size;
+    copy->stream = UseStreamCopy(size);
+    copy->numChunks = numChunks;
+    copy->refCount = numWorkers + 1;
+    for (i=0; i<numWorkers; i++) {
+        if (!QueueUserWorkItem(CopyChunksWorker, copy, WT_EXECUTEDEFAULT)) {
+            // the reference of the calling thread is still held
+            InterlockedDecrement(&copy->refCount);
+        }
+    }
+
+    while (CopyNextChunk(copy)) {
+        VerifyCopiedChunks(copy, &next, verify, offset, FALSE);
+    }
+    VerifyCopiedChunks(copy, &next, verify, offset, TRUE);
+    ReleaseParallelCopy(copy);
+}
+
+// Copy the raw data of all sections. The image memory has been committed
+// completely when it was reserved and is still zero, so uninitialized data
+// needs no work and sections that are contiguous in the file and in memory
+// (i.e. file and section alignment match) are copied together. Memory of
+// custom allocators might not be zero, the uninitialized data of their
+// sections is cleared explicitly.
+//
+// Integrity checks requested in the flags or options of the module are
+// computed while copying and fail the load with ERROR_INVALID_IMAGE_HASH.
+// The hash of shared modules is computed the same way. Parts of the file
+// are verified from the caller's data, which must not change until the
+// load returns (see VerifyRange).
+static BOOL
+CopySections(const unsigned char *data, size_t size, PMEMORYMODULE module, const MEMORYLOADOPTIONS *options)
+{
+    int i;
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(module->headers);
+    DWORD runStart = 0, runEnd = 0, runOffset = 0;
+    DWORD imageSize = module->headers->OptionalHeader.SizeOfImage;
+    BOOL zeroFill = module->alloc != MemoryDefaultAlloc && module->alloc != MemoryPoolAlloc;
+    VERIFYSTATE state;
+    VERIFYSTATE *verify = NULL;
+
+    if ((module->flags & (MEMORY_LOAD_VERIFY_CHECKSUM | MEMORY_LOAD_SHARED)) ||
+        (options != NULL && options->numAllowedHashes > 0)) {
+        memset(&state, 0, sizeof(state));
+        state.checksum = (module->flags & MEMORY_LOAD_VERIFY_CHECKSUM) != 0;
+        state.checksumOffset = ((PIMAGE_DOS_HEADER) data)->e_lfanew +
+            FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader.CheckSum);
+        state.hash = (module->flags & MEMORY_LOAD_SHARED) || (options != NULL && options->numAllowedHashes > 0);
+        Sha256Init(&state.sha);
+        verify = &state;
+    }
+
+    for (i=0; i<=module->headers->FileHeader.NumberOfSections; i++, section++) {
+        BOOL last = (i == module->headers->FileHeader.NumberOfSections);
+        if (!last) {
+            if (zeroFill) {
+                uintptr_t start = (uintptr_t) section->VirtualAddress + section->SizeOfRawData;
+                uintptr_t end = AlignValueUp((uintptr_t) section->VirtualAddress +
+                    (section->Misc.VirtualSize > section->SizeOfRawData ? section->Misc.VirtualSize : section->SizeOfRawData),
+                    module->headers->OptionalHeader.SectionAlignment);
+                if (end > imageSize) {
+                    end = imageSize;
+                }
+                if (start < end) {
+                    memset(codeBase + start, 0, end - start);
+                }
+            }
+            // NOTE: On 64bit systems we truncate to 32bit here but expand
+            // again later when "PhysicalAddress" is used.
+            section->Misc.PhysicalAddress = (DWORD) ((uintptr_t) (codeBase + section->VirtualAddress) & 0xffffffff);
+            if (section->SizeOfRawData == 0) {
+                // section doesn't contain data in the dll itself, but may
+                // define uninitialized data
+                continue;
+            }
+
+            if (!CheckSize(size, section->PointerToRawData + section->SizeOfRawData)) {
+                return FALSE;
+            }
+
+            if (runEnd != runStart && section->VirtualAddress == runEnd &&
+                section->PointerToRawData == runOffset + (runEnd - runStart)) {
+                // extend the current run
+                runEnd += section->SizeOfRawData;
+                continue;
+            }
+        }
+
+        if (runEnd != runStart) {
+            if (verify != NULL && runOffset >= verify->verified) {
+                // data before the run (e.g. the headers) is not copied here
+                VerifyRange(verify, data + verify->verified, runOffset);
+                CopyRange(codeBase + runStart, data, runOffset, runEnd - runStart, verify);
+            } else {
+                // sections out of file order are verified with the data
+                // following the last section
+                CopyRange(codeBase + runStart, data, runOffset, runEnd - runStart, NULL);
+            }
+            LOADSTATS_ADD(module, bytesCopied, runEnd - runStart);
+        }
+        if (!last) {
+            runStart = section->VirtualAddress;
+            runEnd = runStart + section->SizeOfRawData;
+            runOffset = section->PointerToRawData;
+        }
+    }
+
+    if (verify != NULL) {
+        if (!FinishVerification(verify, data, size, module->headers, options)) {
+            return FALSE;
+        }
+        memcpy(module->imageHash.hash, verify->digest, MEMORY_SHA256_SIZE);
+    }
+    return TRUE;
+}
+
+// Protection flags for memory pages (Executable, Readable, Writeable)
+static int ProtectionFlags[2][2][2] = {
+    {
+        // not executable
+        {PAGE_NOACCESS, PAGE_WRITECOPY},
+        {PAGE_READONLY, PAGE_READWRITE},
+    }, {
+        // executable
+        {PAGE_EXECUTE, PAGE_EXECUTE_WRITECOPY},
+        {PAGE_EXECUTE_READ, PAGE_EXECUTE_READWRITE},
+    },
+};
+
+static SIZE_T
+GetRealSectionSize(PIMAGE_NT_HEADERS headers, PIMAGE_SECTION_HEADER section) {
+    DWORD size = section->SizeOfRawData;
+    if (size == 0) {
+        if (section->Characteristics & IMAGE_SCN_CNT_INITIALIZED_DATA) {
+            size = headers->OptionalHeader.SizeOfInitializedData;
+        } else if (section->Characteristics & IMAGE_SCN_CNT_UNINITIALIZED_DATA) {
+            size = headers->OptionalHeader.SizeOfUninitializedData;
+        }
+    }
+    return (SIZE_T) size;
+}
+
+static DWORD
+GetSectionProtection(DWORD characteristics) {
+    // determine protection flags based on characteristics
+    BOOL executable = (characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+    BOOL readable =   (characteristics & IMAGE_SCN_MEM_READ) != 0;
+    BOOL writeable =  (characteristics & IMAGE_SCN_MEM_WRITE) != 0;
+    DWORD protect = ProtectionFlags[executable][readable][writeable];
+    if (characteristics & IMAGE_SCN_MEM_NOT_CACHED) {
+        protect |= PAGE_NOCACHE;
+    }
+    return protect;
+}
+
+typedef struct {
+    DWORD characteristics;
+    BOOL used;
+} PAGEINFO;
+
+// Compute the protection of every page of the image. Only pages that are
+// shared by several sections combine their flags, a page is discardable if
+// all sections on it are discardable. Pages with the same protection are
+// merged into ranges. Pages that don't belong to any section (e.g. the
+// headers) are not part of the map.
+static BOOL
+BuildProtectionMap(PIMAGE_NT_HEADERS headers, SIZE_T pageSize, SIZE_T imageSize,
+    BOOL allowDecommit, MEMORYPROTECTIONRANGE **map, DWORD *count)
+{
+    DWORD numPages = (DWORD) (AlignValueUp(imageSize, pageSize) / pageSize);
+    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(headers);
+    MEMORYPROTECTIONRANGE *ranges;
+    MEMORYPROTECTIONRANGE *range = NULL;
+    PAGEINFO *pages;
+    DWORD numRanges = 0;
+    DWORD i, page;
+
+    *map = NULL;
+    *count = 0;
+    if (numPages == 0) {
+        return TRUE;
+    }
+
+    pages = (PAGEINFO *) calloc(numPages, sizeof(PAGEINFO));
+    if (pages == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    for (i=0; i<headers->FileHeader.NumberOfSections; i++, section++) {
+        SIZE_T sectionSize = GetRealSectionSize(headers, section);
+        DWORD first, last;
+        if (sectionSize == 0) {
+            continue;
+        }
+
+        first = (DWORD) (section->VirtualAddress / pageSize);
+        last = (DWORD) ((AlignValueUp(section->VirtualAddress + sectionSize, pageSize) / pageSize));
+        if (last > numPages) {
+            last = numPages;
+        }
+        for (page=first; page<last; page++) {
+            if (!pages[page].used) {
+                pages[page].characteristics = section->Characteristics;
+                pages[page].used = TRUE;
+            } else if ((section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE) == 0 || (pages[page].characteristics & IMAGE_SCN_MEM_DISCARDABLE) == 0) {
+                pages[page].characteristics = (pages[page].characteristics | section->Characteristics) & ~IMAGE_SCN_MEM_DISCARDABLE;
+            } else {
+                pages[page].characteristics |= section->Characteristics;
+            }
+        }
+    }
+
+    // worst case is a range per page
+    ranges = (MEMORYPROTECTIONRANGE *) malloc(numPages * sizeof(MEMORYPROTECTIONRANGE));
+    if (ranges == NULL) {
+        free(pages);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    for (page=0; page<numPages; page++) {
+        DWORD protect;
+        BOOL discard;
+        if (!pages[page].used) {
+            range = NULL;
+            continue;
+        }
+
+        discard = allowDecommit && (pages[page].characteristics & IMAGE_SCN_MEM_DISCARDABLE) != 0;
+        protect = discard ? PAGE_NOACCESS : GetSectionProtection(pages[page].characteristics);
+        if (range != NULL && range->protect == protect && range->decommitted == discard) {
+            range->size += (DWORD) pageSize;
+            continue;
+        }
+
+        range = &ranges[numRanges++];
+        range->rva = (DWORD) (page * pageSize);
+        range->size = (DWORD) pageSize;
+        range->protect = protect;
+        range->decommitted = discard;
+    }
+    free(pages);
+
+    *map = ranges;
+    *count = numRanges;
+    return TRUE;
+}
+
+static BOOL
+FinalizeSections(PMEMORYMODULE module, SIZE_T imageSize)
+{
+    DWORD i;
+    BOOL result;
+    if (module->flags & MEMORY_LOAD_LARGE_PAGES) {
+        // Protections can only be changed for complete large pages, which
+        // also can't be decommitted.
+        result = BuildProtectionMap(module->headers, GetLargePageSize(), imageSize, FALSE,
+            &module->protectionMap, &module->numProtectionRanges);
+    } else if (module->image != NULL && module->image->numProtectionRanges > 0) {
+        // the map is modified when the module is trimmed, use a private copy
+        SIZE_T mapSize = module->image->numProtectionRanges * sizeof(MEMORYPROTECTIONRANGE);
+        module->protectionMap = (MEMORYPROTECTIONRANGE *) malloc(mapSize);
+        if (module->protectionMap == NULL) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return FALSE;
+        }
+        memcpy(module->protectionMap, module->image->protectionMap, mapSize);
+        module->numProtectionRanges = module->image->numProtectionRanges;
+        result = TRUE;
+    } else {
+        result = BuildProtectionMap(module->headers, module->pageSize, imageSize, TRUE,
+            &module->protectionMap, &module->numProtectionRanges);
+    }
+    if (!result) {
+        return FALSE;
+    }
+
+    // change access flags with one call per range
+    for (i=0; i<module->numProtectionRanges; i++) {
+        MEMORYPROTECTIONRANGE *range = &module->protectionMap[i];
+        DWORD oldProtect;
+        if (range->decommitted) {
+            // pages only contain discardable sections and can safely be freed
+            module->free(module->codeBase + range->rva, range->size, MEM_DECOMMIT, module->userdata);
+            LOADSTATS_ADD(module, pagesDecommitted, range->size / module->pageSize);
+            continue;
+        }
+
+        LOADSTATS_ADD(module, protectCalls, 1);
+        if (VirtualProtect(module->codeBase + range->rva, range->size, range->protect, &oldProtect) == 0) {
+            OutputLastError("Error protecting memory page");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static const MEMORYPROTECTIONRANGE *
+FindProtectionRange(PMEMORYMODULE module, DWORD rva)
+{
+    DWORD start = 0;
+    DWORD end = module->numProtectionRanges;
+    // ranges are sorted by address
+    while (end > start) {
+        DWORD middle = (start + end) >> 1;
+        const MEMORYPROTECTIONRANGE *range = &module->protectionMap[middle];
+        if (rva < range->rva) {
+            end = middle;
+        } else if (rva - range->rva >= range->size) {
+            start = middle + 1;
+        } else {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+static BOOL
+IsDecommitted(PMEMORYMODULE module, DWORD rva)
+{
+    const MEMORYPROTECTIONRANGE *range = FindProtectionRange(module, rva);
+    return range != NULL && range->decommitted;
+}
+
+typedef struct RVARANGE {
+    DWORD start;
+    DWORD end;
+} RVARANGE;
+
+typedef struct {
+    RVARANGE *ranges;
+    DWORD count;
+    DWORD capacity;
+    DWORD imageSize;
+} RVARANGELIST;
+
+static BOOL
+AddRvaRange(RVARANGELIST *list, DWORD start, DWORD size)
+{
+    if (size == 0 || start >= list->imageSize || size > list->imageSize - start) {
+        // ignore invalid ranges, the pages are simply kept
+        return TRUE;
+    }
+
+    if (list->count == list->capacity) {
+        DWORD capacity = list->capacity ? list->capacity * 2 : 64;
+        RVARANGE *tmp = (RVARANGE *) realloc(list->ranges, capacity * sizeof(RVARANGE));
+        if (tmp == NULL) {
+            return FALSE;
+        }
+        list->ranges = tmp;
+        list->capacity = capacity;
+    }
+    list->ranges[list->count].start = start;
+    list->ranges[list->count].end = start + size;
+    list->count++;
+    return TRUE;
+}
+
+static int _compareRvaRange(const void *a, const void *b)
+{
+    const RVARANGE *r1 = (const RVARANGE *) a;
+    const RVARANGE *r2 = (const RVARANGE *) b;
+    if (r1->start < r2->start) {
+        return -1;
+    } else if (r1->start > r2->start) {
+        return 1;
+    }
+    return 0;
+}
+
+// Collect the data that is only needed while loading: base relocations,
+// import descriptors, names of imported libraries and functions and the
+// "OriginalFirstThunk" arrays. The "FirstThunk" arrays (IAT) stay.
+static BOOL
+CollectLoaderData(PMEMORYMODULE module, RVARANGELIST *list)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_DATA_DIRECTORY directory;
+    PIMAGE_IMPORT_DESCRIPTOR importDesc;
+
+    directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_BASERELOC);
+    if (!AddRvaRange(list, directory->VirtualAddress, directory->Size)) {
+        return FALSE;
+    }
+
+    directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_IMPORT);
+    if (directory->Size == 0 || IsDecommitted(module, directory->VirtualAddress)) {
+        // no imports or stored in a discardable section that is gone already
+        return TRUE;
+    }
+
+    importDesc = (PIMAGE_IMPORT_DESCRIPTOR) (codeBase + directory->VirtualAddress);
+    for (; importDesc->Name; importDesc++) {
+        uintptr_t *thunkRef;
+        DWORD count = 0;
+        if (IsDecommitted(module, importDesc->Name)) {
+            continue;
+        }
+        if (!AddRvaRange(list, importDesc->Name, (DWORD) strlen((LPCSTR) (codeBase + importDesc->Name)) + 1)) {
+            return FALSE;
+        }
+
+        if (!importDesc->OriginalFirstThunk || importDesc->OriginalFirstThunk == importDesc->FirstThunk ||
+            IsDecommitted(module, importDesc->OriginalFirstThunk)) {
+            // names have been overwritten by the resolved addresses
+            continue;
+        }
+
+        thunkRef = (uintptr_t *) (codeBase + importDesc->OriginalFirstThunk);
+        for (; *thunkRef; thunkRef++, count++) {
+            PIMAGE_IMPORT_BY_NAME thunkData;
+            if (IMAGE_SNAP_BY_ORDINAL(*thunkRef)) {
+                continue;
+            }
+
+            // entries are padded to an even size
+            thunkData = (PIMAGE_IMPORT_BY_NAME) (codeBase + (*thunkRef));
+            if (!AddRvaRange(list, (DWORD) *thunkRef, (DWORD) AlignValueUp(sizeof(WORD) + strlen((LPCSTR) &thunkData->Name) + 1, 2))) {
+                return FALSE;
+            }
+        }
+        if (!AddRvaRange(list, importDesc->OriginalFirstThunk, (count + 1) * sizeof(uintptr_t))) {
+            return FALSE;
+        }
+    }
+
+    // descriptors including the terminating empty entry
+    return AddRvaRange(list, directory->VirtualAddress,
+        (DWORD) ((unsigned char *) (importDesc + 1) - (codeBase + directory->VirtualAddress)));
+}
+
+static int _compareRva(const void *a, const void *b)
+{
+    DWORD r1 = *(const DWORD *) a;
+    DWORD r2 = *(const DWORD *) b;
+    return (r1 > r2) - (r1 < r2);
+}
+
+// Keep the loader data that is needed to recreate pages after the module
+// has been trimmed: the sorted RVAs of the applied relocations (like
+// MEMORYIMAGE, 32bit ones first) and the ranges of the import address
+// tables. Relocations are only kept if the module was relocated.
+static BOOL
+KeepLoaderData(PMEMORYMODULE module)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_DATA_DIRECTORY directory;
+    RVARANGELIST list;
+
+    if (module->loaderDataKept) {
+        return TRUE;
+    }
+
+    directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_BASERELOC);
+    if (module->locationDelta != 0 && directory->Size != 0 && !IsDecommitted(module, directory->VirtualAddress)) {
+        DWORD maxRelocations = directory->Size / sizeof(WORD);
+        DWORD count32 = 0, count64 = 0;
+        PIMAGE_BASE_RELOCATION relocation = (PIMAGE_BASE_RELOCATION) (codeBase + directory->VirtualAddress);
+        DWORD *relocations = (DWORD *) malloc(maxRelocations * sizeof(DWORD));
+        DWORD *tmp;
+        if (relocations == NULL) {
+            return FALSE;
+        }
+
+        for (; relocation->VirtualAddress > 0; ) {
+            const WORD *relInfo = (const WORD *) OffsetPointer(relocation, IMAGE_SIZEOF_BASE_RELOCATION);
+            DWORD i;
+            for (i=0; i<((relocation->SizeOfBlock-IMAGE_SIZEOF_BASE_RELOCATION) / 2); i++, relInfo++) {
+                switch (*relInfo >> 12)
+                {
+                case IMAGE_REL_BASED_HIGHLOW:
+                    relocations[count32++] = relocation->VirtualAddress + (*relInfo & 0xfff);
+                    break;
+
+#ifdef _WIN64
+                case IMAGE_REL_BASED_DIR64:
+                    // collected from the end, moved behind the 32bit ones below
+                    relocations[maxRelocations - ++count64] = relocation->VirtualAddress + (*relInfo & 0xfff);
+                    break;
+#endif
+
+                default:
+                    // skipped like in PerformBaseRelocation
+                    break;
+                }
+            }
+            relocation = (PIMAGE_BASE_RELOCATION) OffsetPointer(relocation, relocation->SizeOfBlock);
+        }
+
+        memmove(relocations + count32, relocations + maxRelocations - count64, count64 * sizeof(DWORD));
+        qsort(relocations, count32, sizeof(DWORD), _compareRva);
+        qsort(relocations + count32, count64, sizeof(DWORD), _compareRva);
+        if (count32 + count64 == 0) {
+            free(relocations);
+            relocations = NULL;
+        } else if ((tmp = (DWORD *) realloc(relocations, (count32 + count64) * sizeof(DWORD))) != NULL) {
+            relocations = tmp;
+        }
+        module->relocations = relocations;
+        module->numRelocations32 = count32;
+        module->numRelocations64 = count64;
+    }
+
+    memset(&list, 0, sizeof(list));
+    list.imageSize = module->headers->OptionalHeader.SizeOfImage;
+    directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_IAT);
+    if (!AddRvaRange(&list, directory->VirtualAddress, directory->Size)) {
+        goto error;
+    }
+    directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_IMPORT);
+    if (directory->Size != 0 && !IsDecommitted(module, directory->VirtualAddress)) {
+        PIMAGE_IMPORT_DESCRIPTOR importDesc = (PIMAGE_IMPORT_DESCRIPTOR) (codeBase + directory->VirtualAddress);
+        for (; importDesc->Name; importDesc++) {
+            const uintptr_t *funcRef = (const uintptr_t *) (codeBase + importDesc->FirstThunk);
+            DWORD count = 0;
+            for (; *funcRef; funcRef++) {
+                count++;
+            }
+            if (!AddRvaRange(&list, importDesc->FirstThunk, count * sizeof(uintptr_t))) {
+                goto error;
+            }
+        }
+    }
+    qsort(list.ranges, list.count, sizeof(RVARANGE), _compareRvaRange);
+    module->importThunks = list.ranges;
+    module->numImportThunks = list.count;
+    module->loaderDataKept = TRUE;
+    return TRUE;
+
+error:
+    free(list.ranges);
+    free(module->relocations);
+    module->relocations = NULL;
+    module->numRelocations32 = module->numRelocations64 = 0;
+    return FALSE;
+}
+
+// Mark a page aligned range in the protection map as decommitted.
+static BOOL
+MarkDecommitted(PMEMORYMODULE module, DWORD rva, DWORD size)
+{
+    DWORD end = rva + size;
+    DWORD i, count = 0;
+    BOOL inserted = FALSE;
+    MEMORYPROTECTIONRANGE *ranges = (MEMORYPROTECTIONRANGE *) malloc((module->numProtectionRanges * 2 + 1) * sizeof(MEMORYPROTECTIONRANGE));
+    if (ranges == NULL) {
+        return FALSE;
+    }
+
+    for (i=0; i<module->numProtectionRanges; i++) {
+        MEMORYPROTECTIONRANGE range = module->protectionMap[i];
+        DWORD rangeEnd = range.rva + range.size;
+        if (rangeEnd <= rva || range.rva >= end) {
+            // not affected
+            if (!inserted && range.rva >= end) {
+                ranges[count].rva = rva;
+                ranges[count].size = size;
+                ranges[count].protect = PAGE_NOACCESS;
+                ranges[count].decommitted = TRUE;
+                count++;
+                inserted = TRUE;
+            }
+            ranges[count++] = range;
+            continue;
+        }
+
+        if (range.rva < rva) {
+            ranges[count] = range;
+            ranges[count].size = rva - range.rva;
+            count++;
+        }
+        if (!inserted) {
+            ranges[count].rva = rva;
+            ranges[count].size = size;
+            ranges[count].protect = PAGE_NOACCESS;
+            ranges[count].decommitted = TRUE;
+            count++;
+            inserted = TRUE;
+        }
+        if (rangeEnd > end) {
+            ranges[count] = range;
+            ranges[count].rva = end;
+            ranges[count].size = rangeEnd - end;
+            count++;
+        }
+    }
+    if (!inserted) {
+        ranges[count].rva = rva;
+        ranges[count].size = size;
+        ranges[count].protect = PAGE_NOACCESS;
+        ranges[count].decommitted = TRUE;
+        count++;
+    }
+
+    free(module->protectionMap);
+    module->protectionMap = ranges;
+    module->numProtectionRanges = count;
+    return TRUE;
+}
+
+static SIZE_T
+TrimModule(PMEMORYMODULE module)
+{
+    RVARANGELIST list;
+    SIZE_T released = 0;
+    DWORD i;
+
+    if (module->trimmed || (module->flags & MEMORY_LOAD_LARGE_PAGES)) {
+        // large pages can't be decommitted partially
+        return 0;
+    }
+
+    memset(&list, 0, sizeof(list));
+    list.imageSize = module->headers->OptionalHeader.SizeOfImage;
+    if (!KeepLoaderData(module) || !CollectLoaderData(module, &list)) {
+        free(list.ranges);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return 0;
+    }
+
+    // merge touching ranges and release all pages that are covered completely
+    qsort(list.ranges, list.count, sizeof(RVARANGE), _compareRvaRange);
+    i = 0;
+    while (i < list.count) {
+        DWORD start = list.ranges[i].start;
+        DWORD end = list.ranges[i].end;
+        uintptr_t pageStart, pageEnd;
+        for (i++; i < list.count && list.ranges[i].start <= end; i++) {
+            if (list.ranges[i].end > end) {
+                end = list.ranges[i].end;
+            }
+        }
+
+        pageStart = AlignValueUp(start, module->pageSize);
+        pageEnd = AlignValueDown(end, module->pageSize);
+        while (pageStart < pageEnd) {
+            // skip pages that have been decommitted already
+            uintptr_t runEnd;
+            if (IsDecommitted(module, (DWORD) pageStart)) {
+                pageStart += module->pageSize;
+                continue;
+            }
+
+            runEnd = pageStart + module->pageSize;
+            while (runEnd < pageEnd && !IsDecommitted(module, (DWORD) runEnd)) {
+                runEnd += module->pageSize;
+            }
+            // The map must be updated before the pages are gone, so they
+            // are never accessed while marked as committed. If decommitting
+            // fails afterwards, the pages are only ignored.
+            if (!MarkDecommitted(module, (DWORD) pageStart, (DWORD) (runEnd - pageStart))) {
+                free(list.ranges);
+                module->trimmedBytes += released;
+                SetLastError(ERROR_OUTOFMEMORY);
+                return released;
+            }
+            if (module->free(module->codeBase + pageStart, runEnd - pageStart, MEM_DECOMMIT, module->userdata)) {
+                released += runEnd - pageStart;
+                LOADSTATS_ADD(module, pagesDecommitted, (runEnd - pageStart) / module->pageSize);
+            }
+            pageStart = runEnd;
+        }
+    }
+    free(list.ranges);
+
+    module->trimmed = TRUE;
+    module->trimmedBytes += released;
+    return released;
+}
+
+static BOOL
+ExecuteTLS(PMEMORYMODULE module, DWORD reason)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_TLS_DIRECTORY tls;
+    PIMAGE_TLS_CALLBACK* callback;
+
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_TLS);
+    if (directory->VirtualAddress == 0) {
+        return TRUE;
+    }
+
+    tls = (PIMAGE_TLS_DIRECTORY) (codeBase + directory->VirtualAddress);
+    callback = (PIMAGE_TLS_CALLBACK *) tls->AddressOfCallBacks;
+    if (callback) {
+        while (*callback) {
+            (*callback)((LPVOID) codeBase, reason, NULL);
+            callback++;
+        }
+    }
+    return TRUE;
+}
+
+static BOOL
+PerformBaseRelocation(PMEMORYMODULE module, ptrdiff_t delta)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_BASE_RELOCATION relocation;
+    DWORD count = 0;
+
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_BASERELOC);
+    if (directory->Size == 0) {
+        return (delta == 0);
+    }
+
+    relocation = (PIMAGE_BASE_RELOCATION) (codeBase + directory->VirtualAddress);
+    for (; relocation->VirtualAddress > 0; ) {
+        DWORD i;
+        unsigned char *dest = codeBase + relocation->VirtualAddress;
+        unsigned short *relInfo = (unsigned short*) OffsetPointer(relocation, IMAGE_SIZEOF_BASE_RELOCATION);
+        for (i=0; i<((relocation->SizeOfBlock-IMAGE_SIZEOF_BASE_RELOCATION) / 2); i++, relInfo++) {
+            // the upper 4 bits define the type of relocation
+            int type = *relInfo >> 12;
+            // the lower 12 bits define the offset
+            int offset = *relInfo & 0xfff;
+
+            switch (type)
+            {
+            case IMAGE_REL_BASED_ABSOLUTE:
+                // skip relocation
+                break;
+
+            case IMAGE_REL_BASED_HIGHLOW:
+                // change complete 32 bit address
                 {
                     DWORD *patchAddrHL = (DWORD *) (dest + offset);
                     *patchAddrHL += (DWORD) delta;
+                    count++;
+                }
+                break;
+
+#ifdef _WIN64
+            case IMAGE_REL_BASED_DIR64:
+                {
+                    ULONGLONG *patchAddr64 = (ULONGLONG *) (dest + offset);
+                    *patchAddr64 += (ULONGLONG) delta;
+                    count++;
+                }
+                break;
+#endif
+
+            default:
+                //printf("Unknown relocation: %d\n", type);
+                break;
+            }
+        }
+
+        // advance to next relocation block
+        relocation = (PIMAGE_BASE_RELOCATION) OffsetPointer(relocation, relocation->SizeOfBlock);
+    }
+    module->numRelocations = count;
+    return TRUE;
+}
+
+static BOOL
+RegisterExceptionHandling(PMEMORYMODULE module)
+{
+#ifdef _WIN64
+    PRUNTIME_FUNCTION pEntry;
+    DWORD count;
+    PIMAGE_DATA_DIRECTORY pDir = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXCEPTION);
+    if (pDir->Size == 0) {
+        return TRUE;
+    }
+
+    pEntry = (PRUNTIME_FUNCTION)(module->codeBase + pDir->VirtualAddress);
+    count = (pDir->Size / sizeof(RUNTIME_FUNCTION));
+    return RtlAddFunctionTable(pEntry, count, (DWORD64) module->codeBase);
+#else
+    // TODO(fancycode): Support 32bit exception handling.
+    return TRUE;
+#endif
+}
+
+static BOOL
+UnregisterExceptionHandling(PMEMORYMODULE module)
+{
+#ifdef _WIN64
+    PRUNTIME_FUNCTION pEntry;
+    PIMAGE_DATA_DIRECTORY pDir = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXCEPTION);
+    if (pDir->Size == 0) {
+        return TRUE;
+    }
+
+    pEntry = (PRUNTIME_FUNCTION)(module->codeBase + pDir->VirtualAddress);
+    return RtlDeleteFunctionTable(pEntry);
+#else
+    // TODO(fancycode): Support 32bit exception handling.
+    return TRUE;
+#endif
+}
+
+// "numImports" is the number of imported libraries if it is known already.
+static BOOL
+BuildImportTable(PMEMORYMODULE module, DWORD numImports)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_IMPORT_DESCRIPTOR importDesc;
+    BOOL result = TRUE;
+
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_IMPORT);
+    if (directory->Size == 0) {
+        return TRUE;
+    }
+
+    if (numImports > 0) {
+        module->modules = (HCUSTOMMODULE *) malloc(numImports * sizeof(HCUSTOMMODULE));
+        if (module->modules == NULL) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return FALSE;
+        }
+    }
+
+    importDesc = (PIMAGE_IMPORT_DESCRIPTOR) (codeBase + directory->VirtualAddress);
+    for (; !IsBadReadPtr(importDesc, sizeof(IMAGE_IMPORT_DESCRIPTOR)) && importDesc->Name; importDesc++) {
+        uintptr_t *thunkRef;
+        FARPROC *funcRef;
+        HCUSTOMMODULE *tmp;
+        HCUSTOMMODULE handle = module->loadLibrary((LPCSTR) (codeBase + importDesc->Name), module->userdata);
+        if (eventSink != NULL) {
+            EmitEvent(MEMORY_EVENT_DEPENDENCY, (HMEMORYMODULE) module, (LPCSTR) (codeBase + importDesc->Name),
+                0, handle, handle != NULL ? ERROR_SUCCESS : ERROR_MOD_NOT_FOUND);
+        }
+        if (handle == NULL) {
+            SetLastError(ERROR_MOD_NOT_FOUND);
+            result = FALSE;
+            break;
+        }
+
+        if ((DWORD) module->numModules >= numImports) {
+            tmp = (HCUSTOMMODULE *) realloc(module->modules, (module->numModules+1)*(sizeof(HCUSTOMMODULE)));
+            if (tmp == NULL) {
+                module->freeLibrary(handle, module->userdata);
+                SetLastError(ERROR_OUTOFMEMORY);
+                result = FALSE;
+                break;
+            }
+            module->modules = tmp;
+        }
+
+        module->modules[module->numModules++] = handle;
+        if (importDesc->OriginalFirstThunk) {
+            thunkRef = (uintptr_t *) (codeBase + importDesc->OriginalFirstThunk);
+            funcRef = (FARPROC *) (codeBase + importDesc->FirstThunk);
+        } else {
+            // no hint table
+            thunkRef = (uintptr_t *) (codeBase + importDesc->FirstThunk);
+            funcRef = (FARPROC *) (codeBase + importDesc->FirstThunk);
+        }
+        for (; *thunkRef; thunkRef++, funcRef++) {
+            if (IMAGE_SNAP_BY_ORDINAL(*thunkRef)) {
+                *funcRef = module->getProcAddress(handle, (LPCSTR)IMAGE_ORDINAL(*thunkRef), module->userdata);
+            } else {
+                PIMAGE_IMPORT_BY_NAME thunkData = (PIMAGE_IMPORT_BY_NAME) (codeBase + (*thunkRef));
+                *funcRef = module->getProcAddress(handle, (LPCSTR)&thunkData->Name, module->userdata);
+            }
+            if (*funcRef == 0) {
+                result = FALSE;
+                break;
+            }
+            LOADSTATS_ADD(module, importsResolved, 1);
+        }
+
+        if (!result) {
+            module->freeLibrary(handle, module->userdata);
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            break;
+        }
+    }
+
+    return result;
+}
+
+// Global index of the address ranges of all loaded modules, sorted by start
+// address. Lookups never lock: readers pin the currently published snapshot
+// through its "readers" count. Writers are serialized, publish a new snapshot
+// and retire the old one, which is released once nobody uses it anymore.
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    PMEMORYMODULE module;
+} MODULE_RANGE;
+
+typedef struct MODULE_INDEX {
+    struct MODULE_INDEX *nextRetired;
+    volatile LONG readers;
+    DWORD count;
+    MODULE_RANGE ranges[1];
+} MODULE_INDEX;
+
+static MODULE_INDEX * volatile moduleIndex = NULL;
+static MODULE_INDEX *retiredModuleIndexes = NULL;
+// readers between loading the snapshot pointer and pinning the snapshot
+static volatile LONG moduleIndexLoaders = 0;
+static volatile LONG moduleIndexLock = 0;
+// snapshot pinned by the thread notification running on a thread
+static DWORD moduleIndexHeldSlot = TLS_OUT_OF_INDEXES;
+
+static const MODULE_INDEX *
+AcquireModuleIndex(void)
+{
+    MODULE_INDEX *index;
+    for (;;) {
+        InterlockedIncrement(&moduleIndexLoaders);
+        index = moduleIndex;
+        if (index != NULL) {
+            InterlockedIncrement(&index->readers);
+        }
+        InterlockedDecrement(&moduleIndexLoaders);
+        if (index == NULL || index == moduleIndex) {
+            return index;
+        }
+
+        // Retired while it was pinned, it might still contain modules that
+        // are being freed and are no longer waited for.
+        InterlockedDecrement(&index->readers);
+    }
+}
+
+static inline void
+ReleaseModuleIndex(const MODULE_INDEX *index)
+{
+    if (index != NULL) {
+        InterlockedDecrement(&((MODULE_INDEX *) index)->readers);
+    }
+}
+
+static const MODULE_INDEX *
+GetHeldModuleIndex(void)
+{
+    if (moduleIndexHeldSlot == TLS_OUT_OF_INDEXES) {
+        return NULL;
+    }
+    return (const MODULE_INDEX *) TlsGetValue(moduleIndexHeldSlot);
+}
+
+static MODULE_INDEX *
+AllocModuleIndex(DWORD count)
+{
+    MODULE_INDEX *index = (MODULE_INDEX *) HeapAlloc(GetProcessHeap(), 0,
+        sizeof(MODULE_INDEX) + (count ? count - 1 : 0) * sizeof(MODULE_RANGE));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->nextRetired = NULL;
+    index->readers = 0;
+    index->count = count;
+    return index;
+}
+
+// Release retired snapshots that are no longer pinned. Must be called with
+// the index lock held.
+static void
+ReclaimModuleIndexes(void)
+{
+    MODULE_INDEX **ref = &retiredModuleIndexes;
+
+    // Readers that loaded the pointer of a retired snapshot but didn't pin
+    // it yet would write to freed memory, try again on the next update.
+    if (moduleIndexLoaders != 0) {
+        return;
+    }
+    while (*ref != NULL) {
+        MODULE_INDEX *index = *ref;
+        if (index->readers == 0) {
+            *ref = index->nextRetired;
+            HeapFree(GetProcessHeap(), 0, index);
+        } else {
+            ref = &index->nextRetired;
+        }
+    }
+}
+
+// Must be called with the index lock held.
+static void
+PublishModuleIndex(MODULE_INDEX *index)
+{
+    MODULE_INDEX *old = (MODULE_INDEX *) InterlockedExchangePointer((PVOID volatile *) &moduleIndex, index);
+    if (old != NULL) {
+        old->nextRetired = retiredModuleIndexes;
+        retiredModuleIndexes = old;
+    }
+    ReclaimModuleIndexes();
+}
+
+static BOOL
+RegisterModuleRange(PMEMORYMODULE module, SIZE_T size)
+{
+    uintptr_t start = (uintptr_t) module->codeBase;
+    const MODULE_INDEX *current;
+    MODULE_INDEX *index;
+    DWORD count;
+    DWORD i, pos;
+    BOOL inserted = FALSE;
+
+    AcquireSpinLock(&moduleIndexLock);
+    if (moduleIndexHeldSlot == TLS_OUT_OF_INDEXES) {
+        moduleIndexHeldSlot = TlsAlloc();
+        if (moduleIndexHeldSlot == TLS_OUT_OF_INDEXES) {
+            // TlsAlloc has set the error
+            ReleaseSpinLock(&moduleIndexLock);
+            return FALSE;
+        }
+    }
+    current = moduleIndex;
+    count = current ? current->count : 0;
+    index = AllocModuleIndex(count + 1);
+    if (index == NULL) {
+        ReleaseSpinLock(&moduleIndexLock);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    for (i=0, pos=0; i<count; i++) {
+        if (current->ranges[i].module == NULL) {
+            // stale entry, see UnregisterModuleRanges
+            continue;
+        }
+        if (!inserted && current->ranges[i].start > start) {
+            index->ranges[pos].start = start;
+            index->ranges[pos].end = start + size;
+            index->ranges[pos].module = module;
+            inserted = TRUE;
+            pos++;
+        }
+        index->ranges[pos++] = current->ranges[i];
+    }
+    if (!inserted) {
+        index->ranges[pos].start = start;
+        index->ranges[pos].end = start + size;
+        index->ranges[pos].module = module;
+        pos++;
+    }
+    index->count = pos;
+    PublishModuleIndex(index);
+    ReleaseSpinLock(&moduleIndexLock);
+    return TRUE;
+}
+
+static int
+CompareModulePointers(const void *a, const void *b)
+{
+    uintptr_t p1 = (uintptr_t) *(const PMEMORYMODULE *) a;
+    uintptr_t p2 = (uintptr_t) *(const PMEMORYMODULE *) b;
+    return (p1 > p2) - (p1 < p2);
+}
+
+// Check if "handle" is one of the "count" modules of a batch. "sorted" holds
+// the modules sorted with CompareModulePointers or is NULL.
+static BOOL
+IsBatchMember(HCUSTOMMODULE handle, PMEMORYMODULE *modules, PMEMORYMODULE *sorted, DWORD count)
+{
+    PMEMORYMODULE key = (PMEMORYMODULE) handle;
+    DWORD i;
+
+    if (sorted != NULL) {
+        return bsearch(&key, sorted, count, sizeof(PMEMORYMODULE), CompareModulePointers) != NULL;
+    }
+    for (i=0; i<count; i++) {
+        if (modules[i] == key) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Remove the ranges of "count" modules with one new snapshot. "modules" must
+// be sorted with CompareModulePointers. Returns TRUE if the ranges had to be
+// removed from the published snapshot in place.
+static BOOL
+UnregisterModuleRanges(PMEMORYMODULE *modules, DWORD count)
+{
+    const MODULE_INDEX *current;
+    MODULE_INDEX *index;
+    DWORD i, pos, removed = 0;
+
+    AcquireSpinLock(&moduleIndexLock);
+    current = moduleIndex;
+    if (current == NULL) {
+        ReleaseSpinLock(&moduleIndexLock);
+        return FALSE;
+    }
+
+    for (i=0; i<current->count; i++) {
+        if (current->ranges[i].module != NULL &&
+            bsearch(&current->ranges[i].module, modules, count, sizeof(PMEMORYMODULE), CompareModulePointers) != NULL) {
+            removed++;
+        }
+    }
+    if (removed == 0) {
+        // modules were never registered
+        ReleaseSpinLock(&moduleIndexLock);
+        return FALSE;
+    }
+
+    index = AllocModuleIndex(current->count - removed);
+    if (index == NULL) {
+        // Can't shrink the index, mark the entries as unused instead. Ranges
+        // are only read through the published snapshot, so this is safe for
+        // concurrent readers.
+        for (i=0; i<current->count; i++) {
+            if (current->ranges[i].module != NULL &&
+                bsearch(&current->ranges[i].module, modules, count, sizeof(PMEMORYMODULE), CompareModulePointers) != NULL) {
+                ((MODULE_RANGE *) &current->ranges[i])->module = NULL;
+            }
+        }
+        ReleaseSpinLock(&moduleIndexLock);
+        return TRUE;
+    }
+
+    for (i=0, pos=0; i<current->count; i++) {
+        if (current->ranges[i].module != NULL &&
+            bsearch(&current->ranges[i].module, modules, count, sizeof(PMEMORYMODULE), CompareModulePointers) == NULL) {
+            index->ranges[pos++] = current->ranges[i];
+        }
+    }
+    index->count = pos;
+    PublishModuleIndex(index);
+    ReleaseSpinLock(&moduleIndexLock);
+    return FALSE;
+}
+
+static BOOL
+ContainsModules(const MODULE_INDEX *index, PMEMORYMODULE *modules, PMEMORYMODULE *sorted, DWORD count)
+{
+    DWORD i;
+    for (i=0; i<index->count; i++) {
+        if (index->ranges[i].module != NULL &&
+            IsBatchMember(index->ranges[i].module, modules, sorted, count)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Wait until no thread uses a snapshot that still contains one of the
+// "count" modules, which have been unregistered already. The snapshot pinned
+// by a notification of the calling thread is not waited for, the modules may
+// be freed from DllMain. "inPlace" also waits for the published snapshot if
+// the ranges were removed from it in place.
+static void
+WaitForModuleIndexReaders(PMEMORYMODULE *modules, PMEMORYMODULE *sorted, DWORD count, BOOL inPlace)
+{
+    const MODULE_INDEX *held = GetHeldModuleIndex();
+    const MODULE_INDEX *index;
+    BOOL busy;
+
+    for (;;) {
+        busy = FALSE;
+        AcquireSpinLock(&moduleIndexLock);
+        ReclaimModuleIndexes();
+        if (inPlace && moduleIndex != NULL &&
+            moduleIndex->readers > (moduleIndex == held ? 1 : 0)) {
+            busy = TRUE;
+        }
+        for (index = retiredModuleIndexes; !busy && index != NULL; index = index->nextRetired) {
+            // readers that pin a retired snapshot release it right away
+            if (index->readers > (index == held ? 1 : 0) &&
+                ContainsModules(index, modules, sorted, count)) {
+                busy = TRUE;
+            }
+        }
+        ReleaseSpinLock(&moduleIndexLock);
+        if (!busy) {
+            return;
+        }
+        Sleep(0);
+    }
+}
+
+// Implicit TLS ("__declspec(thread)") of memory modules. Code compiled for
+// implicit TLS reads the block of the current thread from the TLS vector the
+// TEB points to, using the index stored at "AddressOfIndex". The vectors of
+// the Windows loader only have entries for its own modules, so every thread
+// gets a private copy of the loader's vector with one more entry per memory
+// module, which points to the module's block for the thread. The indices of
+// memory modules follow the ones the loader had handed out when the first
+// memory module with TLS was loaded. The loader's vector is kept and put
+// back when the thread detaches, so the loader releases its own vector.
+//
+// Vectors are only installed and changed by their own thread: the thread
+// that loads a module and threads that are created afterwards get blocks,
+// threads that were running before the module was loaded don't. The blocks
+// are also kept in the TLS_THREAD and copied to the vector whenever the
+// thread accesses it, so other threads can release the blocks of a freed
+// module without touching the vector. Native modules with implicit TLS that
+// are loaded afterwards make the loader replace all vectors with larger ones
+// whose indices collide with memory modules, which is not supported.
+#define MEMORY_TLS_MAX_SLOTS    64
+#define MEMORY_TLS_NO_INDEX     ((DWORD) -1)
+#define MEMORY_TLS_NO_COUNT     ((SIZE_T) -1)
+
+#ifdef _WIN64
+#define TEB_TLS_POINTER_OFFSET  0x58
+#else
+#define TEB_TLS_POINTER_OFFSET  0x2C
+#endif
+
+typedef struct TLS_THREAD {
+    struct TLS_THREAD *next;
+    void **loaderVector;
+    // "tlsIndexBase" + MEMORY_TLS_MAX_SLOTS entries, NULL if the loader
+    // replaced it
+    void **vector;
+    void *blocks[MEMORY_TLS_MAX_SLOTS];
+} TLS_THREAD;
+
+static volatile LONG tlsLock = 0;
+static DWORD tlsIndexBase = 0;
+static BOOL tlsSlotUsed[MEMORY_TLS_MAX_SLOTS];
+// all threads with blocks
+static TLS_THREAD *tlsThreads = NULL;
+// TLS_THREAD of the current thread
+static DWORD tlsThreadSlot = TLS_OUT_OF_INDEXES;
+
+static inline void ** volatile *
+GetTlsVectorPointer(void)
+{
+    return (void ** volatile *) ((unsigned char *) NtCurrentTeb() + TEB_TLS_POINTER_OFFSET);
+}
+
+// Number of indices the Windows loader handed out, determined from the
+// loaded native modules.
+static SIZE_T
+GetLoadedTlsCount(void)
+{
+    MODULEENTRY32 entry;
+    HANDLE snapshot;
+    SIZE_T result = 0;
+
+    snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, 0);
+    if (snapshot == INVALID_HANDLE_VALUE) {
+        return MEMORY_TLS_NO_COUNT;
+    }
+
+    entry.dwSize = sizeof(entry);
+    if (Module32First(snapshot, &entry)) {
+        do {
+            PIMAGE_DOS_HEADER dos_header = (PIMAGE_DOS_HEADER) entry.modBaseAddr;
+            PIMAGE_NT_HEADERS nt_headers = (PIMAGE_NT_HEADERS) (entry.modBaseAddr + dos_header->e_lfanew);
+            PIMAGE_DATA_DIRECTORY directory = &nt_headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_TLS];
+            PIMAGE_TLS_DIRECTORY tls;
+            if (directory->VirtualAddress == 0) {
+                continue;
+            }
+
+            // the loader relocated the directory with the module
+            tls = (PIMAGE_TLS_DIRECTORY) (entry.modBaseAddr + directory->VirtualAddress);
+            if (tls->AddressOfIndex != 0 && *(DWORD *) tls->AddressOfIndex >= result) {
+                result = *(DWORD *) tls->AddressOfIndex + 1;
+            }
+        } while (Module32Next(snapshot, &entry));
+    }
+    CloseHandle(snapshot);
+    return result;
+}
+
+// Number of entries of the loader's TLS vector of the current thread, or
+// MEMORY_TLS_NO_COUNT if it can't be determined.
+static SIZE_T
+GetLoaderTlsCount(void **vector)
+{
+    SIZE_T size;
+    if (vector == NULL) {
+        return 0;
+    }
+
+    // The vectors are allocated by the Windows loader from the process heap,
+    // newer versions put a header in front of them that HeapSize rejects.
+    size = HeapSize(GetProcessHeap(), 0, vector);
+    if (size != (SIZE_T) -1) {
+        return size / sizeof(void *);
+    }
+
+    return GetLoadedTlsCount();
+}
+
+static DWORD
+AllocateTlsIndex(void)
+{
+    DWORD i;
+    DWORD result = MEMORY_TLS_NO_INDEX;
+    AcquireSpinLock(&tlsLock);
+    if (tlsThreadSlot == TLS_OUT_OF_INDEXES) {
+        SIZE_T count = GetLoaderTlsCount(*GetTlsVectorPointer());
+        if (count == MEMORY_TLS_NO_COUNT) {
+            ReleaseSpinLock(&tlsLock);
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return MEMORY_TLS_NO_INDEX;
+        }
+
+        tlsThreadSlot = TlsAlloc();
+        if (tlsThreadSlot == TLS_OUT_OF_INDEXES) {
+            ReleaseSpinLock(&tlsLock);
+            return MEMORY_TLS_NO_INDEX;
+        }
+        // continue after the indices of the loader
+        tlsIndexBase = (DWORD) count;
+    }
+    for (i=0; i<MEMORY_TLS_MAX_SLOTS; i++) {
+        if (!tlsSlotUsed[i]) {
+            tlsSlotUsed[i] = TRUE;
+            result = tlsIndexBase + i;
+            break;
+        }
+    }
+    ReleaseSpinLock(&tlsLock);
+    if (result == MEMORY_TLS_NO_INDEX) {
+        SetLastError(ERROR_OUTOFMEMORY);
+    }
+    return result;
+}
+
+// Make sure the current thread uses its private vector and that it contains
+// the current blocks. The private vector (and if "create" is set, the
+// TLS_THREAD) is installed if necessary. Must be called with the TLS lock
+// held.
+static TLS_THREAD *
+GetTlsThread(BOOL create)
+{
+    void ** volatile *vectorRef = GetTlsVectorPointer();
+    TLS_THREAD *thread = (TLS_THREAD *) TlsGetValue(tlsThreadSlot);
+    void **vector;
+    SIZE_T count;
+
+    if (thread != NULL && thread->vector != NULL) {
+        if (*vectorRef == thread->vector) {
+            memcpy(thread->vector + tlsIndexBase, thread->blocks, sizeof(thread->blocks));
+            return thread;
+        }
+
+        // The loader replaced the vector of the thread and owns the private
+        // one now.
+        thread->vector = NULL;
+    } else if (thread == NULL && !create) {
+        return NULL;
+    }
+
+    count = GetLoaderTlsCount(*vectorRef);
+    if (count > tlsIndexBase) {
+        // a native module with TLS was loaded after the first memory module,
+        // its indices collide with the ones of memory modules
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+
+    vector = (void **) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+        (tlsIndexBase + MEMORY_TLS_MAX_SLOTS) * sizeof(void *));
+    if (vector == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    if (thread == NULL) {
+        thread = (TLS_THREAD *) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(TLS_THREAD));
+        if (thread == NULL) {
+            HeapFree(GetProcessHeap(), 0, vector);
+            SetLastError(ERROR_OUTOFMEMORY);
+            return NULL;
+        }
+
+        thread->next = tlsThreads;
+        tlsThreads = thread;
+        TlsSetValue(tlsThreadSlot, thread);
+    }
+
+    thread->loaderVector = *vectorRef;
+    thread->vector = vector;
+    if (count > 0) {
+        memcpy(vector, thread->loaderVector, count * sizeof(void *));
+    }
+    memcpy(vector + tlsIndexBase, thread->blocks, sizeof(thread->blocks));
+    // The entries of the loader are the same in both vectors, so code that
+    // runs on the thread may use either of them.
+    *vectorRef = vector;
+    return thread;
+}
+
+// Release the private vector and blocks of the current thread when it
+// detaches. Must be called with the TLS lock held.
+static void
+ReleaseTlsThread(void)
+{
+    void ** volatile *vectorRef = GetTlsVectorPointer();
+    TLS_THREAD *thread = (TLS_THREAD *) TlsGetValue(tlsThreadSlot);
+    TLS_THREAD **ref;
+    DWORD i;
+
+    if (thread == NULL) {
+        return;
+    }
+
+    for (ref = &tlsThreads; *ref != thread; ref = &(*ref)->next) {
+    }
+    *ref = thread->next;
+    TlsSetValue(tlsThreadSlot, NULL);
+    for (i=0; i<MEMORY_TLS_MAX_SLOTS; i++) {
+        if (thread->blocks[i] != NULL) {
+            HeapFree(GetProcessHeap(), 0, thread->blocks[i]);
+        }
+    }
+    if (thread->vector != NULL && *vectorRef == thread->vector) {
+        *vectorRef = thread->loaderVector;
+        HeapFree(GetProcessHeap(), 0, thread->vector);
+    }
+    // otherwise the loader replaced (and owns) the private vector
+    HeapFree(GetProcessHeap(), 0, thread);
+}
+
+// Allocate the block of a module for the current thread. Must be called
+// with the TLS lock held.
+static BOOL
+AllocateTlsBlock(PMEMORYMODULE module)
+{
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_TLS);
+    PIMAGE_TLS_DIRECTORY tls = (PIMAGE_TLS_DIRECTORY) (module->codeBase + directory->VirtualAddress);
+    SIZE_T templateSize = (SIZE_T) (tls->EndAddressOfRawData - tls->StartAddressOfRawData);
+    DWORD slot = module->tlsIndex - tlsIndexBase;
+    TLS_THREAD *thread;
+    unsigned char *data;
+
+    thread = GetTlsThread(TRUE);
+    if (thread == NULL) {
+        return FALSE;
+    }
+    if (thread->blocks[slot] != NULL) {
+        // thread already has a block
+        return TRUE;
+    }
+
+    data = (unsigned char *) HeapAlloc(GetProcessHeap(), 0, templateSize + tls->SizeOfZeroFill);
+    if (data == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+    if (templateSize > 0) {
+        memcpy(data, (const void *) tls->StartAddressOfRawData, templateSize);
+    }
+    memset(data + templateSize, 0, tls->SizeOfZeroFill);
+    thread->blocks[slot] = data;
+    thread->vector[module->tlsIndex] = data;
+    return TRUE;
+}
+
+static BOOL
+InitializeTLS(PMEMORYMODULE module)
+{
+    PIMAGE_TLS_DIRECTORY tls;
+    BOOL result;
+
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_TLS);
+    if (directory->VirtualAddress == 0) {
+        return TRUE;
+    }
+
+    tls = (PIMAGE_TLS_DIRECTORY) (module->codeBase + directory->VirtualAddress);
+    if (tls->AddressOfIndex == 0) {
+        return TRUE;
+    }
+
+    module->tlsIndex = AllocateTlsIndex();
+    if (module->tlsIndex == MEMORY_TLS_NO_INDEX) {
+        return FALSE;
+    }
+    *(DWORD *) tls->AddressOfIndex = module->tlsIndex;
+
+    // From now on, new threads get their blocks through the thread
+    // notification callback. Threads that are already running don't get
+    // blocks and must not use the TLS data of the module.
+    module->tlsReady = TRUE;
+
+    AcquireSpinLock(&tlsLock);
+    result = AllocateTlsBlock(module);
+    ReleaseSpinLock(&tlsLock);
+    return result;
+}
+
+static void
+ReleaseTLS(PMEMORYMODULE module)
+{
+    TLS_THREAD *thread;
+    DWORD slot;
+
+    if (module->tlsIndex == MEMORY_TLS_NO_INDEX) {
+        return;
+    }
+
+    // Only the blocks are released, the vectors of other threads are
+    // updated the next time the threads access them.
+    slot = module->tlsIndex - tlsIndexBase;
+    AcquireSpinLock(&tlsLock);
+    for (thread = tlsThreads; thread != NULL; thread = thread->next) {
+        if (thread->blocks[slot] != NULL) {
+            HeapFree(GetProcessHeap(), 0, thread->blocks[slot]);
+            thread->blocks[slot] = NULL;
+        }
+    }
+    GetTlsThread(FALSE);
+    tlsSlotUsed[slot] = FALSE;
+    ReleaseSpinLock(&tlsLock);
+    module->tlsIndex = MEMORY_TLS_NO_INDEX;
+}
+
+// Forward thread attach/detach notifications of the host to all memory
+// modules. The list of modules is taken from the lock-free module index,
+// so creating threads doesn't serialize on a global lock. The snapshot stays
+// pinned while the modules are notified, so they can't be released until
+// their notifications are done.
+static void NTAPI
+MemoryModuleTlsCallback(PVOID handle, DWORD reason, PVOID reserved)
+{
+    const MODULE_INDEX *index;
+    uintptr_t start;
+    DWORD i, first, last;
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(reserved);
+
+    if ((reason != DLL_THREAD_ATTACH && reason != DLL_THREAD_DETACH) ||
+        moduleIndexHeldSlot == TLS_OUT_OF_INDEXES) {
+        // no module has been loaded yet
+        return;
+    }
+
+    index = AcquireModuleIndex();
+    TlsSetValue(moduleIndexHeldSlot, (LPVOID) index);
+    for (i=0; index != NULL && i<index->count; i++) {
+        PMEMORYMODULE module = index->ranges[i].module;
+        if (module == NULL) {
+            continue;
+        }
+
+        if (index != moduleIndex) {
+            // The notifications loaded or freed modules, continue after the
+            // last notified range in the current snapshot. Freed modules
+            // are only contained in the old one.
+            start = index->ranges[i].start;
+            ReleaseModuleIndex(index);
+            index = AcquireModuleIndex();
+            TlsSetValue(moduleIndexHeldSlot, (LPVOID) index);
+            if (index == NULL) {
+                break;
+            }
+
+            first = 0;
+            last = index->count;
+            while (last > first) {
+                DWORD middle = (first + last) >> 1;
+                if (index->ranges[middle].start < start) {
+                    first = middle + 1;
+                } else {
+                    last = middle;
+                }
+            }
+            i = first;
+            if (i == index->count) {
+                break;
+            }
+            module = index->ranges[i].module;
+            if (module == NULL) {
+                continue;
+            }
+        }
+
+        if (module->tlsReady) {
+            // the loader may have replaced the vector in the meantime
+            AcquireSpinLock(&tlsLock);
+            if (reason == DLL_THREAD_ATTACH) {
+                AllocateTlsBlock(module);
+            } else {
+                GetTlsThread(FALSE);
+            }
+            ReleaseSpinLock(&tlsLock);
+        }
+        if (module->threadNotifications) {
+            ExecuteTLS(module, reason);
+            if (module->initialized) {
+                DllEntryProc DllEntry = (DllEntryProc)(LPVOID)(module->codeBase + module->headers->OptionalHeader.AddressOfEntryPoint);
+                (*DllEntry)((HINSTANCE)module->codeBase, reason, 0);
+            }
+        }
+    }
+    TlsSetValue(moduleIndexHeldSlot, NULL);
+    ReleaseModuleIndex(index);
+
+    if (reason == DLL_THREAD_DETACH && tlsThreadSlot != TLS_OUT_OF_INDEXES) {
+        // all modules have been notified, release the blocks of the thread
+        AcquireSpinLock(&tlsLock);
+        ReleaseTlsThread();
+        ReleaseSpinLock(&tlsLock);
+    }
+}
+
+// Register the callback in the TLS directory of the host.
+#if defined(_MSC_VER)
+#ifdef _WIN64
+#pragma comment(linker, "/INCLUDE:_tls_used")
+#pragma comment(linker, "/INCLUDE:MemoryModuleTlsCallbackEntry")
+#pragma const_seg(".CRT$XLM")
+extern const PIMAGE_TLS_CALLBACK MemoryModuleTlsCallbackEntry;
+const PIMAGE_TLS_CALLBACK MemoryModuleTlsCallbackEntry = MemoryModuleTlsCallback;
+#pragma const_seg()
+#else
+#pragma comment(linker, "/INCLUDE:__tls_used")
+#pragma comment(linker, "/INCLUDE:_MemoryModuleTlsCallbackEntry")
+#pragma data_seg(".CRT$XLM")
+PIMAGE_TLS_CALLBACK MemoryModuleTlsCallbackEntry = MemoryModuleTlsCallback;
+#pragma data_seg()
+#endif
+#else
+PIMAGE_TLS_CALLBACK MemoryModuleTlsCallbackEntry __attribute__((section(".CRT$XLM"), used)) = MemoryModuleTlsCallback;
+#endif
+
+// Hibernation of idle modules. The contents of all resident pages are either
+// restored from the original image (if they didn't change), recreated as
+// zero pages or compressed. Afterwards the pages are decommitted and
+// restored on first access by a vectored exception handler.
+#define COMPRESSION_FORMAT_LZNT1    2
+#define COMPRESSION_ENGINE_STANDARD 0
+
+typedef LONG (NTAPI *RtlGetCompressionWorkSpaceSizeFunc)(USHORT, PULONG, PULONG);
+typedef LONG (NTAPI *RtlCompressBufferFunc)(USHORT, PUCHAR, ULONG, PUCHAR, ULONG, ULONG, PULONG, PVOID);
+typedef LONG (NTAPI *RtlDecompressBufferFunc)(USHORT, PUCHAR, ULONG, PUCHAR, ULONG, PULONG);
+
+#define PAGE_RESIDENT       0
+#define PAGE_ZERO           1
+#define PAGE_FROM_IMAGE     2
+#define PAGE_COMPRESSED     3
+#define PAGE_STORED         4
+
+typedef struct {
+    SIZE_T offset;
+    DWORD size;
+    DWORD state;
+} HIBERNATEDPAGE;
+
+typedef struct HIBERNATIONDATA {
+    const unsigned char *data;
+    size_t size;
+    DWORD numPages;
+    HIBERNATEDPAGE *pages;
+    unsigned char *storage;
+    SIZE_T storageSize;
+} HIBERNATIONDATA;
+
+static PVOID hibernationHandler = NULL;
+static volatile LONG hibernationHandlerLock = 0;
+
+static FARPROC
+GetNtdllProc(LPCSTR name)
+{
+    return GetProcAddress(GetModuleHandleA("ntdll.dll"), name);
+}
+
+static BOOL
+IsReadable(DWORD protect)
+{
+    return (protect & (PAGE_READONLY | PAGE_READWRITE | PAGE_WRITECOPY |
+        PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+}
+
+static BOOL
+IsAccessAllowed(DWORD protect, ULONG_PTR accessType)
+{
+    switch (accessType) {
+    case 0:
+        // read
+        return IsReadable(protect);
+    case 1:
+        // write
+        return (protect & (PAGE_READWRITE | PAGE_WRITECOPY | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+    case 8:
+        // execute
+        return (protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+    default:
+        return FALSE;
+    }
+}
+
+// Copy the raw section data of an RVA range from the image.
+static void
+ReadImageRange(PMEMORYMODULE module, const HIBERNATIONDATA *hibernation, DWORD rva, DWORD size, unsigned char *buffer)
+{
+    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(module->headers);
+    DWORD end = rva + size;
+    int i;
+
+    memset(buffer, 0, size);
+    for (i=0; i<module->headers->FileHeader.NumberOfSections; i++, section++) {
+        DWORD start = section->VirtualAddress > rva ? section->VirtualAddress : rva;
+        DWORD stop = section->VirtualAddress + section->SizeOfRawData;
+        if (stop > end) {
+            stop = end;
+        }
+        if (start >= stop || (size_t) section->PointerToRawData + section->SizeOfRawData > hibernation->size) {
+            continue;
+        }
+
+        memcpy(buffer + (start - rva), hibernation->data + section->PointerToRawData + (start - section->VirtualAddress), stop - start);
+    }
+}
+
+// Apply the kept relocations of one width to a page, including relocations
+// that start on the previous page or end on the next one.
+static void
+RelocateImagePage(PMEMORYMODULE module, const HIBERNATIONDATA *hibernation, DWORD rva, unsigned char *buffer,
+    const DWORD *relocations, DWORD count, DWORD width)
+{
+    DWORD end = rva + module->pageSize;
+    DWORD first = rva >= width ? rva - width + 1 : 0;
+    DWORD lo = 0, hi = count;
+
+    while (lo < hi) {
+        DWORD mid = lo + (hi - lo) / 2;
+        if (relocations[mid] < first) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo<count && relocations[lo]<end; lo++) {
+        DWORD reloc = relocations[lo];
+        DWORD start = reloc > rva ? reloc : rva;
+        DWORD stop = reloc + width < end ? reloc + width : end;
+        union {
+            DWORD value32;
+            ULONGLONG value64;
+            unsigned char bytes[sizeof(ULONGLONG)];
+        } value;
+
+        ReadImageRange(module, hibernation, reloc, width, value.bytes);
+        if (width == sizeof(DWORD)) {
+            value.value32 += (DWORD) module->locationDelta;
+        } else {
+            value.value64 += (ULONGLONG) module->locationDelta;
+        }
+        memcpy(buffer + (start - rva), value.bytes + (start - reloc), stop - start);
+    }
+}
+
+// Recreate the contents a page had directly after the sections were copied
+// and relocated.
+static void
+ReadImagePage(PMEMORYMODULE module, const HIBERNATIONDATA *hibernation, DWORD rva, unsigned char *buffer)
+{
+    ReadImageRange(module, hibernation, rva, module->pageSize, buffer);
+    RelocateImagePage(module, hibernation, rva, buffer,
+        module->relocations, module->numRelocations32, sizeof(DWORD));
+    RelocateImagePage(module, hibernation, rva, buffer,
+        module->relocations + module->numRelocations32, module->numRelocations64, sizeof(ULONGLONG));
+}
+
+// Pages containing import address tables never match the image as they
+// hold the bound addresses.
+static BOOL
+ContainsImportThunks(PMEMORYMODULE module, DWORD rva)
+{
+    DWORD end = rva + module->pageSize;
+    DWORD i;
+    for (i=0; i<module->numImportThunks && module->importThunks[i].start<end; i++) {
+        if (module->importThunks[i].end > rva) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Must be called with the hibernation lock of the module held.
+static BOOL
+RestorePage(PMEMORYMODULE module, DWORD page)
+{
+    HIBERNATIONDATA *hibernation = module->hibernation;
+    HIBERNATEDPAGE *info = &hibernation->pages[page];
+    DWORD rva = page * module->pageSize;
+    unsigned char *dest = module->codeBase + rva;
+    const MEMORYPROTECTIONRANGE *range = FindProtectionRange(module, rva);
+    DWORD oldProtect;
+
+    if (info->state == PAGE_RESIDENT) {
+        return TRUE;
+    }
+
+    if (range == NULL || module->alloc(dest, module->pageSize, MEM_COMMIT, PAGE_READWRITE, module->userdata) == NULL) {
+        return FALSE;
+    }
+
+    switch (info->state) {
+    case PAGE_ZERO:
+        // freshly committed pages are zero already
+        break;
+
+    case PAGE_FROM_IMAGE:
+        ReadImagePage(module, hibernation, rva, dest);
+        break;
+
+    case PAGE_COMPRESSED:
+        {
+            static RtlDecompressBufferFunc decompress = NULL;
+            ULONG finalSize;
+            if (decompress == NULL) {
+                decompress = (RtlDecompressBufferFunc) (LPVOID) GetNtdllProc("RtlDecompressBuffer");
+            }
+            if (decompress == NULL ||
+                decompress(COMPRESSION_FORMAT_LZNT1, dest, module->pageSize,
+                    hibernation->storage + info->offset, info->size, &finalSize) < 0) {
+                return FALSE;
+            }
+        }
+        break;
+
+    case PAGE_STORED:
+        memcpy(dest, hibernation->storage + info->offset, module->pageSize);
+        break;
+    }
+
+    if (range->protect != PAGE_READWRITE &&
+        !VirtualProtect(dest, module->pageSize, range->protect, &oldProtect)) {
+        return FALSE;
+    }
+    if (range->protect & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) {
+        FlushInstructionCache(GetCurrentProcess(), dest, module->pageSize);
+    }
+    info->state = PAGE_RESIDENT;
+    return TRUE;
+}
+
+static LONG WINAPI
+HibernationExceptionHandler(PEXCEPTION_POINTERS info)
+{
+    PEXCEPTION_RECORD record = info->ExceptionRecord;
+    PMEMORYMODULE module;
+    DWORD rva;
+    DWORD page;
+    LONG result = EXCEPTION_CONTINUE_SEARCH;
+
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    module = (PMEMORYMODULE) MemoryModuleFromAddress((LPCVOID) record->ExceptionInformation[1], &rva);
+    if (module == NULL) {
+        return EXCEPTION_CONTINUE_SEARCH;
+    }
+
+    page = rva / module->pageSize;
+    AcquireSpinLock(&module->hibernationLock);
+    if (module->hibernation != NULL && page < module->hibernation->numPages &&
+        module->hibernation->pages[page].state != PAGE_RESIDENT) {
+        if (RestorePage(module, page)) {
+            result = EXCEPTION_CONTINUE_EXECUTION;
+        }
+    } else {
+        // The page might have been restored by another thread in the
+        // meantime, retry if its current protection allows the access.
+        MEMORY_BASIC_INFORMATION mbi;
+        if (VirtualQuery((LPCVOID) record->ExceptionInformation[1], &mbi, sizeof(mbi)) &&
+            mbi.State == MEM_COMMIT && IsAccessAllowed(mbi.Protect, record->ExceptionInformation[0])) {
+            result = EXCEPTION_CONTINUE_EXECUTION;
+        }
+    }
+    ReleaseSpinLock(&module->hibernationLock);
+    return result;
+}
+
+static void
+FreeHibernationData(HIBERNATIONDATA *hibernation)
+{
+    if (hibernation == NULL) {
+        return;
+    }
+
+    free(hibernation->pages);
+    free(hibernation->storage);
+    free(hibernation);
+}
+
+// Must be called with the hibernation lock of the module held.
+static BOOL
+WakeModule(PMEMORYMODULE module)
+{
+    HIBERNATIONDATA *hibernation = module->hibernation;
+    DWORD page;
+    if (hibernation == NULL) {
+        return TRUE;
+    }
+
+    for (page=0; page<hibernation->numPages; page++) {
+        if (!RestorePage(module, page)) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return FALSE;
+        }
+    }
+
+    module->hibernation = NULL;
+    FreeHibernationData(hibernation);
+    return TRUE;
+}
+
+static BOOL
+AppendStorage(HIBERNATIONDATA *hibernation, SIZE_T *capacity, const unsigned char *data, DWORD size)
+{
+    if (hibernation->storageSize + size > *capacity) {
+        SIZE_T newCapacity = *capacity ? *capacity * 2 : 16 * size;
+        unsigned char *tmp;
+        while (newCapacity < hibernation->storageSize + size) {
+            newCapacity *= 2;
+        }
+        tmp = (unsigned char *) realloc(hibernation->storage, newCapacity);
+        if (tmp == NULL) {
+            return FALSE;
+        }
+        hibernation->storage = tmp;
+        *capacity = newCapacity;
+    }
+
+    memcpy(hibernation->storage + hibernation->storageSize, data, size);
+    hibernation->storageSize += size;
+    return TRUE;
+}
+
+static BOOL
+HibernateModule(PMEMORYMODULE module, const void *data, size_t size, SIZE_T *released)
+{
+    RtlGetCompressionWorkSpaceSizeFunc getWorkSpaceSize;
+    RtlCompressBufferFunc compress;
+    HIBERNATIONDATA *hibernation;
+    unsigned char *buffer = NULL;
+    unsigned char *compressed = NULL;
+    void *workSpace = NULL;
+    SIZE_T capacity = 0;
+    ULONG workSpaceSize, fragmentSize;
+    DWORD page, i;
+    BOOL result = FALSE;
+
+    getWorkSpaceSize = (RtlGetCompressionWorkSpaceSizeFunc) (LPVOID) GetNtdllProc("RtlGetCompressionWorkSpaceSize");
+    compress = (RtlCompressBufferFunc) (LPVOID) GetNtdllProc("RtlCompressBuffer");
+    if (getWorkSpaceSize == NULL || compress == NULL ||
+        getWorkSpaceSize(COMPRESSION_FORMAT_LZNT1 | COMPRESSION_ENGINE_STANDARD, &workSpaceSize, &fragmentSize) < 0) {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
+    }
+
+    hibernation = (HIBERNATIONDATA *) calloc(1, sizeof(HIBERNATIONDATA));
+    if (hibernation == NULL || (data != NULL && !KeepLoaderData(module))) {
+        free(hibernation);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    hibernation->data = (const unsigned char *) data;
+    hibernation->size = data != NULL ? size : 0;
+    hibernation->numPages = (DWORD) (AlignValueUp(module->headers->OptionalHeader.SizeOfImage, module->pageSize) / module->pageSize);
+    hibernation->pages = (HIBERNATEDPAGE *) calloc(hibernation->numPages, sizeof(HIBERNATEDPAGE));
+    buffer = (unsigned char *) malloc(module->pageSize);
+    // LZNT1 may expand incompressible data slightly
+    compressed = (unsigned char *) malloc(module->pageSize * 2);
+    workSpace = malloc(workSpaceSize);
+    if (hibernation->pages == NULL || buffer == NULL || compressed == NULL || workSpace == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto exit;
+    }
+
+    for (i=0; i<module->numProtectionRanges; i++) {
+        const MEMORYPROTECTIONRANGE *range = &module->protectionMap[i];
+        if (range->decommitted || !IsReadable(range->protect)) {
+            continue;
+        }
+
+        for (page=range->rva / module->pageSize; page<(range->rva + range->size) / module->pageSize; page++) {
+            HIBERNATEDPAGE *info = &hibernation->pages[page];
+            unsigned char *src = module->codeBase + page * module->pageSize;
+            ULONG compressedSize;
+            LONG status;
+
+            if (hibernation->data != NULL && !ContainsImportThunks(module, page * module->pageSize)) {
+                ReadImagePage(module, hibernation, page * module->pageSize, buffer);
+                if (memcmp(buffer, src, module->pageSize) == 0) {
+                    info->state = PAGE_FROM_IMAGE;
+                    continue;
+                }
+            }
+
+            status = compress(COMPRESSION_FORMAT_LZNT1 | COMPRESSION_ENGINE_STANDARD, src, module->pageSize,
+                compressed, module->pageSize * 2, 4096, &compressedSize, workSpace);
+            if (status < 0) {
+                SetLastError(ERROR_NOT_SUPPORTED);
+                goto exit;
+            }
+
+            info->offset = hibernation->storageSize;
+            if (compressedSize == 0 || status == 0x00000117 /* STATUS_BUFFER_ALL_ZEROS */) {
+                info->state = PAGE_ZERO;
+            } else if (compressedSize < module->pageSize) {
+                info->size = compressedSize;
+                info->state = PAGE_COMPRESSED;
+                if (!AppendStorage(hibernation, &capacity, compressed, compressedSize)) {
+                    SetLastError(ERROR_OUTOFMEMORY);
+                    goto exit;
+                }
+            } else {
+                info->size = module->pageSize;
+                info->state = PAGE_STORED;
+                if (!AppendStorage(hibernation, &capacity, src, module->pageSize)) {
+                    SetLastError(ERROR_OUTOFMEMORY);
+                    goto exit;
+                }
+            }
+        }
+    }
+
+    if (hibernation->storageSize > 0 && hibernation->storageSize < capacity) {
+        // release unused storage
+        unsigned char *tmp = (unsigned char *) realloc(hibernation->storage, hibernation->storageSize);
+        if (tmp != NULL) {
+            hibernation->storage = tmp;
+        }
+    }
+
+    // The handler must be able to restore pages as soon as the first one is
+    // decommitted. Faulting threads wait for the hibernation lock, which is
+    // held until all pages are decommitted.
+    AcquireSpinLock(&hibernationHandlerLock);
+    if (hibernationHandler == NULL) {
+        hibernationHandler = AddVectoredExceptionHandler(1, HibernationExceptionHandler);
+    }
+    ReleaseSpinLock(&hibernationHandlerLock);
+    if (hibernationHandler == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto exit;
+    }
+
+    module->hibernation = hibernation;
+
+    // decommit all pages that can be restored
+    *released = 0;
+    page = 0;
+    while (page < hibernation->numPages) {
+        DWORD end;
+        if (hibernation->pages[page].state == PAGE_RESIDENT) {
+            page++;
+            continue;
+        }
+
+        for (end=page+1; end<hibernation->numPages && hibernation->pages[end].state != PAGE_RESIDENT; end++) {
+        }
+        if (!module->free(module->codeBase + page * module->pageSize, (end - page) * module->pageSize, MEM_DECOMMIT, module->userdata)) {
+            // keep pages that could not be decommitted resident
+            for (; page<end; page++) {
+                hibernation->pages[page].state = PAGE_RESIDENT;
+            }
+            continue;
+        }
+        *released += (end - page) * module->pageSize;
+        page = end;
+    }
+    *released = (*released > hibernation->storageSize) ? *released - hibernation->storageSize : 0;
+
+    hibernation = NULL;
+    result = TRUE;
+
+exit:
+    FreeHibernationData(hibernation);
+    free(workSpace);
+    free(compressed);
+    free(buffer);
+    return result;
+}
+
+// Same as WIN32_MEMORY_RANGE_ENTRY, which is missing in older SDKs.
+typedef struct {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+} MEMORY_RANGE_ENTRY;
+
+typedef BOOL (WINAPI *PrefetchVirtualMemoryFunc)(HANDLE, ULONG_PTR, MEMORY_RANGE_ENTRY *, ULONG);
+
+// Returns NULL before Windows 8.
+static PrefetchVirtualMemoryFunc
+GetPrefetchVirtualMemory(void)
+{
+    // 0: not checked yet, 1: available, 2: not available
+    static volatile LONG state = 0;
+    static PrefetchVirtualMemoryFunc prefetch = NULL;
+    PrefetchVirtualMemoryFunc func;
+
+    if (state != 0) {
+        return (state == 1) ? prefetch : NULL;
+    }
+
+    func = (PrefetchVirtualMemoryFunc) (LPVOID) GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+    prefetch = func;
+    InterlockedExchange(&state, func != NULL ? 1 : 2);
+    return func;
+}
+
+static BOOL
+IsPrefetchable(const MEMORYPROTECTIONRANGE *range, BOOL hot)
+{
+    DWORD protect = range->protect & 0xff;
+    if (range->decommitted || protect == PAGE_NOACCESS) {
+        return FALSE;
+    }
+
+    // without hot ranges only code and read-only data is prefetched
+    return hot || protect == PAGE_READONLY || protect == PAGE_EXECUTE ||
+        protect == PAGE_EXECUTE_READ || protect == PAGE_EXECUTE_READWRITE ||
+        protect == PAGE_EXECUTE_WRITECOPY;
+}
+
+// Read one byte of every readable page, also restores hibernated pages.
+static void
+TouchPages(PMEMORYMODULE module, const MEMORY_RANGE_ENTRY *entries, DWORD count)
+{
+    DWORD i;
+    for (i=0; i<count; i++) {
+        volatile const unsigned char *page = (volatile const unsigned char *) AlignAddressDown(entries[i].VirtualAddress, module->pageSize);
+        const unsigned char *end = (const unsigned char *) entries[i].VirtualAddress + entries[i].NumberOfBytes;
+        const MEMORYPROTECTIONRANGE *range = FindProtectionRange(module, (DWORD) ((const unsigned char *) entries[i].VirtualAddress - module->codeBase));
+        if (range == NULL || !IsReadable(range->protect)) {
+            continue;
+        }
+        for (; (const unsigned char *) page < end; page += module->pageSize) {
+            (void) *page;
+        }
+    }
+}
+
+// Prefetch the pages of the given hot ranges or of all code and read-only
+// data if "numHotRanges" is 0.
+static BOOL
+PrefetchModule(PMEMORYMODULE module, const MEMORYRVARANGE *hotRanges, DWORD numHotRanges)
+{
+    PrefetchVirtualMemoryFunc prefetch;
+    MEMORY_RANGE_ENTRY *entries;
+    DWORD numEntries = 0;
+    DWORD i, j;
+
+    if (module->flags & MEMORY_LOAD_LARGE_PAGES) {
+        // large pages are never paged out
+        return TRUE;
+    }
+
+    entries = (MEMORY_RANGE_ENTRY *) malloc(module->numProtectionRanges * (numHotRanges > 0 ? numHotRanges : 1) * sizeof(MEMORY_RANGE_ENTRY));
+    if (entries == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    // Every entry lies within one range of the protection map, so the
+    // protection of its pages is known when touching them.
+    for (i=0; i<module->numProtectionRanges; i++) {
+        const MEMORYPROTECTIONRANGE *range = &module->protectionMap[i];
+        if (!IsPrefetchable(range, numHotRanges > 0)) {
+            continue;
+        }
+
+        if (numHotRanges == 0) {
+            entries[numEntries].VirtualAddress = module->codeBase + range->rva;
+            entries[numEntries].NumberOfBytes = range->size;
+            numEntries++;
+            continue;
+        }
+
+        for (j=0; j<numHotRanges; j++) {
+            ULONGLONG start = hotRanges[j].rva;
+            ULONGLONG end = start + hotRanges[j].size;
+            if (start < range->rva) {
+                start = range->rva;
+            }
+            if (end > (ULONGLONG) range->rva + range->size) {
+                end = (ULONGLONG) range->rva + range->size;
+            }
+            if (start >= end) {
+                continue;
+            }
+
+            entries[numEntries].VirtualAddress = module->codeBase + (DWORD) start;
+            entries[numEntries].NumberOfBytes = (SIZE_T) (end - start);
+            numEntries++;
+        }
+    }
+
+    // PrefetchVirtualMemory can't restore hibernated pages
+    prefetch = (module->hibernation == NULL) ? GetPrefetchVirtualMemory() : NULL;
+    if (numEntries > 0) {
+        if (prefetch == NULL || !prefetch(GetCurrentProcess(), numEntries, entries, 0)) {
+            TouchPages(module, entries, numEntries);
+        }
+    }
+    free(entries);
+    return TRUE;
+}
+
+LPVOID MemoryDefaultAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect, void* userdata)
+{
+	UNREFERENCED_PARAMETER(userdata);
+	return VirtualAlloc(address, size, allocationType, protect);
+}
+
+BOOL MemoryDefaultFree(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType, void* userdata)
+{
+	UNREFERENCED_PARAMETER(userdata);
+	return VirtualFree(lpAddress, dwSize, dwFreeType);
+}
+
+// Pool allocator that can be passed as CustomAllocFunc / CustomFreeFunc.
+// Images are placed in slots of large reserved regions, slots are recycled
+// when modules are freed and the regions are only released together with
+// the pool.
+#define MEMORY_POOL_DEFAULT_REGION_SIZE (64 * 1024 * 1024)
+
+typedef struct MEMORY_POOL_BLOCK {
+    struct MEMORY_POOL_BLOCK *next;
+    unsigned char *start;
+    SIZE_T size;
+    BOOL used;
+    // one entry per page, only allocated for used blocks
+    unsigned char *committed;
+} MEMORY_POOL_BLOCK;
+
+typedef struct MEMORY_POOL_REGION {
+    struct MEMORY_POOL_REGION *next;
+    unsigned char *start;
+    SIZE_T size;
+    MEMORY_POOL_BLOCK *blocks;
+} MEMORY_POOL_REGION;
+
+typedef struct {
+    volatile LONG lock;
+    SIZE_T regionSize;
+    DWORD pageSize;
+    DWORD granularity;
+    MEMORY_POOL_REGION *regions;
+    ULONGLONG syscalls;
+    ULONGLONG syscallsAvoided;
+} MEMORY_POOL;
+
+static MEMORY_POOL_BLOCK *
+FindPoolBlock(MEMORY_POOL *pool, LPCVOID address, MEMORY_POOL_REGION **region)
+{
+    MEMORY_POOL_REGION *r;
+    for (r=pool->regions; r!=NULL; r=r->next) {
+        MEMORY_POOL_BLOCK *block;
+        if ((const unsigned char *) address < r->start || (SIZE_T) ((const unsigned char *) address - r->start) >= r->size) {
+            continue;
+        }
+
+        for (block=r->blocks; block!=NULL; block=block->next) {
+            if ((const unsigned char *) address >= block->start && (SIZE_T) ((const unsigned char *) address - block->start) < block->size) {
+                if (region != NULL) {
+                    *region = r;
+                }
+                return block->used ? block : NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Returns the address inside "block" where an allocation of "size" bytes
+// can be placed or NULL if the block is too small.
+static unsigned char *
+FitPoolBlock(MEMORY_POOL_BLOCK *block, SIZE_T size)
+{
+    unsigned char *start = block->start;
+#ifdef _WIN64
+    // Images must not cross a 4GB boundary, see MemoryLoadLibraryEx2.
+    if (((uintptr_t) start >> 32) != (((uintptr_t) start + size - 1) >> 32)) {
+        start = (unsigned char *) AlignValueUp((uintptr_t) start, (uintptr_t) 1 << 32);
+    }
+#endif
+    if (start < block->start || (SIZE_T) (start - block->start) + size > block->size) {
+        return NULL;
+    }
+    return start;
+}
+
+static MEMORY_POOL_BLOCK *
+AllocPoolBlock(unsigned char *start, SIZE_T size, BOOL used)
+{
+    MEMORY_POOL_BLOCK *block = (MEMORY_POOL_BLOCK *) calloc(1, sizeof(MEMORY_POOL_BLOCK));
+    if (block != NULL) {
+        block->start = start;
+        block->size = size;
+        block->used = used;
+    }
+    return block;
+}
+
+// Split "block" so "start" / "size" are covered by a separate used block.
+static MEMORY_POOL_BLOCK *
+UsePoolBlock(MEMORY_POOL *pool, MEMORY_POOL_BLOCK *block, unsigned char *start, SIZE_T size)
+{
+    SIZE_T before = start - block->start;
+    SIZE_T after = block->size - before - size;
+    unsigned char *committed = (unsigned char *) calloc(size / pool->pageSize, 1);
+    if (committed == NULL) {
+        return NULL;
+    }
+
+    if (after > 0) {
+        MEMORY_POOL_BLOCK *tail = AllocPoolBlock(start + size, after, FALSE);
+        if (tail == NULL) {
+            free(committed);
+            return NULL;
+        }
+        tail->next = block->next;
+        block->next = tail;
+        block->size -= after;
+    }
+    if (before > 0) {
+        MEMORY_POOL_BLOCK *used = AllocPoolBlock(start, size, FALSE);
+        if (used == NULL) {
+            // merge the tail back
+            if (after > 0) {
+                MEMORY_POOL_BLOCK *tail = block->next;
+                block->next = tail->next;
+                block->size += after;
+                free(tail);
+            }
+            free(committed);
+            return NULL;
+        }
+        used->next = block->next;
+        block->next = used;
+        block->size = before;
+        block = used;
+    }
+    block->used = TRUE;
+    block->committed = committed;
+    return block;
+}
+
+static MEMORY_POOL_REGION *
+AddPoolRegion(MEMORY_POOL *pool, SIZE_T size)
+{
+    MEMORY_POOL_REGION *region;
+    SIZE_T regionSize = pool->regionSize;
+    if (regionSize < size) {
+        regionSize = AlignValueUp(size, pool->granularity);
+    }
+
+    region = (MEMORY_POOL_REGION *) calloc(1, sizeof(MEMORY_POOL_REGION));
+    if (region == NULL) {
+        return NULL;
+    }
+
+    pool->syscalls++;
+    region->start = (unsigned char *) VirtualAlloc(NULL, regionSize, MEM_RESERVE, PAGE_NOACCESS);
+    if (region->start == NULL) {
+        free(region);
+        return NULL;
+    }
+
+    region->size = regionSize;
+    region->blocks = AllocPoolBlock(region->start, regionSize, FALSE);
+    if (region->blocks == NULL) {
+        VirtualFree(region->start, 0, MEM_RELEASE);
+        free(region);
+        return NULL;
+    }
+
+    region->next = pool->regions;
+    pool->regions = region;
+    return region;
+}
+
+static LPVOID
+ReservePoolSlot(MEMORY_POOL *pool, LPVOID address, SIZE_T size)
+{
+    MEMORY_POOL_REGION *region;
+    MEMORY_POOL_BLOCK *block;
+    unsigned char *start;
+    size = AlignValueUp(size, pool->granularity);
+    if (address != NULL) {
+        // Placement at a fixed address (e.g. the preferred image base) is
+        // only possible if the address is free inside one of the regions.
+        start = (unsigned char *) address;
+        for (region=pool->regions; region!=NULL; region=region->next) {
+            for (block=region->blocks; block!=NULL; block=block->next) {
+                if (!block->used && start >= block->start &&
+                    (SIZE_T) (start - block->start) + size <= block->size) {
+                    block = UsePoolBlock(pool, block, start, size);
+                    if (block != NULL) {
+                        pool->syscallsAvoided++;
+                        return block->start;
+                    }
+                    return NULL;
+                }
+            }
+        }
+        SetLastError(ERROR_INVALID_ADDRESS);
+        return NULL;
+    }
+
+    for (region=pool->regions; region!=NULL; region=region->next) {
+        for (block=region->blocks; block!=NULL; block=block->next) {
+            if (!block->used && (start = FitPoolBlock(block, size)) != NULL) {
+                block = UsePoolBlock(pool, block, start, size);
+                if (block != NULL) {
+                    // a VirtualAlloc call to reserve the memory was avoided
+                    pool->syscallsAvoided++;
+                    return block->start;
+                }
+                return NULL;
+            }
+        }
+    }
+
+    region = AddPoolRegion(pool, size);
+    if (region == NULL) {
+        return NULL;
+    }
+
+    start = FitPoolBlock(region->blocks, size);
+    if (start == NULL) {
+        // only possible if the region crosses a 4GB boundary
+        start = region->start;
+    }
+    block = UsePoolBlock(pool, region->blocks, start, size);
+    return block != NULL ? block->start : NULL;
+}
+
+static LPVOID
+CommitPoolPages(MEMORY_POOL *pool, MEMORY_POOL_BLOCK *block, unsigned char *address, SIZE_T size, DWORD protect)
+{
+    SIZE_T first = (SIZE_T) (address - block->start) / pool->pageSize;
+    SIZE_T last = (SIZE_T) (address + size - 1 - block->start) / pool->pageSize;
+    SIZE_T page;
+    if (address + size > block->start + block->size) {
+        SetLastError(ERROR_INVALID_ADDRESS);
+        return NULL;
+    }
+
+    for (page=first; page<=last; page++) {
+        if (!block->committed[page]) {
+            break;
+        }
+    }
+    if (page > last) {
+        // All pages are committed already, the loader only commits writable
+        // pages before changing their protection so the call can be skipped.
+        // "protect" is not applied: the pool doesn't know the current
+        // protection, which is changed with VirtualProtect directly, and
+        // checking it would cost the call that is avoided here.
+        pool->syscallsAvoided++;
+        return address;
+    }
+
+    pool->syscalls++;
+    if (VirtualAlloc(address, size, MEM_COMMIT, protect) == NULL) {
+        return NULL;
+    }
+    for (page=first; page<=last; page++) {
+        block->committed[page] = 1;
+    }
+    return address;
+}
+
+static void
+ReleasePoolBlock(MEMORY_POOL *pool, MEMORY_POOL_REGION *region, MEMORY_POOL_BLOCK *block)
+{
+    MEMORY_POOL_BLOCK *prev = NULL;
+    MEMORY_POOL_BLOCK *tmp;
+    SIZE_T page;
+    SIZE_T numPages = block->size / pool->pageSize;
+
+    for (page=0; page<numPages; page++) {
+        if (block->committed[page]) {
+            break;
+        }
+    }
+    if (page < numPages) {
+        // The slot is reused for other images, so its contents and
+        // protection must be reset.
+        pool->syscalls++;
+        VirtualFree(block->start, block->size, MEM_DECOMMIT);
+    } else {
+        // nothing to decommit, no call was needed to release the slot
+        pool->syscallsAvoided++;
+    }
+    free(block->committed);
+    block->committed = NULL;
+    block->used = FALSE;
+
+    // merge with free neighbours
+    for (tmp=region->blocks; tmp!=block; tmp=tmp->next) {
+        prev = tmp;
+    }
+    tmp = block->next;
+    if (tmp != NULL && !tmp->used) {
+        block->size += tmp->size;
+        block->next = tmp->next;
+        free(tmp);
+    }
+    if (prev != NULL && !prev->used) {
+        prev->size += block->size;
+        prev->next = block->next;
+        free(block);
+    }
+}
+
+HMEMORYPOOL MemoryCreatePool(SIZE_T regionSize)
+{
+    SYSTEM_INFO sysInfo;
+    MEMORY_POOL *pool = (MEMORY_POOL *) calloc(1, sizeof(MEMORY_POOL));
+    if (pool == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    GetNativeSystemInfo(&sysInfo);
+    pool->pageSize = sysInfo.dwPageSize;
+    pool->granularity = sysInfo.dwAllocationGranularity;
+    if (regionSize == 0) {
+        regionSize = MEMORY_POOL_DEFAULT_REGION_SIZE;
+    }
+    pool->regionSize = AlignValueUp(regionSize, pool->granularity);
+    return (HMEMORYPOOL) pool;
+}
+
+BOOL MemoryDestroyPool(HMEMORYPOOL handle)
+{
+    MEMORY_POOL *pool = (MEMORY_POOL *) handle;
+    MEMORY_POOL_REGION *region;
+    MEMORY_POOL_BLOCK *block;
+    if (pool == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    for (region=pool->regions; region!=NULL; region=region->next) {
+        for (block=region->blocks; block!=NULL; block=block->next) {
+            if (block->used) {
+                SetLastError(ERROR_BUSY);
+                return FALSE;
+            }
+        }
+    }
+
+    region = pool->regions;
+    while (region != NULL) {
+        MEMORY_POOL_REGION *next = region->next;
+        block = region->blocks;
+        while (block != NULL) {
+            MEMORY_POOL_BLOCK *nextBlock = block->next;
+            free(block);
+            block = nextBlock;
+        }
+        VirtualFree(region->start, 0, MEM_RELEASE);
+        free(region);
+        region = next;
+    }
+    free(pool);
+    return TRUE;
+}
+
+LPVOID MemoryPoolAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect, void* userdata)
+{
+    MEMORY_POOL *pool = (MEMORY_POOL *) userdata;
+    MEMORY_POOL_BLOCK *block;
+    LPVOID result;
+
+    if (allocationType & MEM_LARGE_PAGES) {
+        // large pages can't be placed in the pool regions
+        return VirtualAlloc(address, size, allocationType, protect);
+    }
+
+    AcquireSpinLock(&pool->lock);
+    if (allocationType & MEM_RESERVE) {
+        result = ReservePoolSlot(pool, address, size);
+        if (result != NULL && (allocationType & MEM_COMMIT)) {
+            MEMORY_POOL_REGION *region;
+            block = FindPoolBlock(pool, result, &region);
+            if (CommitPoolPages(pool, block, (unsigned char *) result, size, protect) == NULL) {
+                ReleasePoolBlock(pool, region, block);
+                result = NULL;
+            }
+        }
+    } else {
+        block = FindPoolBlock(pool, address, NULL);
+        if (block != NULL) {
+            result = CommitPoolPages(pool, block, (unsigned char *) address, size, protect);
+        } else {
+            pool->syscalls++;
+            result = VirtualAlloc(address, size, allocationType, protect);
+        }
+    }
+    ReleaseSpinLock(&pool->lock);
+    return result;
+}
+
+BOOL MemoryPoolFree(LPVOID address, SIZE_T size, DWORD freeType, void* userdata)
+{
+    MEMORY_POOL *pool = (MEMORY_POOL *) userdata;
+    MEMORY_POOL_REGION *region;
+    MEMORY_POOL_BLOCK *block;
+    BOOL result = TRUE;
+
+    AcquireSpinLock(&pool->lock);
+    block = FindPoolBlock(pool, address, &region);
+    if (block == NULL) {
+        pool->syscalls++;
+        result = VirtualFree(address, size, freeType);
+    } else if (freeType & MEM_RELEASE) {
+        if (address != block->start) {
+            SetLastError(ERROR_INVALID_ADDRESS);
+            result = FALSE;
+        } else {
+            ReleasePoolBlock(pool, region, block);
+        }
+    } else {
+        SIZE_T first;
+        SIZE_T last;
+        if (size == 0) {
+            // VirtualFree would decommit up to the end of the whole region
+            // which contains other slots, stop at the end of the block
+            size = block->size - (SIZE_T) ((unsigned char *) address - block->start);
+        } else if (size > block->size - (SIZE_T) ((unsigned char *) address - block->start)) {
+            ReleaseSpinLock(&pool->lock);
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        first = (SIZE_T) ((unsigned char *) address - block->start) / pool->pageSize;
+        last = (SIZE_T) ((unsigned char *) address + size - 1 - block->start) / pool->pageSize;
+        pool->syscalls++;
+        result = VirtualFree(address, size, freeType);
+        if (result) {
+            for (; first<=last; first++) {
+                block->committed[first] = 0;
+            }
+        }
+    }
+    ReleaseSpinLock(&pool->lock);
+    return result;
+}
+
+void MemoryGetPoolStats(HMEMORYPOOL handle, MEMORYPOOLSTATS *stats)
+{
+    MEMORY_POOL *pool = (MEMORY_POOL *) handle;
+    MEMORY_POOL_REGION *region;
+    MEMORY_POOL_BLOCK *block;
+
+    memset(stats, 0, sizeof(MEMORYPOOLSTATS));
+    if (pool == NULL) {
+        return;
+    }
+
+    AcquireSpinLock(&pool->lock);
+    for (region=pool->regions; region!=NULL; region=region->next) {
+        stats->numRegions++;
+        stats->reservedBytes += region->size;
+        for (block=region->blocks; block!=NULL; block=block->next) {
+            if (block->used) {
+                SIZE_T page;
+                stats->numSlots++;
+                stats->usedBytes += block->size;
+                for (page=0; page<block->size / pool->pageSize; page++) {
+                    if (block->committed[page]) {
+                        stats->committedBytes += pool->pageSize;
+                    }
+                }
+            } else {
+                stats->numFreeBlocks++;
+                stats->freeBytes += block->size;
+                if (block->size > stats->largestFreeBlock) {
+                    stats->largestFreeBlock = block->size;
+                }
+            }
+        }
+    }
+    stats->syscalls = pool->syscalls;
+    stats->syscallsAvoided = pool->syscallsAvoided;
+    ReleaseSpinLock(&pool->lock);
+}
+
+HCUSTOMMODULE MemoryDefaultLoadLibrary(LPCSTR filename, void *userdata)
+{
+    HMODULE result;
+    UNREFERENCED_PARAMETER(userdata);
+    result = LoadLibraryA(filename);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    return (HCUSTOMMODULE) result;
+}
+
+FARPROC MemoryDefaultGetProcAddress(HCUSTOMMODULE module, LPCSTR name, void *userdata)
+{
+    UNREFERENCED_PARAMETER(userdata);
+    return (FARPROC) GetProcAddress((HMODULE) module, name);
+}
+
+void MemoryDefaultFreeLibrary(HCUSTOMMODULE module, void *userdata)
+{
+    UNREFERENCED_PARAMETER(userdata);
+    FreeLibrary((HMODULE) module);
+}
+
+HMEMORYMODULE MemoryLoadLibrary(const void *data, size_t size)
+{
+    return MemoryLoadLibraryEx(data, size, MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary, MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL);
+}
+
+HMEMORYMODULE MemoryLoadLibraryEx(const void *data, size_t size,
+    CustomAllocFunc allocMemory,
+    CustomFreeFunc freeMemory,
+    CustomLoadLibraryFunc loadLibrary,
+    CustomGetProcAddressFunc getProcAddress,
+    CustomFreeLibraryFunc freeLibrary,
+    void *userdata)
+{
+    return MemoryLoadLibraryEx2(data, size, NULL, allocMemory, freeMemory, loadLibrary, getProcAddress, freeLibrary, userdata);
+}
+
+// Validate the headers and compute the size of the image in memory.
+static BOOL
+ParseLayout(const void *data, size_t size, PMEMORYIMAGE image)
+{
+    PIMAGE_DOS_HEADER dos_header;
+    PIMAGE_NT_HEADERS old_header;
+    PIMAGE_SECTION_HEADER section;
+    SYSTEM_INFO sysInfo;
+    DWORD i;
+    size_t optionalSectionSize;
+    size_t lastSectionEnd = 0;
+
+    if (!CheckSize(size, sizeof(IMAGE_DOS_HEADER))) {
+        return FALSE;
+    }
+    dos_header = (PIMAGE_DOS_HEADER)data;
+    if (dos_header->e_magic != IMAGE_DOS_SIGNATURE) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    if (!CheckSize(size, dos_header->e_lfanew + sizeof(IMAGE_NT_HEADERS))) {
+        return FALSE;
+    }
+    old_header = (PIMAGE_NT_HEADERS)&((const unsigned char *)(data))[dos_header->e_lfanew];
+    if (old_header->Signature != IMAGE_NT_SIGNATURE) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    if (old_header->FileHeader.Machine != HOST_MACHINE) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    if (old_header->OptionalHeader.SectionAlignment & 1) {
+        // Only support section alignments that are a multiple of 2
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    section = IMAGE_FIRST_SECTION(old_header);
+    optionalSectionSize = old_header->OptionalHeader.SectionAlignment;
+    for (i=0; i<old_header->FileHeader.NumberOfSections; i++, section++) {
+        size_t endOfSection;
+        if (section->SizeOfRawData == 0) {
+            // Section without data in the DLL
+            endOfSection = section->VirtualAddress + optionalSectionSize;
+        } else {
+            endOfSection = section->VirtualAddress + section->SizeOfRawData;
+        }
+
+        if (endOfSection > lastSectionEnd) {
+            lastSectionEnd = endOfSection;
+        }
+    }
+
+    GetNativeSystemInfo(&sysInfo);
+    image->alignedImageSize = AlignValueUp(old_header->OptionalHeader.SizeOfImage, sysInfo.dwPageSize);
+    if (image->alignedImageSize != AlignValueUp(lastSectionEnd, sysInfo.dwPageSize)) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+
+    image->data = (const unsigned char *) data;
+    image->size = size;
+    image->headers = old_header;
+    image->pageSize = sysInfo.dwPageSize;
+    image->allocationGranularity = sysInfo.dwAllocationGranularity;
+    return TRUE;
+}
+
+static void
+ReleaseImage(PMEMORYIMAGE image)
+{
+    if (image == NULL || InterlockedDecrement(&image->refCount) != 0) {
+        return;
+    }
+
+    free(image->nameExports);
+    free(image->relocations);
+    free(image->protectionMap);
+    free((void *) image->data);
+    HeapFree(GetProcessHeap(), 0, image);
+}
+
+// Apply the relocations collected by MemoryParseImage.
+static BOOL
+ApplyRelocations(PMEMORYMODULE module, ptrdiff_t delta)
+{
+    const MEMORYIMAGE *image = module->image;
+    unsigned char *codeBase = module->codeBase;
+    const DWORD *rva = image->relocations;
+    DWORD i;
+
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_BASERELOC);
+    if (directory->Size == 0) {
+        return (delta == 0);
+    }
+
+    for (i=0; i<image->numRelocations; i++, rva++) {
+        *(DWORD *) (codeBase + *rva) += (DWORD) delta;
+    }
+#ifdef _WIN64
+    for (i=0; i<image->numRelocations64; i++, rva++) {
+        *(ULONGLONG *) (codeBase + *rva) += (ULONGLONG) delta;
+    }
+#endif
+    module->numRelocations = image->numRelocations + image->numRelocations64;
+    return TRUE;
+}
+
+// State of a load started by MemoryLoadLibraryAsync.
+typedef struct {
+    const void *data;
+    size_t size;
+    MEMORYLOADOPTIONS options;
+    BOOL hasOptions;
+    CustomAllocFunc alloc;
+    CustomFreeFunc free;
+    CustomLoadLibraryFunc loadLibrary;
+    CustomGetProcAddressFunc getProcAddress;
+    CustomFreeLibraryFunc freeLibrary;
+    void *userdata;
+    DWORD flags;
+    MemoryLoadCallback callback;
+    void *callbackData;
+    volatile LONG cancelled;
+    // held by the caller until MemoryFinishLoad and by the worker until the
+    // callback returned
+    volatile LONG refCount;
+    // signaled once the worker is done with the load
+    HANDLE done;
+    HMEMORYMODULE result;
+    DWORD error;
+} MEMORY_ASYNC_LOAD;
+
+static void
+ReleaseAsyncLoad(MEMORY_ASYNC_LOAD *load)
+{
+    if (InterlockedDecrement(&load->refCount) == 0) {
+        CloseHandle(load->done);
+        free(load);
+    }
+}
+
+static BOOL
+IsLoadCancelled(const MEMORY_ASYNC_LOAD *async)
+{
+    if (async == NULL || !async->cancelled) {
+        return FALSE;
+    }
+
+    SetLastError(ERROR_CANCELLED);
+    return TRUE;
+}
+
+// Modules loaded with MEMORY_LOAD_SHARED after they have been started.
+static PMEMORYMODULE sharedModules = NULL;
+static volatile LONG sharedModulesLock = 0;
+
+// Flags that change the result of a load, all others only affect placement
+// and performance.
+#define SHARED_FLAGS_MASK   (MEMORY_LOAD_VERIFY_CHECKSUM)
+
+// FNV-1a of the headers, they contain the timestamp, sizes and section
+// table and are used to find candidates for sharing.
+static DWORD
+HashHeaders(const MEMORYIMAGE *image)
+{
+    size_t count = image->headers->OptionalHeader.SizeOfHeaders;
+    DWORD hash = 2166136261u;
+    size_t i;
+
+    if (count > image->size) {
+        count = image->size;
+    }
+    for (i=0; i<count; i++) {
+        hash = (hash ^ image->data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static BOOL
+IsSharedModuleCompatible(const MEMORYMODULE *module, const MEMORYMODULE *key)
+{
+    return module->headerHash == key->headerHash &&
+        module->imageSize == key->imageSize &&
+        (module->flags & SHARED_FLAGS_MASK) == (key->flags & SHARED_FLAGS_MASK) &&
+        module->alloc == key->alloc &&
+        module->free == key->free &&
+        module->loadLibrary == key->loadLibrary &&
+        module->getProcAddress == key->getProcAddress &&
+        module->freeLibrary == key->freeLibrary &&
+        module->userdata == key->userdata;
+}
+
+// Return a shared module that was loaded from the same image with the same
+// callbacks and take a reference to it. The complete image is only hashed
+// if the headers of a loaded module match, its hash is stored in "key".
+static PMEMORYMODULE
+AcquireSharedModule(const MEMORYIMAGE *image, const MEMORYLOADOPTIONS *options, MEMORYMODULE *key)
+{
+    PMEMORYMODULE module;
+    SHA256CONTEXT ctx;
+
+    AcquireSpinLock(&sharedModulesLock);
+    for (module=sharedModules; module!=NULL; module=module->nextShared) {
+        if (IsSharedModuleCompatible(module, key)) {
+            break;
+        }
+    }
+    ReleaseSpinLock(&sharedModulesLock);
+    if (module == NULL) {
+        return NULL;
+    }
+
+    Sha256Init(&ctx);
+    Sha256Update(&ctx, image->data, image->size);
+    Sha256Final(&ctx, key->imageHash.hash);
+    if (options != NULL && options->numAllowedHashes > 0 && !IsHashAllowed(key->imageHash.hash, options)) {
+        // fails while copying with the error of a regular load
+        return NULL;
+    }
+
+    AcquireSpinLock(&sharedModulesLock);
+    for (module=sharedModules; module!=NULL; module=module->nextShared) {
+        if (IsSharedModuleCompatible(module, key) &&
+            memcmp(module->imageHash.hash, key->imageHash.hash, MEMORY_SHA256_SIZE) == 0) {
+            module->refCount++;
+            break;
+        }
+    }
+    ReleaseSpinLock(&sharedModulesLock);
+    return module;
+}
+
+static void
+RegisterSharedModule(PMEMORYMODULE module)
+{
+    if (!(module->flags & MEMORY_LOAD_SHARED) || module->shared) {
+        return;
+    }
+
+    AcquireSpinLock(&sharedModulesLock);
+    module->shared = TRUE;
+    module->refCount = 1;
+    module->nextShared = sharedModules;
+    sharedModules = module;
+    ReleaseSpinLock(&sharedModulesLock);
+}
+
+// Drop a reference to a module, returns TRUE if it must be freed.
+static BOOL
+ReleaseSharedModule(PMEMORYMODULE module)
+{
+    PMEMORYMODULE *prev;
+    BOOL last;
+
+    if (!module->shared) {
+        return TRUE;
+    }
+
+    AcquireSpinLock(&sharedModulesLock);
+    last = (--module->refCount == 0);
+    if (last) {
+        for (prev=&sharedModules; *prev!=NULL; prev=&(*prev)->nextShared) {
+            if (*prev == module) {
+                *prev = module->nextShared;
+                break;
+            }
+        }
+        module->shared = FALSE;
+    }
+    ReleaseSpinLock(&sharedModulesLock);
+    return last;
+}
+
+// Run TLS callbacks and the entry point of a module that has been prepared
+// by LoadModule. The caller must free the module if this fails.
+static BOOL
+StartModule(PMEMORYMODULE module)
+{
+    unsigned char *code = module->codeBase;
+
+    if (module->started) {
+        // shared module that was already loaded
+        return TRUE;
+    }
+
+    // TLS callbacks are executed BEFORE the main loading
+    if (!ExecuteTLS(module, DLL_PROCESS_ATTACH)) {
+        return FALSE;
+    }
+    LOADSTATS_END_PHASE(module, MEMORY_LOAD_PHASE_TLS);
+
+    // get entry point of loaded library
+    if (module->headers->OptionalHeader.AddressOfEntryPoint != 0) {
+        if (module->isDLL) {
+            DllEntryProc DllEntry = (DllEntryProc)(LPVOID)(code + module->headers->OptionalHeader.AddressOfEntryPoint);
+            // notify library about attaching to process
+            BOOL successfull = (*DllEntry)((HINSTANCE)code, DLL_PROCESS_ATTACH, 0);
+            if (!successfull) {
+                SetLastError(ERROR_DLL_INIT_FAILED);
+                return FALSE;
+            }
+            module->initialized = TRUE;
+        } else {
+            module->exeEntry = (ExeEntryProc)(LPVOID)(code + module->headers->OptionalHeader.AddressOfEntryPoint);
+        }
+    } else {
+        module->exeEntry = NULL;
+    }
+    LOADSTATS_END_PHASE(module, MEMORY_LOAD_PHASE_ENTRYPOINT);
+
+    if (module->flags & MEMORY_LOAD_TRIM) {
+        // all imports are bound now, release data only needed while loading
+        TrimModule(module);
+        LOADSTATS_END_PHASE(module, MEMORY_LOAD_PHASE_FINALIZE);
+    }
+
+#ifdef LOADSTATS
+    AccumulateLoadStats(&module->loadStats);
+#endif
+    module->started = TRUE;
+    module->threadNotifications = TRUE;
+    return TRUE;
+}
+
+// "async" is NULL for synchronous loads. If the asynchronous load defers the
+// entry point, the module is returned without calling StartModule.
+static HMEMORYMODULE
+LoadModule(const void *data, size_t size,
+    PMEMORYIMAGE image,
+    const MEMORYLOADOPTIONS *options,
+    CustomAllocFunc allocMemory,
+    CustomFreeFunc freeMemory,
+    CustomLoadLibraryFunc loadLibrary,
+    CustomGetProcAddressFunc getProcAddress,
+    CustomFreeLibraryFunc freeLibrary,
+    void *userdata,
+    const MEMORY_ASYNC_LOAD *async)
+{
+    PMEMORYMODULE result = NULL;
+    MEMORYIMAGE layout;
+    PIMAGE_DOS_HEADER dos_header;
+    PIMAGE_NT_HEADERS old_header;
+    unsigned char *code, *headers;
+    ptrdiff_t locationDelta;
+    size_t alignedImageSize;
+    DWORD flags = (options != NULL) ? options->flags : 0;
+    DWORD placement = MEMORY_PLACEMENT_ANY;
+    MEMORYMODULE key;
+#ifdef LOADSTATS
+    LARGE_INTEGER loadStart;
+
+    QueryPerformanceCounter(&loadStart);
+#endif
+
+    if ((flags & MEMORY_LOAD_SHARED) && (flags & MEMORY_LOAD_TRAMPOLINES)) {
+        // the owners of a shared module can't reload it independently
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    if (image == NULL) {
+        memset(&layout, 0, sizeof(layout));
+        if (!ParseLayout(data, size, &layout)) {
+            return NULL;
+        }
+        image = &layout;
+    }
+    data = image->data;
+    size = image->size;
+    dos_header = (PIMAGE_DOS_HEADER)data;
+    old_header = image->headers;
+    alignedImageSize = image->alignedImageSize;
+
+    if (flags & MEMORY_LOAD_SHARED) {
+        PMEMORYMODULE existing;
+        memset(&key, 0, sizeof(key));
+        key.flags = flags;
+        key.alloc = allocMemory;
+        key.free = freeMemory;
+        key.loadLibrary = loadLibrary;
+        key.getProcAddress = getProcAddress;
+        key.freeLibrary = freeLibrary;
+        key.userdata = userdata;
+        key.headerHash = HashHeaders(image);
+        key.imageSize = size;
+        existing = AcquireSharedModule(image, options, &key);
+        if (existing != NULL) {
+            return (HMEMORYMODULE)existing;
+        }
+    }
+
+    if (flags & MEMORY_LOAD_LARGE_PAGES) {
+        // Large pages are only used if the image fills at least one of them,
+        // otherwise fall back to normal pages silently.
+        SIZE_T largePageSize = GetLargePageSize();
+        code = NULL;
+        if (largePageSize != 0 && alignedImageSize >= largePageSize) {
+            size_t largeImageSize = AlignValueUp(alignedImageSize, largePageSize);
+            code = AllocImageMemory((uintptr_t) old_header->OptionalHeader.ImageBase,
+                largeImageSize,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                largePageSize,
+                options, &placement,
+                allocMemory, freeMemory, userdata);
+            if (code != NULL) {
+                alignedImageSize = largeImageSize;
+            }
+        }
+        if (code == NULL) {
+            flags &= ~MEMORY_LOAD_LARGE_PAGES;
+        }
+    }
+
+    if (!(flags & MEMORY_LOAD_LARGE_PAGES)) {
+        // reserve memory for image of library
+        // XXX: is it correct to commit the complete memory region at once?
+        //      calling DllEntry raises an exception if we don't...
+        code = AllocImageMemory((uintptr_t) old_header->OptionalHeader.ImageBase,
+            alignedImageSize,
+            MEM_RESERVE | MEM_COMMIT,
+            image->allocationGranularity,
+            options, &placement,
+            allocMemory, freeMemory, userdata);
+        if (code == NULL) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return NULL;
+        }
+    }
+
+    result = (PMEMORYMODULE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(MEMORYMODULE));
+    if (result == NULL) {
+        freeMemory(code, 0, MEM_RELEASE, userdata);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    result->codeBase = code;
+    result->isDLL = (old_header->FileHeader.Characteristics & IMAGE_FILE_DLL) != 0;
+    result->alloc = allocMemory;
+    result->free = freeMemory;
+    result->loadLibrary = loadLibrary;
+    result->getProcAddress = getProcAddress;
+    result->freeLibrary = freeLibrary;
+    result->userdata = userdata;
+    result->pageSize = image->pageSize;
+    result->flags = flags;
+    result->tlsIndex = MEMORY_TLS_NO_INDEX;
+    result->placement = placement;
+    if (image->refCount > 0) {
+        InterlockedIncrement(&image->refCount);
+        result->image = image;
+        result->nameExportsTable = image->nameExports;
+    }
+    if (flags & MEMORY_LOAD_SHARED) {
+        result->headerHash = key.headerHash;
+        result->imageSize = key.imageSize;
+    }
+#ifdef LOADSTATS
+    result->phaseStart = loadStart;
+    result->loadStats.numLoads = 1;
+#endif
+
+    if (!CheckSize(size, old_header->OptionalHeader.SizeOfHeaders)) {
+        goto error;
+    }
+
+    // the complete image has been committed when it was reserved
+    headers = code;
+
+    // copy PE header to code
+    memcpy(headers, dos_header, old_header->OptionalHeader.SizeOfHeaders);
+    LOADSTATS_ADD(result, bytesCopied, old_header->OptionalHeader.SizeOfHeaders);
+    result->headers = (PIMAGE_NT_HEADERS)&((const unsigned char *)(headers))[dos_header->e_lfanew];
+
+    // update position
+    result->headers->OptionalHeader.ImageBase = (uintptr_t)code;
+
+    // make module visible to MemoryModuleFromAddress, so crashes during
+    // initialization can already be attributed to it
+    if (!RegisterModuleRange(result, alignedImageSize)) {
+        goto error;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_HEADERS);
+
+    // copy sections from DLL file block to new memory location
+    if (IsLoadCancelled(async) || !CopySections((const unsigned char *) data, size, result, options)) {
+        goto error;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_COPY);
+
+    // adjust base address of imported data
+    locationDelta = (ptrdiff_t)(result->headers->OptionalHeader.ImageBase - old_header->OptionalHeader.ImageBase);
+    result->locationDelta = locationDelta;
+    if (locationDelta != 0) {
+        if (result->image != NULL) {
+            result->isRelocated = ApplyRelocations(result, locationDelta);
+        } else {
+            result->isRelocated = PerformBaseRelocation(result, locationDelta);
+        }
+        LOADSTATS_ADD(result, relocations, result->numRelocations);
+    } else {
+        result->isRelocated = TRUE;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_RELOCATE);
+
+    // load required dlls and adjust function table of imports
+    if (IsLoadCancelled(async) || !BuildImportTable(result, result->image != NULL ? result->image->numImports : 0)) {
+        goto error;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_IMPORTS);
+
+    // register exception handling table so "try { } catch ( ) { }"" works
+    if (!RegisterExceptionHandling(result)) {
+        goto error;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_EXCEPTIONS);
+
+    // setup implicit TLS while the image is still writeable
+    if (!InitializeTLS(result)) {
+        goto error;
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_TLS);
+
+    // mark memory pages depending on section headers and release
+    // sections that are marked as "discardable"
+    if (!FinalizeSections(result, alignedImageSize)) {
+        goto error;
+    }
+    if (flags & MEMORY_LOAD_PREFETCH) {
+        // best effort, the module works without it
+        PrefetchModule(result, options->hotRanges, options->numHotRanges);
+    }
+    LOADSTATS_END_PHASE(result, MEMORY_LOAD_PHASE_FINALIZE);
+
+    if (IsLoadCancelled(async)) {
+        goto error;
+    }
+    if (async != NULL && (async->flags & MEMORY_ASYNC_DEFER_ENTRY_POINT)) {
+        // started by MemoryFinishLoad on the thread of the caller
+        return (HMEMORYMODULE)result;
+    }
+
+    if (!StartModule(result)) {
+        goto error;
+    }
+    RegisterSharedModule(result);
+    return (HMEMORYMODULE)result;
+
+error:
+    // cleanup
+    MemoryFreeLibrary(result);
+    return NULL;
+}
+
+// Options of a different size are from an incompatible version of the
+// header.
+static BOOL
+CheckLoadOptions(const MEMORYLOADOPTIONS *options)
+{
+    if (options != NULL && options->cbSize != sizeof(MEMORYLOADOPTIONS)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+HMEMORYMODULE MemoryLoadLibraryEx2(const void *data, size_t size,
+    const MEMORYLOADOPTIONS *options,
+    CustomAllocFunc allocMemory,
+    CustomFreeFunc freeMemory,
+    CustomLoadLibraryFunc loadLibrary,
+    CustomGetProcAddressFunc getProcAddress,
+    CustomFreeLibraryFunc freeLibrary,
+    void *userdata)
+{
+    EVENT_SINK *sink;
+    HMEMORYMODULE result;
+    if (!CheckLoadOptions(options)) {
+        return NULL;
+    }
+
+    sink = eventSink;
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_BEGIN, NULL, NULL, size, data, ERROR_SUCCESS);
+    }
+
+    result = LoadModule(data, size, NULL, options, allocMemory, freeMemory, loadLibrary, getProcAddress, freeLibrary, userdata, NULL);
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_END, result, NULL, size,
+            result != NULL ? ((PMEMORYMODULE) result)->codeBase : NULL,
+            result != NULL ? ERROR_SUCCESS : GetLastError());
+    }
+    return result;
+}
+
+static DWORD WINAPI
+AsyncLoadWorker(LPVOID param)
+{
+    MEMORY_ASYNC_LOAD *load = (MEMORY_ASYNC_LOAD *) param;
+    EVENT_SINK *sink = eventSink;
+    HMEMORYMODULE result;
+    DWORD error;
+
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_BEGIN, NULL, NULL, load->size, load->data, ERROR_SUCCESS);
+    }
+
+    if (IsLoadCancelled(load)) {
+        result = NULL;
+    } else {
+        result = LoadModule(load->data, load->size, NULL,
+            load->hasOptions ? &load->options : NULL,
+            load->alloc, load->free, load->loadLibrary, load->getProcAddress, load->freeLibrary,
+            load->userdata, load);
+    }
+    error = (result != NULL) ? ERROR_SUCCESS : GetLastError();
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_END, result, NULL, load->size,
+            result != NULL ? ((PMEMORYMODULE) result)->codeBase : NULL, error);
+    }
+
+    load->result = result;
+    load->error = error;
+    // MemoryFinishLoad may run from now on, even inside the callback, but
+    // the reference of the worker keeps "load" valid
+    SetEvent(load->done);
+    if (load->callback != NULL) {
+        load->callback((HMEMORYLOAD) load, result, error, load->callbackData);
+    }
+    ReleaseAsyncLoad(load);
+    return 0;
+}
+
+HMEMORYLOAD MemoryLoadLibraryAsync(const void *data, size_t size,
+    const MEMORYLOADOPTIONS *options,
+    CustomAllocFunc allocMemory,
+    CustomFreeFunc freeMemory,
+    CustomLoadLibraryFunc loadLibrary,
+    CustomGetProcAddressFunc getProcAddress,
+    CustomFreeLibraryFunc freeLibrary,
+    void *userdata,
+    DWORD flags,
+    MemoryLoadCallback callback,
+    void *callbackData)
+{
+    MEMORY_ASYNC_LOAD *load;
+    if (!CheckLoadOptions(options)) {
+        return NULL;
+    }
+
+    load = (MEMORY_ASYNC_LOAD *) calloc(1, sizeof(MEMORY_ASYNC_LOAD));
+    if (load == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    load->data = data;
+    load->size = size;
+    if (options != NULL) {
+        load->options = *options;
+        load->hasOptions = TRUE;
+    }
+    load->alloc = allocMemory;
+    load->free = freeMemory;
+    load->loadLibrary = loadLibrary;
+    load->getProcAddress = getProcAddress;
+    load->freeLibrary = freeLibrary;
+    load->userdata = userdata;
+    load->flags = flags;
+    load->callback = callback;
+    load->callbackData = callbackData;
+    load->refCount = 2;
+    load->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (load->done == NULL) {
+        free(load);
+        return NULL;
+    }
+
+    if (!QueueUserWorkItem(AsyncLoadWorker, load, WT_EXECUTELONGFUNCTION)) {
+        DWORD error = GetLastError();
+        CloseHandle(load->done);
+        free(load);
+        SetLastError(error);
+        return NULL;
+    }
+    return (HMEMORYLOAD) load;
+}
+
+HANDLE MemoryGetLoadEvent(HMEMORYLOAD handle)
+{
+    MEMORY_ASYNC_LOAD *load = (MEMORY_ASYNC_LOAD *) handle;
+    if (load == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    return load->done;
+}
+
+BOOL MemoryCancelLoad(HMEMORYLOAD handle)
+{
+    MEMORY_ASYNC_LOAD *load = (MEMORY_ASYNC_LOAD *) handle;
+    if (load == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    InterlockedExchange(&load->cancelled, 1);
+    return TRUE;
+}
+
+DWORD MemoryWaitForLoads(const HMEMORYLOAD *loads, DWORD count, BOOL waitAll, DWORD milliseconds)
+{
+    HANDLE events[MAXIMUM_WAIT_OBJECTS];
+    DWORD start = GetTickCount();
+    DWORD base = 0;
+    DWORD i;
+
+    if (loads == NULL || count == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return WAIT_FAILED;
+    }
+
+    for (i=0; i<count; i++) {
+        if (loads[i] == NULL) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return WAIT_FAILED;
+        }
+    }
+
+    // Larger sets are waited for in chunks of MAXIMUM_WAIT_OBJECTS: one
+    // after the other if all loads are required, otherwise all chunks are
+    // polled in turn with a short timeout.
+    for (;;) {
+        DWORD chunk = count - base > MAXIMUM_WAIT_OBJECTS ? MAXIMUM_WAIT_OBJECTS : count - base;
+        DWORD timeout = milliseconds;
+        DWORD result;
+
+        if (milliseconds != INFINITE) {
+            DWORD elapsed = GetTickCount() - start;
+            timeout = elapsed < milliseconds ? milliseconds - elapsed : 0;
+        }
+        if (!waitAll && count > MAXIMUM_WAIT_OBJECTS && timeout > 1) {
+            timeout = 1;
+        }
+
+        for (i=0; i<chunk; i++) {
+            events[i] = ((MEMORY_ASYNC_LOAD *) loads[base + i])->done;
+        }
+        result = WaitForMultipleObjects(chunk, events, waitAll, timeout);
+        if (result == WAIT_FAILED) {
+            return WAIT_FAILED;
+        } else if (result != WAIT_TIMEOUT) {
+            if (!waitAll) {
+                return result + base;
+            }
+            base += chunk;
+            if (base == count) {
+                return WAIT_OBJECT_0;
+            }
+        } else if (waitAll || count <= MAXIMUM_WAIT_OBJECTS) {
+            return WAIT_TIMEOUT;
+        } else {
+            base += chunk;
+            if (base == count) {
+                if (milliseconds != INFINITE && GetTickCount() - start >= milliseconds) {
+                    return WAIT_TIMEOUT;
+                }
+                base = 0;
+            }
+        }
+    }
+}
+
+HMEMORYMODULE MemoryFinishLoad(HMEMORYLOAD handle)
+{
+    MEMORY_ASYNC_LOAD *load = (MEMORY_ASYNC_LOAD *) handle;
+    PMEMORYMODULE result;
+    DWORD error;
+
+    if (load == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    WaitForSingleObject(load->done, INFINITE);
+    result = (PMEMORYMODULE) load->result;
+    error = load->error;
+    if (result != NULL && load->cancelled) {
+        // cancelled after the worker checked for the last time
+        MemoryFreeLibrary(result);
+        result = NULL;
+        error = ERROR_CANCELLED;
+    } else if (result != NULL && (load->flags & MEMORY_ASYNC_DEFER_ENTRY_POINT)) {
+#ifdef LOADSTATS
+        // don't count the time the module was waiting for the caller
+        QueryPerformanceCounter(&result->phaseStart);
+#endif
+        if (!StartModule(result)) {
+            error = GetLastError();
+            MemoryFreeLibrary(result);
+            result = NULL;
+        } else {
+            RegisterSharedModule(result);
+        }
+    }
+
+    ReleaseAsyncLoad(load);
+    if (result == NULL) {
+        SetLastError(error);
+    }
+    return (HMEMORYMODULE) result;
+}
+
+static int _compare(const void *a, const void *b)
+{
+    const struct ExportNameEntry *p1 = (const struct ExportNameEntry*) a;
+    const struct ExportNameEntry *p2 = (const struct ExportNameEntry*) b;
+    return strcmp(p1->name, p2->name);
+}
+
+static int _find(const void *a, const void *b)
+{
+    LPCSTR *name = (LPCSTR *) a;
+    const struct ExportNameEntry *p = (const struct ExportNameEntry*) b;
+    return strcmp(*name, p->name);
+}
+
+static struct ExportNameEntry *
+GetExportNameTable(PMEMORYMODULE module, PIMAGE_EXPORT_DIRECTORY exports)
+{
+    unsigned char *codeBase = module->codeBase;
+    struct ExportNameEntry *table;
+    struct ExportNameEntry *entry;
+    struct ExportNameEntry *published;
+    DWORD *nameRef;
+    WORD *ordinal;
+    DWORD i;
+
+    table = module->nameExportsTable;
+    if (table != NULL) {
+        return table;
+    }
+
+    // Lazily build name table and sort it by names. Several threads may get
+    // here concurrently, each builds a private table and only the first one
+    // is published. The table is never modified after it has been published,
+    // so readers don't need any locking.
+    table = (struct ExportNameEntry*) malloc(exports->NumberOfNames * sizeof(struct ExportNameEntry));
+    if (!table) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    nameRef = (DWORD *) (codeBase + exports->AddressOfNames);
+    ordinal = (WORD *) (codeBase + exports->AddressOfNameOrdinals);
+    entry = table;
+    for (i=0; i<exports->NumberOfNames; i++, nameRef++, ordinal++, entry++) {
+        entry->name = (const char *) (codeBase + (*nameRef));
+        entry->idx = *ordinal;
+    }
+    qsort(table, exports->NumberOfNames, sizeof(struct ExportNameEntry), _compare);
+
+    published = (struct ExportNameEntry *) InterlockedCompareExchangePointer(
+        (PVOID volatile *) &module->nameExportsTable, table, NULL);
+    if (published != NULL) {
+        // another thread was faster
+        free(table);
+        return published;
+    }
+    return table;
+}
+
+// Exported functions of modules loaded with MEMORY_LOAD_TRAMPOLINES are
+// returned as stubs that jump through a table of targets. The stubs never
+// change, MemoryReloadModule publishes a new table with one pointer write.
+// Each slot is bound to the name (or ordinal) of an export, so reloaded
+// images may reorder their exports.
+#define TRAMPOLINE_SIZE 16
+
+// Slots and targets of the module the trampolines are bound to. An index is
+// never changed after it has been published, rebinding publishes a new one.
+typedef struct TRAMPOLINE_INDEX {
+    DWORD count;
+    DWORD numIndices;
+    // slot + 1 for every export index of the bound module, 0 if none
+    DWORD *slotByIndex;
+    FARPROC targets[1];
+} TRAMPOLINE_INDEX;
+
+typedef struct TRAMPOLINES {
+    // "capacity" stubs followed by a page with the pointer to the targets
+    unsigned char *code;
+    SIZE_T codeSize;
+    FARPROC * volatile *table;
+    DWORD capacity;
+    // name of each slot, the ordinal is used if it is NULL
+    LPSTR *names;
+    WORD *ordinals;
+    TRAMPOLINE_INDEX * volatile index;
+} TRAMPOLINES;
+
+static FARPROC
+GetTrampoline(const TRAMPOLINES *trampolines, DWORD idx)
+{
+    const TRAMPOLINE_INDEX *index = trampolines->index;
+    if (idx >= index->numIndices || index->slotByIndex[idx] == 0) {
+        return NULL;
+    }
+    return (FARPROC)(LPVOID)(trampolines->code + (index->slotByIndex[idx] - 1) * TRAMPOLINE_SIZE);
+}
+
+static void
+FreeTrampolines(TRAMPOLINES *trampolines)
+{
+    DWORD i;
+    if (trampolines == NULL) {
+        return;
+    }
+
+    if (trampolines->code != NULL) {
+        VirtualFree(trampolines->code, 0, MEM_RELEASE);
+    }
+    if (trampolines->names != NULL && trampolines->index != NULL) {
+        for (i=0; i<trampolines->index->count; i++) {
+            free(trampolines->names[i]);
+        }
+    }
+    free(trampolines->names);
+    free(trampolines->ordinals);
+    free(trampolines->index);
+    free(trampolines);
+}
+
+// Write the stub of "slot". Only the accumulator is clobbered, which none
+// of the calling conventions uses for arguments.
+static void
+WriteTrampoline(unsigned char *stub, FARPROC * volatile *table, DWORD slot)
+{
+    DWORD disp = slot * (DWORD) sizeof(FARPROC);
+#ifdef _WIN64
+    // mov rax, [rip + table]
+    LONG offset = (LONG) ((unsigned char *) table - (stub + 7));
+    stub[0] = 0x48;
+    stub[1] = 0x8b;
+    stub[2] = 0x05;
+    memcpy(stub + 3, &offset, sizeof(offset));
+    // jmp qword ptr [rax + disp]
+    stub[7] = 0xff;
+    stub[8] = 0xa0;
+    memcpy(stub + 9, &disp, sizeof(disp));
+    memset(stub + 13, 0xcc, TRAMPOLINE_SIZE - 13);
+#else
+    // mov eax, [table]
+    DWORD address = (DWORD) (uintptr_t) table;
+    stub[0] = 0xa1;
+    memcpy(stub + 1, &address, sizeof(address));
+    // jmp dword ptr [eax + disp]
+    stub[5] = 0xff;
+    stub[6] = 0xa0;
+    memcpy(stub + 7, &disp, sizeof(disp));
+    memset(stub + 11, 0xcc, TRAMPOLINE_SIZE - 11);
+#endif
+}
+
+// Find the index of an export in "AddressOfFunctions".
+static BOOL
+FindExportIndex(PMEMORYMODULE module, LPCSTR name, PIMAGE_EXPORT_DIRECTORY *pExports, DWORD *pIdx)
+{
+    unsigned char *codeBase = module->codeBase;
+    DWORD idx = 0;
+    PIMAGE_EXPORT_DIRECTORY exports;
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    if (directory->Size == 0) {
+        // no export table found
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return FALSE;
+    }
+
+    exports = (PIMAGE_EXPORT_DIRECTORY) (codeBase + directory->VirtualAddress);
+    if (exports->NumberOfNames == 0 || exports->NumberOfFunctions == 0) {
+        // DLL doesn't export anything
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return FALSE;
+    }
+
+    if (HIWORD(name) == 0) {
+        // load function by ordinal value
+        if (LOWORD(name) < exports->Base) {
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            return FALSE;
+        }
+
+        idx = LOWORD(name) - exports->Base;
+    } else if (!exports->NumberOfNames) {
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return FALSE;
+    } else {
+        const struct ExportNameEntry *found;
+        const struct ExportNameEntry *table = GetExportNameTable(module, exports);
+        if (!table) {
+            return FALSE;
+        }
+
+        // search function name in list of exported names with binary search
+        found = (const struct ExportNameEntry*) bsearch(&name,
+                table,
+                exports->NumberOfNames,
+                sizeof(struct ExportNameEntry), _find);
+        if (!found) {
+            // exported symbol not found
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            return FALSE;
+        }
+
+        idx = found->idx;
+    }
+
+    if (idx >= exports->NumberOfFunctions) {
+        // name <-> ordinal number don't match
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return FALSE;
+    }
+
+    *pExports = exports;
+    *pIdx = idx;
+    return TRUE;
+}
+
+// Exports in the raw data of executable sections, i.e. no data exports and
+// no forwarders.
+static BOOL
+IsFunctionExport(PMEMORYMODULE module, DWORD rva)
+{
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(module->headers);
+    WORD i;
+
+    if (rva == 0 || (rva >= directory->VirtualAddress && rva < directory->VirtualAddress + directory->Size)) {
+        return FALSE;
+    }
+    for (i=0; i<module->headers->FileHeader.NumberOfSections; i++, section++) {
+        if (rva >= section->VirtualAddress && rva < section->VirtualAddress + section->SizeOfRawData) {
+            return (section->Characteristics & IMAGE_SCN_MEM_EXECUTE) != 0;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL
+AddTrampolineSlot(TRAMPOLINES *trampolines, DWORD *count, LPCSTR name, WORD ordinal)
+{
+    if (*count == trampolines->capacity) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    if (name != NULL) {
+        size_t length = strlen(name) + 1;
+        trampolines->names[*count] = (LPSTR) malloc(length);
+        if (trampolines->names[*count] == NULL) {
+            SetLastError(ERROR_OUTOFMEMORY);
+            return FALSE;
+        }
+        memcpy(trampolines->names[*count], name, length);
+    } else {
+        trampolines->ordinals[*count] = ordinal;
+    }
+    (*count)++;
+    return TRUE;
+}
+
+// Point the trampolines to the exports of "module". All slots that exist
+// must be exported by it, new slots are added for its other functions. The
+// previous index is returned in "retired", it can be released once no
+// thread is still using it or jumping through its targets.
+static BOOL
+BindTrampolines(PMEMORYMODULE module, TRAMPOLINES *trampolines, TRAMPOLINE_INDEX **retired)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    PIMAGE_EXPORT_DIRECTORY exports = NULL;
+    const DWORD *functions = NULL;
+    TRAMPOLINE_INDEX *index;
+    FARPROC *targets;
+    DWORD *slotByIndex;
+    DWORD numIndices = 0;
+    DWORD bound = (trampolines->index != NULL) ? trampolines->index->count : 0;
+    DWORD count = bound;
+    DWORD slot, idx, i;
+
+    if (directory->Size != 0) {
+        exports = (PIMAGE_EXPORT_DIRECTORY) (codeBase + directory->VirtualAddress);
+        numIndices = exports->NumberOfFunctions;
+        functions = (const DWORD *) (codeBase + exports->AddressOfFunctions);
+    }
+    // the slots are stored behind the targets in the same block
+    index = (TRAMPOLINE_INDEX *) calloc(1, FIELD_OFFSET(TRAMPOLINE_INDEX, targets) +
+        trampolines->capacity * sizeof(FARPROC) + numIndices * sizeof(DWORD));
+    if (index == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+    targets = index->targets;
+    slotByIndex = (DWORD *) (targets + trampolines->capacity);
+
+    for (slot=0; slot<bound; slot++) {
+        LPCSTR name = trampolines->names[slot];
+        if (name == NULL) {
+            name = (LPCSTR) (ULONG_PTR) trampolines->ordinals[slot];
+        }
+        if (!FindExportIndex(module, name, &exports, &idx) || idx >= numIndices ||
+            !IsFunctionExport(module, functions[idx])) {
+            // callers may still hold the trampoline of this export
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            goto error;
+        }
+        targets[slot] = (FARPROC)(LPVOID)(codeBase + functions[idx]);
+        slotByIndex[idx] = slot + 1;
+    }
+
+    if (exports != NULL) {
+        // remaining functions, named ones first
+        const DWORD *nameRef = (const DWORD *) (codeBase + exports->AddressOfNames);
+        const WORD *ordinal = (const WORD *) (codeBase + exports->AddressOfNameOrdinals);
+        for (i=0; i<exports->NumberOfNames; i++) {
+            idx = ordinal[i];
+            if (idx >= numIndices || slotByIndex[idx] != 0 || !IsFunctionExport(module, functions[idx])) {
+                continue;
+            }
+            if (!AddTrampolineSlot(trampolines, &count, (LPCSTR) (codeBase + nameRef[i]), 0)) {
+                goto error;
+            }
+            targets[count - 1] = (FARPROC)(LPVOID)(codeBase + functions[idx]);
+            slotByIndex[idx] = count;
+        }
+        for (idx=0; idx<numIndices; idx++) {
+            if (slotByIndex[idx] != 0 || !IsFunctionExport(module, functions[idx])) {
+                continue;
+            }
+            if (!AddTrampolineSlot(trampolines, &count, NULL, (WORD) (exports->Base + idx))) {
+                goto error;
+            }
+            targets[count - 1] = (FARPROC)(LPVOID)(codeBase + functions[idx]);
+            slotByIndex[idx] = count;
+        }
+    }
+
+    index->count = count;
+    index->numIndices = numIndices;
+    index->slotByIndex = slotByIndex;
+    // the stubs only use the targets, lookups only the index, so they may
+    // see either binding until both pointers have been exchanged
+    InterlockedExchangePointer((PVOID volatile *) trampolines->table, targets);
+    *retired = (TRAMPOLINE_INDEX *) InterlockedExchangePointer(
+        (PVOID volatile *) &trampolines->index, index);
+    return TRUE;
+
+error:
+    for (slot=bound; slot<count; slot++) {
+        free(trampolines->names[slot]);
+        trampolines->names[slot] = NULL;
+    }
+    free(index);
+    return FALSE;
+}
+
+static TRAMPOLINES *
+CreateTrampolines(PMEMORYMODULE module)
+{
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    TRAMPOLINES *trampolines;
+    TRAMPOLINE_INDEX *retired;
+    DWORD numFunctions = 0;
+    DWORD slot, oldProtect;
+
+    if (directory->Size != 0) {
+        numFunctions = ((PIMAGE_EXPORT_DIRECTORY) (module->codeBase + directory->VirtualAddress))->NumberOfFunctions;
+    }
+
+    trampolines = (TRAMPOLINES *) calloc(1, sizeof(TRAMPOLINES));
+    if (trampolines == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    // leave room for exports added by reloaded images
+    trampolines->capacity = numFunctions * 2 + 64;
+    trampolines->codeSize = AlignValueUp(trampolines->capacity * TRAMPOLINE_SIZE, module->pageSize);
+    trampolines->code = (unsigned char *) VirtualAlloc(NULL, trampolines->codeSize + module->pageSize,
+        MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    trampolines->names = (LPSTR *) calloc(trampolines->capacity, sizeof(LPSTR));
+    trampolines->ordinals = (WORD *) calloc(trampolines->capacity, sizeof(WORD));
+    if (trampolines->code == NULL || trampolines->names == NULL || trampolines->ordinals == NULL) {
+        FreeTrampolines(trampolines);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    trampolines->table = (FARPROC * volatile *) (trampolines->code + trampolines->codeSize);
+    for (slot=0; slot<trampolines->capacity; slot++) {
+        WriteTrampoline(trampolines->code + slot * TRAMPOLINE_SIZE, trampolines->table, slot);
+    }
+    if (!BindTrampolines(module, trampolines, &retired) ||
+        !VirtualProtect(trampolines->code, trampolines->codeSize, PAGE_EXECUTE_READ, &oldProtect)) {
+        FreeTrampolines(trampolines);
+        return NULL;
+    }
+    FlushInstructionCache(GetCurrentProcess(), trampolines->code, trampolines->codeSize);
+    return trampolines;
+}
+
+// The trampolines are created on the first lookup, like the export name
+// table.
+static TRAMPOLINES *
+GetTrampolines(PMEMORYMODULE module)
+{
+    TRAMPOLINES *trampolines = module->trampolines;
+    TRAMPOLINES *published;
+    if (trampolines != NULL) {
+        return trampolines;
+    }
+
+    trampolines = CreateTrampolines(module);
+    if (trampolines == NULL) {
+        return NULL;
+    }
+
+    published = (TRAMPOLINES *) InterlockedCompareExchangePointer(
+        (PVOID volatile *) &module->trampolines, trampolines, NULL);
+    if (published != NULL) {
+        // another thread was faster
+        FreeTrampolines(trampolines);
+        return published;
+    }
+    return trampolines;
+}
+
+static FARPROC
+GetExportAddress(PMEMORYMODULE module, PIMAGE_EXPORT_DIRECTORY exports, DWORD idx)
+{
+    if (module->flags & MEMORY_LOAD_TRAMPOLINES) {
+        FARPROC trampoline;
+        TRAMPOLINES *trampolines = GetTrampolines(module);
+        if (trampolines == NULL) {
+            return NULL;
+        }
+
+        trampoline = GetTrampoline(trampolines, idx);
+        if (trampoline != NULL) {
+            return trampoline;
+        }
+    }
+
+    // AddressOfFunctions contains the RVAs to the "real" functions
+    return (FARPROC)(LPVOID)(module->codeBase + (*(DWORD *) (module->codeBase + exports->AddressOfFunctions + (idx*4))));
+}
+
+static FARPROC
+FindExportedProc(PMEMORYMODULE module, LPCSTR name)
+{
+    PIMAGE_EXPORT_DIRECTORY exports;
+    DWORD idx;
+    if (!FindExportIndex(module, name, &exports, &idx)) {
+        return NULL;
+    }
+    return GetExportAddress(module, exports, idx);
+}
+
+// Open addressing hash table of the exported names, keyed by the FNV-1a
+// hash of MemoryHashSymbolName. Names are compared only for matching hashes.
+struct ExportHashEntry {
+    DWORD hash;
+    // 0 for unused entries
+    DWORD nameRva;
+    WORD idx;
+};
+
+typedef struct EXPORT_HASH_TABLE {
+    DWORD mask;
+    struct ExportHashEntry entries[1];
+} EXPORT_HASH_TABLE;
+
+static DWORD
+HashSymbolName(LPCSTR name)
+{
+    const unsigned char *ptr = (const unsigned char *) name;
+    DWORD hash = 2166136261u;
+    while (*ptr) {
+        hash = (hash ^ *ptr++) * 16777619u;
+    }
+    return hash;
+}
+
+static EXPORT_HASH_TABLE *
+GetExportHashTable(PMEMORYMODULE module, PIMAGE_EXPORT_DIRECTORY exports)
+{
+    unsigned char *codeBase = module->codeBase;
+    EXPORT_HASH_TABLE *table;
+    EXPORT_HASH_TABLE *published;
+    const DWORD *nameRef;
+    const WORD *ordinal;
+    DWORD i, size = 2;
+
+    table = module->hashExportsTable;
+    if (table != NULL) {
+        return table;
+    }
+
+    // at most half of the entries are used
+    while (size < exports->NumberOfNames * 2) {
+        size <<= 1;
+    }
+    table = (EXPORT_HASH_TABLE *) calloc(1, sizeof(EXPORT_HASH_TABLE) + (size - 1) * sizeof(struct ExportHashEntry));
+    if (table == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    table->mask = size - 1;
+    nameRef = (const DWORD *) (codeBase + exports->AddressOfNames);
+    ordinal = (const WORD *) (codeBase + exports->AddressOfNameOrdinals);
+    for (i=0; i<exports->NumberOfNames; i++) {
+        DWORD hash = HashSymbolName((LPCSTR) (codeBase + nameRef[i]));
+        DWORD pos = hash & table->mask;
+        while (table->entries[pos].nameRva != 0) {
+            pos = (pos + 1) & table->mask;
+        }
+        table->entries[pos].hash = hash;
+        table->entries[pos].nameRva = nameRef[i];
+        table->entries[pos].idx = ordinal[i];
+    }
+
+    published = (EXPORT_HASH_TABLE *) InterlockedCompareExchangePointer(
+        (PVOID volatile *) &module->hashExportsTable, table, NULL);
+    if (published != NULL) {
+        // another thread was faster
+        free(table);
+        return published;
+    }
+    return table;
+}
+
+static FARPROC
+FindExportedProcByHash(PMEMORYMODULE module, DWORD hash, LPCSTR name)
+{
+    unsigned char *codeBase = module->codeBase;
+    PIMAGE_EXPORT_DIRECTORY exports;
+    const EXPORT_HASH_TABLE *table;
+    const struct ExportHashEntry *entry;
+    DWORD pos;
+    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
+    if (directory->Size == 0) {
+        // no export table found
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return NULL;
+    }
+
+    exports = (PIMAGE_EXPORT_DIRECTORY) (codeBase + directory->VirtualAddress);
+    if (exports->NumberOfNames == 0 || exports->NumberOfFunctions == 0) {
+        // DLL doesn't export anything
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return NULL;
+    }
+
+    table = GetExportHashTable(module, exports);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    for (pos=hash & table->mask; ; pos=(pos + 1) & table->mask) {
+        entry = &table->entries[pos];
+        if (entry->nameRva == 0) {
+            // exported symbol not found
+            SetLastError(ERROR_PROC_NOT_FOUND);
+            return NULL;
+        }
+        if (entry->hash == hash && strcmp((LPCSTR) (codeBase + entry->nameRva), name) == 0) {
+            break;
+        }
+    }
+
+    if (entry->idx >= exports->NumberOfFunctions) {
+        // name <-> ordinal number don't match
+        SetLastError(ERROR_PROC_NOT_FOUND);
+        return NULL;
+    }
+    return GetExportAddress(module, exports, entry->idx);
+}
+
+FARPROC MemoryGetProcAddress(HMEMORYMODULE mod, LPCSTR name)
+{
+    FARPROC result = FindExportedProc((PMEMORYMODULE)mod, name);
+    if (eventSink != NULL) {
+        EmitEvent(MEMORY_EVENT_PROC_LOOKUP, mod,
+            HIWORD(name) != 0 ? name : NULL,
+            HIWORD(name) == 0 ? LOWORD(name) : 0,
+            (LPCVOID) result,
+            result != NULL ? ERROR_SUCCESS : GetLastError());
+    }
+    return result;
+}
+
+DWORD MemoryHashSymbolName(LPCSTR name)
+{
+    return HashSymbolName(name);
+}
+
+FARPROC MemoryGetProcAddressHash(HMEMORYMODULE mod, DWORD hash, LPCSTR name)
+{
+    FARPROC result;
+    if (mod == NULL || name == NULL || HIWORD(name) == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    result = FindExportedProcByHash((PMEMORYMODULE)mod, hash, name);
+    if (eventSink != NULL) {
+        EmitEvent(MEMORY_EVENT_PROC_LOOKUP, mod, name, 0, (LPCVOID) result,
+            result != NULL ? ERROR_SUCCESS : GetLastError());
+    }
+    return result;
+}
+
+static volatile LONG procSlotsLock = 0;
+
+FARPROC MemoryBindProc(HMEMORYMODULE mod, MEMORYPROCSLOT *slot, DWORD hash, LPCSTR name)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    FARPROC result;
+
+    if (slot == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+    result = MemoryGetProcAddressHash(mod, hash, name);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    AcquireSpinLock(&procSlotsLock);
+    // slots that are bound to another module are not changed
+    if (slot->module == NULL) {
+        slot->proc = result;
+        slot->next = module->procSlots;
+        module->procSlots = slot;
+        // readers check the module first, so it is published last
+        InterlockedExchangePointer((PVOID volatile *) &slot->module, mod);
+    }
+    ReleaseSpinLock(&procSlotsLock);
+    return result;
+}
+
+static void
+UnbindProcSlots(PMEMORYMODULE module)
+{
+    MEMORYPROCSLOT *slot;
+    if (module->procSlots == NULL) {
+        return;
+    }
+
+    AcquireSpinLock(&procSlotsLock);
+    for (slot=module->procSlots; slot!=NULL; slot=slot->next) {
+        slot->module = NULL;
+        slot->proc = NULL;
+    }
+    module->procSlots = NULL;
+    ReleaseSpinLock(&procSlotsLock);
+}
+
+HMEMORYMODULE MemoryReloadModule(HMEMORYMODULE mod, const void *data, size_t size)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    PMEMORYMODULE result;
+    MEMORYLOADOPTIONS options;
+    TRAMPOLINE_INDEX *retired;
+    DWORD error;
+
+    if (module == NULL || !(module->flags & MEMORY_LOAD_TRAMPOLINES)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.cbSize = sizeof(options);
+    options.flags = module->flags;
+    result = (PMEMORYMODULE) MemoryLoadLibraryEx2(data, size, &options,
+        module->alloc, module->free, module->loadLibrary, module->getProcAddress, module->freeLibrary,
+        module->userdata);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    // nobody has looked up functions if there are no trampolines yet
+    if (module->trampolines != NULL) {
+        if (!BindTrampolines(result, module->trampolines, &retired)) {
+            error = GetLastError();
+            MemoryFreeLibrary(result);
+            SetLastError(error);
+            return NULL;
+        }
+        result->trampolines = module->trampolines;
+        module->trampolines = NULL;
+        module->retiredIndex = retired;
+    }
+    module->flags &= ~MEMORY_LOAD_TRAMPOLINES;
+    return (HMEMORYMODULE)result;
+}
+
+// Returns the file data of "size" bytes at "rva" or NULL if they are not
+// part of the headers or the raw data of a section.
+static const unsigned char *
+ImageRvaToData(const MEMORYIMAGE *image, DWORD rva, DWORD size)
+{
+    PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(image->headers);
+    DWORD offset;
+    WORD i;
+
+    if (rva + size < rva) {
+        return NULL;
+    }
+
+    if (rva + size <= image->headers->OptionalHeader.SizeOfHeaders) {
+        offset = rva;
+    } else {
+        for (i=0; i<image->headers->FileHeader.NumberOfSections; i++, section++) {
+            if (rva >= section->VirtualAddress && rva + size <= section->VirtualAddress + section->SizeOfRawData) {
+                break;
+            }
+        }
+        if (i == image->headers->FileHeader.NumberOfSections) {
+            return NULL;
+        }
+        offset = section->PointerToRawData + (rva - section->VirtualAddress);
+    }
+
+    if (offset + size < offset || offset + size > image->size) {
+        return NULL;
+    }
+    return image->data + offset;
+}
+
+static BOOL
+CollectRelocations(PMEMORYIMAGE image)
+{
+    PIMAGE_DATA_DIRECTORY directory = &image->headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC];
+    DWORD sizeOfImage = image->headers->OptionalHeader.SizeOfImage;
+    DWORD maxRelocations = directory->Size / sizeof(WORD);
+    DWORD pos = 0;
+
+    if (directory->Size == 0) {
+        return TRUE;
+    }
+
+    // every entry takes two bytes, so this is enough for all of them
+    image->relocations = (DWORD *) malloc(maxRelocations * sizeof(DWORD));
+    if (image->relocations == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+
+    while (pos + IMAGE_SIZEOF_BASE_RELOCATION <= directory->Size) {
+        PIMAGE_BASE_RELOCATION relocation = (PIMAGE_BASE_RELOCATION) ImageRvaToData(image,
+            directory->VirtualAddress + pos, IMAGE_SIZEOF_BASE_RELOCATION);
+        const WORD *relInfo;
+        DWORD i, count;
+        if (relocation == NULL) {
+            SetLastError(ERROR_BAD_EXE_FORMAT);
+            return FALSE;
+        }
+        if (relocation->VirtualAddress == 0) {
+            break;
+        }
+        if (relocation->SizeOfBlock < IMAGE_SIZEOF_BASE_RELOCATION ||
+            ImageRvaToData(image, directory->VirtualAddress + pos, relocation->SizeOfBlock) == NULL) {
+            SetLastError(ERROR_BAD_EXE_FORMAT);
+            return FALSE;
+        }
+
+        relInfo = (const WORD *) OffsetPointer(relocation, IMAGE_SIZEOF_BASE_RELOCATION);
+        count = (relocation->SizeOfBlock - IMAGE_SIZEOF_BASE_RELOCATION) / 2;
+        for (i=0; i<count; i++, relInfo++) {
+            DWORD rva = relocation->VirtualAddress + (*relInfo & 0xfff);
+            switch (*relInfo >> 12)
+            {
+            case IMAGE_REL_BASED_HIGHLOW:
+                if (rva + sizeof(DWORD) > sizeOfImage) {
+                    SetLastError(ERROR_BAD_EXE_FORMAT);
+                    return FALSE;
                 }
+                image->relocations[image->numRelocations++] = rva;
                 break;
 
 #ifdef _WIN64
             case IMAGE_REL_BASED_DIR64:
-                {
-                    ULONGLONG *patchAddr64 = (ULONGLONG *) (dest + offset);
-                    *patchAddr64 += (ULONGLONG) delta;
+                if (rva + sizeof(ULONGLONG) > sizeOfImage) {
+                    SetLastError(ERROR_BAD_EXE_FORMAT);
+                    return FALSE;
                 }
+                // collected from the end, moved behind the 32bit ones below
+                image->relocations[maxRelocations - ++image->numRelocations64] = rva;
                 break;
 #endif
 
             default:
-                //printf("Unknown relocation: %d\n", type);
+                // skipped like in PerformBaseRelocation
                 break;
             }
         }
 
-        // advance to next relocation block
-        relocation = (PIMAGE_BASE_RELOCATION) OffsetPointer(relocation, relocation->SizeOfBlock);
-    }
-    return TRUE;
-}
-
-static BOOL
-RegisterExceptionHandling(PMEMORYMODULE module)
-{
-#ifdef _WIN64
-    PRUNTIME_FUNCTION pEntry;
-    DWORD count;
-    PIMAGE_DATA_DIRECTORY pDir = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXCEPTION);
-    if (pDir->Size == 0) {
-        return TRUE;
+        pos += relocation->SizeOfBlock;
     }
 
-    pEntry = (PRUNTIME_FUNCTION)(module->codeBase + pDir->VirtualAddress);
-    count = (pDir->Size / sizeof(RUNTIME_FUNCTION));
-    return RtlAddFunctionTable(pEntry, count, (DWORD64) module->codeBase);
-#else
-    // TODO(fancycode): Support 32bit exception handling.
+    memmove(image->relocations + image->numRelocations,
+        image->relocations + maxRelocations - image->numRelocations64,
+        image->numRelocations64 * sizeof(DWORD));
     return TRUE;
-#endif
 }
 
 static BOOL
-UnregisterExceptionHandling(PMEMORYMODULE module)
+CountImports(PMEMORYIMAGE image)
 {
-#ifdef _WIN64
-    PRUNTIME_FUNCTION pEntry;
-    PIMAGE_DATA_DIRECTORY pDir = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXCEPTION);
-    if (pDir->Size == 0) {
+    PIMAGE_DATA_DIRECTORY directory = &image->headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT];
+    const IMAGE_IMPORT_DESCRIPTOR *importDesc;
+
+    if (directory->Size == 0) {
         return TRUE;
     }
 
-    pEntry = (PRUNTIME_FUNCTION)(module->codeBase + pDir->VirtualAddress);
-    return RtlDeleteFunctionTable(pEntry);
-#else
-    // TODO(fancycode): Support 32bit exception handling.
+    for (;;) {
+        importDesc = (const IMAGE_IMPORT_DESCRIPTOR *) ImageRvaToData(image,
+            directory->VirtualAddress + image->numImports * sizeof(IMAGE_IMPORT_DESCRIPTOR),
+            sizeof(IMAGE_IMPORT_DESCRIPTOR));
+        if (importDesc == NULL || importDesc->Name == 0) {
+            break;
+        }
+        if (ImageRvaToData(image, importDesc->Name, 1) == NULL) {
+            SetLastError(ERROR_BAD_EXE_FORMAT);
+            return FALSE;
+        }
+        image->numImports++;
+    }
     return TRUE;
-#endif
 }
 
 static BOOL
-BuildImportTable(PMEMORYMODULE module)
+BuildExportIndex(PMEMORYIMAGE image)
 {
-    unsigned char *codeBase = module->codeBase;
-    PIMAGE_IMPORT_DESCRIPTOR importDesc;
-    BOOL result = TRUE;
+    PIMAGE_DATA_DIRECTORY directory = &image->headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+    const IMAGE_EXPORT_DIRECTORY *exports;
+    const DWORD *nameRef;
+    const WORD *ordinal;
+    struct ExportNameEntry *entry;
+    DWORD i;
 
-    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_IMPORT);
     if (directory->Size == 0) {
         return TRUE;
     }
 
-    importDesc = (PIMAGE_IMPORT_DESCRIPTOR) (codeBase + directory->VirtualAddress);
-    for (; !IsBadReadPtr(importDesc, sizeof(IMAGE_IMPORT_DESCRIPTOR)) && importDesc->Name; importDesc++) {
-        uintptr_t *thunkRef;
-        FARPROC *funcRef;
-        HCUSTOMMODULE *tmp;
-        HCUSTOMMODULE handle = module->loadLibrary((LPCSTR) (codeBase + importDesc->Name), module->userdata);
-        if (handle == NULL) {
-            SetLastError(ERROR_MOD_NOT_FOUND);
-            result = FALSE;
-            break;
-        }
+    exports = (const IMAGE_EXPORT_DIRECTORY *) ImageRvaToData(image, directory->VirtualAddress, sizeof(IMAGE_EXPORT_DIRECTORY));
+    if (exports == NULL) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
+    if (exports->NumberOfNames == 0 || exports->NumberOfFunctions == 0) {
+        return TRUE;
+    }
 
-        tmp = (HCUSTOMMODULE *) realloc(module->modules, (module->numModules+1)*(sizeof(HCUSTOMMODULE)));
-        if (tmp == NULL) {
-            module->freeLibrary(handle, module->userdata);
-            SetLastError(ERROR_OUTOFMEMORY);
-            result = FALSE;
-            break;
-        }
-        module->modules = tmp;
+    nameRef = (const DWORD *) ImageRvaToData(image, exports->AddressOfNames, exports->NumberOfNames * sizeof(DWORD));
+    ordinal = (const WORD *) ImageRvaToData(image, exports->AddressOfNameOrdinals, exports->NumberOfNames * sizeof(WORD));
+    if (nameRef == NULL || ordinal == NULL) {
+        SetLastError(ERROR_BAD_EXE_FORMAT);
+        return FALSE;
+    }
 
-        module->modules[module->numModules++] = handle;
-        if (importDesc->OriginalFirstThunk) {
-            thunkRef = (uintptr_t *) (codeBase + importDesc->OriginalFirstThunk);
-            funcRef = (FARPROC *) (codeBase + importDesc->FirstThunk);
-        } else {
-            // no hint table
-            thunkRef = (uintptr_t *) (codeBase + importDesc->FirstThunk);
-            funcRef = (FARPROC *) (codeBase + importDesc->FirstThunk);
-        }
-        for (; *thunkRef; thunkRef++, funcRef++) {
-            if (IMAGE_SNAP_BY_ORDINAL(*thunkRef)) {
-                *funcRef = module->getProcAddress(handle, (LPCSTR)IMAGE_ORDINAL(*thunkRef), module->userdata);
-            } else {
-                PIMAGE_IMPORT_BY_NAME thunkData = (PIMAGE_IMPORT_BY_NAME) (codeBase + (*thunkRef));
-                *funcRef = module->getProcAddress(handle, (LPCSTR)&thunkData->Name, module->userdata);
-            }
-            if (*funcRef == 0) {
-                result = FALSE;
-                break;
-            }
-        }
+    image->nameExports = (struct ExportNameEntry *) malloc(exports->NumberOfNames * sizeof(struct ExportNameEntry));
+    if (image->nameExports == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
 
-        if (!result) {
-            module->freeLibrary(handle, module->userdata);
-            SetLastError(ERROR_PROC_NOT_FOUND);
-            break;
+    entry = image->nameExports;
+    for (i=0; i<exports->NumberOfNames; i++, nameRef++, ordinal++, entry++) {
+        entry->name = (LPCSTR) ImageRvaToData(image, *nameRef, 1);
+        if (entry->name == NULL) {
+            SetLastError(ERROR_BAD_EXE_FORMAT);
+            return FALSE;
         }
+        entry->idx = *ordinal;
     }
-
-    return result;
+    qsort(image->nameExports, exports->NumberOfNames, sizeof(struct ExportNameEntry), _compare);
+    return TRUE;
 }
 
-LPVOID MemoryDefaultAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect, void* userdata)
+HMEMORYIMAGE MemoryParseImage(const void *data, size_t size)
 {
-	UNREFERENCED_PARAMETER(userdata);
-	return VirtualAlloc(address, size, allocationType, protect);
-}
+    PMEMORYIMAGE image;
+    void *copy;
 
-BOOL MemoryDefaultFree(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType, void* userdata)
-{
-	UNREFERENCED_PARAMETER(userdata);
-	return VirtualFree(lpAddress, dwSize, dwFreeType);
+    image = (PMEMORYIMAGE) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(MEMORYIMAGE));
+    if (image == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+    image->refCount = 1;
+
+    copy = malloc(size);
+    if (copy == NULL) {
+        HeapFree(GetProcessHeap(), 0, image);
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+    memcpy(copy, data, size);
+    image->data = (const unsigned char *) copy;
+    image->size = size;
+
+    if (!ParseLayout(copy, size, image) ||
+        !CheckSize(size, image->headers->OptionalHeader.SizeOfHeaders) ||
+        !BuildProtectionMap(image->headers, image->pageSize, image->alignedImageSize, TRUE,
+            &image->protectionMap, &image->numProtectionRanges) ||
+        !CollectRelocations(image) ||
+        !CountImports(image) ||
+        !BuildExportIndex(image)) {
+        DWORD error = GetLastError();
+        ReleaseImage(image);
+        SetLastError(error);
+        return NULL;
+    }
+    return (HMEMORYIMAGE) image;
 }
 
-HCUSTOMMODULE MemoryDefaultLoadLibrary(LPCSTR filename, void *userdata)
+HMEMORYMODULE MemoryLoadFromImage(HMEMORYIMAGE handle,
+    const MEMORYLOADOPTIONS *options,
+    CustomAllocFunc allocMemory,
+    CustomFreeFunc freeMemory,
+    CustomLoadLibraryFunc loadLibrary,
+    CustomGetProcAddressFunc getProcAddress,
+    CustomFreeLibraryFunc freeLibrary,
+    void *userdata)
 {
-    HMODULE result;
-    UNREFERENCED_PARAMETER(userdata);
-    result = LoadLibraryA(filename);
-    if (result == NULL) {
+    PMEMORYIMAGE image = (PMEMORYIMAGE) handle;
+    EVENT_SINK *sink;
+    HMEMORYMODULE result;
+    if (image == NULL || !CheckLoadOptions(options)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
         return NULL;
     }
 
-    return (HCUSTOMMODULE) result;
+    sink = eventSink;
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_BEGIN, NULL, NULL, image->size, image->data, ERROR_SUCCESS);
+    }
+
+    result = LoadModule(image->data, image->size, image, options, allocMemory, freeMemory, loadLibrary, getProcAddress, freeLibrary, userdata, NULL);
+    if (sink != NULL) {
+        EmitSinkEvent(sink, MEMORY_EVENT_LOAD_END, result, NULL, image->size,
+            result != NULL ? ((PMEMORYMODULE) result)->codeBase : NULL,
+            result != NULL ? ERROR_SUCCESS : GetLastError());
+    }
+    return result;
 }
 
-FARPROC MemoryDefaultGetProcAddress(HCUSTOMMODULE module, LPCSTR name, void *userdata)
+void MemoryFreeImage(HMEMORYIMAGE image)
 {
-    UNREFERENCED_PARAMETER(userdata);
-    return (FARPROC) GetProcAddress((HMODULE) module, name);
+    ReleaseImage((PMEMORYIMAGE) image);
 }
 
-void MemoryDefaultFreeLibrary(HCUSTOMMODULE module, void *userdata)
+BOOL MemoryHashImage(const void *data, size_t size, MEMORYIMAGEHASH *hash)
 {
-    UNREFERENCED_PARAMETER(userdata);
-    FreeLibrary((HMODULE) module);
+    SHA256CONTEXT ctx;
+    if ((data == NULL && size > 0) || hash == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    Sha256Init(&ctx);
+    Sha256Update(&ctx, (const unsigned char *) data, size);
+    Sha256Final(&ctx, hash->hash);
+    return TRUE;
 }
 
-HMEMORYMODULE MemoryLoadLibrary(const void *data, size_t size)
+typedef struct {
+    // first member, so entries can be searched with CompareModulePointers
+    PMEMORYMODULE module;
+    DWORD index;
+} UNLOAD_ENTRY;
+
+static DWORD
+FindUnloadEntry(const UNLOAD_ENTRY *entries, DWORD count, HCUSTOMMODULE handle)
 {
-    return MemoryLoadLibraryEx(data, size, MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary, MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL);
+    const UNLOAD_ENTRY *entry;
+    if (handle == NULL) {
+        return count;
+    }
+
+    entry = (const UNLOAD_ENTRY *) bsearch(&handle, entries, count, sizeof(UNLOAD_ENTRY), CompareModulePointers);
+    return (entry != NULL) ? entry->index : count;
 }
 
-HMEMORYMODULE MemoryLoadLibraryEx(const void *data, size_t size,
-    CustomAllocFunc allocMemory,
-    CustomFreeFunc freeMemory,
-    CustomLoadLibraryFunc loadLibrary,
-    CustomGetProcAddressFunc getProcAddress,
-    CustomFreeLibraryFunc freeLibrary,
-    void *userdata)
+// Order "count" modules so modules are freed before the modules in the batch
+// they depend on, otherwise in reverse order. Returns NULL if out of memory.
+static PMEMORYMODULE *
+SortForUnload(PMEMORYMODULE *modules, DWORD count)
 {
-    PMEMORYMODULE result = NULL;
-    PIMAGE_DOS_HEADER dos_header;
-    PIMAGE_NT_HEADERS old_header;
-    unsigned char *code, *headers;
-    ptrdiff_t locationDelta;
-    SYSTEM_INFO sysInfo;
-    PIMAGE_SECTION_HEADER section;
-    DWORD i;
-    size_t optionalSectionSize;
-    size_t lastSectionEnd = 0;
-    size_t alignedImageSize;
-#ifdef _WIN64
-    POINTER_LIST *blockedMemory = NULL;
-#endif
-
-    if (!CheckSize(size, sizeof(IMAGE_DOS_HEADER))) {
-        return NULL;
-    }
-    dos_header = (PIMAGE_DOS_HEADER)data;
-    if (dos_header->e_magic != IMAGE_DOS_SIGNATURE) {
-        SetLastError(ERROR_BAD_EXE_FORMAT);
-        return NULL;
+    PMEMORYMODULE *order;
+    UNLOAD_ENTRY *entries;
+    DWORD *dependents;
+    DWORD i, idx, numPlaced;
+    int j;
+
+    order = (PMEMORYMODULE *) malloc(count * sizeof(PMEMORYMODULE));
+    entries = (UNLOAD_ENTRY *) malloc(count * sizeof(UNLOAD_ENTRY));
+    dependents = (DWORD *) calloc(count, sizeof(DWORD));
+    if (order == NULL || entries == NULL || dependents == NULL) {
+        free(order);
+        order = NULL;
+        goto exit;
     }
 
-    if (!CheckSize(size, dos_header->e_lfanew + sizeof(IMAGE_NT_HEADERS))) {
-        return NULL;
+    // count how many modules in the batch import each module of the batch
+    for (i=0; i<count; i++) {
+        entries[i].module = modules[i];
+        entries[i].index = i;
     }
-    old_header = (PIMAGE_NT_HEADERS)&((const unsigned char *)(data))[dos_header->e_lfanew];
-    if (old_header->Signature != IMAGE_NT_SIGNATURE) {
-        SetLastError(ERROR_BAD_EXE_FORMAT);
-        return NULL;
+    qsort(entries, count, sizeof(UNLOAD_ENTRY), CompareModulePointers);
+    for (i=0; i<count; i++) {
+        for (j=0; j<modules[i]->numModules; j++) {
+            idx = FindUnloadEntry(entries, count, modules[i]->modules[j]);
+            if (idx < count) {
+                dependents[idx]++;
+            }
+        }
     }
 
-    if (old_header->FileHeader.Machine != HOST_MACHINE) {
-        SetLastError(ERROR_BAD_EXE_FORMAT);
-        return NULL;
+    // Repeatedly take all modules no remaining module depends on, last one
+    // first. Taken modules are cleared in "modules".
+    numPlaced = 0;
+    while (numPlaced < count) {
+        BOOL found = FALSE;
+        DWORD last = count;
+        for (i=count; i>0; i--) {
+            PMEMORYMODULE module = modules[i-1];
+            if (module == NULL) {
+                continue;
+            }
+            if (last == count) {
+                last = i-1;
+            }
+            if (dependents[i-1] != 0) {
+                continue;
+            }
+
+            order[numPlaced++] = module;
+            modules[i-1] = NULL;
+            found = TRUE;
+            for (j=0; j<module->numModules; j++) {
+                idx = FindUnloadEntry(entries, count, module->modules[j]);
+                if (idx < count && dependents[idx] > 0) {
+                    dependents[idx]--;
+                }
+            }
+        }
+        if (!found) {
+            // cyclic dependencies, break the cycle at the last module
+            dependents[last] = 0;
+        }
     }
 
-    if (old_header->OptionalHeader.SectionAlignment & 1) {
-        // Only support section alignments that are a multiple of 2
-        SetLastError(ERROR_BAD_EXE_FORMAT);
-        return NULL;
+exit:
+    free(dependents);
+    free(entries);
+    return order;
+}
+
+// Free "count" modules in the given order. All modules are detached before
+// the first one is released and the libraries they imported are only freed
+// after all images have been released, so dependencies shared by the batch
+// are not unloaded and reloaded in between.
+static void
+FreeModules(PMEMORYMODULE *modules, DWORD count, BOOL terminating)
+{
+    PMEMORYMODULE *sorted = NULL;
+    BOOL inPlace = FALSE;
+    DWORD i;
+    int j;
+
+    for (i=0; i<count; i++) {
+        PMEMORYMODULE module = modules[i];
+        if (eventSink != NULL) {
+            EmitEvent(MEMORY_EVENT_FREE, (HMEMORYMODULE) module, NULL, 0, module->codeBase, ERROR_SUCCESS);
+        }
+        // stop thread notifications
+        module->threadNotifications = FALSE;
+        module->tlsReady = FALSE;
     }
 
-    section = IMAGE_FIRST_SECTION(old_header);
-    optionalSectionSize = old_header->OptionalHeader.SectionAlignment;
-    for (i=0; i<old_header->FileHeader.NumberOfSections; i++, section++) {
-        size_t endOfSection;
-        if (section->SizeOfRawData == 0) {
-            // Section without data in the DLL
-            endOfSection = section->VirtualAddress + optionalSectionSize;
+    if (!terminating) {
+        // Remove the modules from the index before waiting, so lookups and
+        // notifications that start afterwards can't see them anymore.
+        if (count == 1) {
+            inPlace = UnregisterModuleRanges(modules, 1);
         } else {
-            endOfSection = section->VirtualAddress + section->SizeOfRawData;
+            // kept until the imports are released to look up batch members
+            sorted = (PMEMORYMODULE *) malloc(count * sizeof(PMEMORYMODULE));
+            if (sorted != NULL) {
+                memcpy(sorted, modules, count * sizeof(PMEMORYMODULE));
+                qsort(sorted, count, sizeof(PMEMORYMODULE), CompareModulePointers);
+                inPlace = UnregisterModuleRanges(sorted, count);
+            } else {
+                for (i=0; i<count; i++) {
+                    inPlace |= UnregisterModuleRanges(&modules[i], 1);
+                }
+            }
         }
+        // wait once until running lookups and notifications are done
+        WaitForModuleIndexReaders(modules, sorted, count, inPlace);
+    }
 
-        if (endOfSection > lastSectionEnd) {
-            lastSectionEnd = endOfSection;
+    for (i=0; i<count; i++) {
+        PMEMORYMODULE module = modules[i];
+        if (module->initialized) {
+            // notify library about detaching from process, "lpReserved" is
+            // non-NULL if the process is terminating
+            DllEntryProc DllEntry = (DllEntryProc)(LPVOID)(module->codeBase + module->headers->OptionalHeader.AddressOfEntryPoint);
+            (*DllEntry)((HINSTANCE)module->codeBase, DLL_PROCESS_DETACH, terminating ? (LPVOID) 1 : 0);
+            module->initialized = FALSE;
+        }
+        if (module->started) {
+            ExecuteTLS(module, DLL_PROCESS_DETACH);
+            module->started = FALSE;
         }
     }
-
-    GetNativeSystemInfo(&sysInfo);
-    alignedImageSize = AlignValueUp(old_header->OptionalHeader.SizeOfImage, sysInfo.dwPageSize);
-    if (alignedImageSize != AlignValueUp(lastSectionEnd, sysInfo.dwPageSize)) {
-        SetLastError(ERROR_BAD_EXE_FORMAT);
-        return NULL;
+    if (terminating) {
+        // The memory of the modules stays valid until the process is gone,
+        // so nothing else needs to be released or unregistered. Threads
+        // that pinned the index might have been terminated already.
+        return;
     }
 
-    // reserve memory for image of library
-    // XXX: is it correct to commit the complete memory region at once?
-    //      calling DllEntry raises an exception if we don't...
-    code = (unsigned char *)allocMemory((LPVOID)(old_header->OptionalHeader.ImageBase),
-        alignedImageSize,
-        MEM_RESERVE | MEM_COMMIT,
-        PAGE_READWRITE,
-        userdata);
+    for (i=0; i<count; i++) {
+        PMEMORYMODULE module = modules[i];
+        UnregisterExceptionHandling(module);
+        ReleaseTLS(module);
 
-    if (code == NULL) {
-        // try to allocate memory at arbitrary position
-        code = (unsigned char *)allocMemory(NULL,
-            alignedImageSize,
-            MEM_RESERVE | MEM_COMMIT,
-            PAGE_READWRITE,
-            userdata);
-        if (code == NULL) {
-            SetLastError(ERROR_OUTOFMEMORY);
-            return NULL;
+        UnbindProcSlots(module);
+        if (module->image == NULL) {
+            free(module->nameExportsTable);
         }
-    }
-
-#ifdef _WIN64
-    // Memory block may not span 4 GB boundaries.
-    while ((((uintptr_t) code) >> 32) < (((uintptr_t) (code + alignedImageSize)) >> 32)) {
-        POINTER_LIST *node = (POINTER_LIST*) malloc(sizeof(POINTER_LIST));
-        if (!node) {
-            freeMemory(code, 0, MEM_RELEASE, userdata);
-            FreePointerList(blockedMemory, freeMemory, userdata);
-            SetLastError(ERROR_OUTOFMEMORY);
-            return NULL;
+        free(module->hashExportsTable);
+        free(module->protectionMap);
+        free(module->relocations);
+        free(module->importThunks);
+        FreeTrampolines(module->trampolines);
+        free(module->retiredIndex);
+        FreeHibernationData(module->hibernation);
+        if (module->codeBase != NULL) {
+            // release memory of library
+            module->free(module->codeBase, 0, MEM_RELEASE, module->userdata);
         }
+    }
 
-        node->next = blockedMemory;
-        node->address = code;
-        blockedMemory = node;
+    for (i=0; i<count; i++) {
+        PMEMORYMODULE module = modules[i];
+        if (module->modules != NULL) {
+            // free previously opened libraries
+            for (j=0; j<module->numModules; j++) {
+                // imports resolved to a module of the batch have been
+                // released with the batch already
+                if (module->modules[j] != NULL &&
+                        !IsBatchMember(module->modules[j], modules, sorted, count)) {
+                    module->freeLibrary(module->modules[j], module->userdata);
+                }
+            }
 
-        code = (unsigned char *)allocMemory(NULL,
-            alignedImageSize,
-            MEM_RESERVE | MEM_COMMIT,
-            PAGE_READWRITE,
-            userdata);
-        if (code == NULL) {
-            FreePointerList(blockedMemory, freeMemory, userdata);
-            SetLastError(ERROR_OUTOFMEMORY);
-            return NULL;
+            free(module->modules);
         }
+
+        ReleaseImage(module->image);
+        HeapFree(GetProcessHeap(), 0, module);
     }
-#endif
+    free(sorted);
+}
 
-    result = (PMEMORYMODULE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(MEMORYMODULE));
-    if (result == NULL) {
-        freeMemory(code, 0, MEM_RELEASE, userdata);
-#ifdef _WIN64
-        FreePointerList(blockedMemory, freeMemory, userdata);
-#endif
-        SetLastError(ERROR_OUTOFMEMORY);
-        return NULL;
+void MemoryFreeLibrary(HMEMORYMODULE mod)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+
+    if (module == NULL || !ReleaseSharedModule(module)) {
+        return;
     }
+    FreeModules(&module, 1, FALSE);
+}
 
-    result->codeBase = code;
-    result->isDLL = (old_header->FileHeader.Characteristics & IMAGE_FILE_DLL) != 0;
-    result->alloc = allocMemory;
-    result->free = freeMemory;
-    result->loadLibrary = loadLibrary;
-    result->getProcAddress = getProcAddress;
-    result->freeLibrary = freeLibrary;
-    result->userdata = userdata;
-    result->pageSize = sysInfo.dwPageSize;
-#ifdef _WIN64
-    result->blockedMemory = blockedMemory;
-#endif
+BOOL MemoryFreeLibraries(const HMEMORYMODULE *mods, DWORD count, DWORD flags)
+{
+    PMEMORYMODULE *modules;
+    PMEMORYMODULE *order;
+    BOOL terminating = (flags & MEMORY_FREE_PROCESS_TERMINATING) != 0;
+    DWORD i, numModules = 0;
 
-    if (!CheckSize(size, old_header->OptionalHeader.SizeOfHeaders)) {
-        goto error;
+    if ((mods == NULL && count > 0) || (flags & ~MEMORY_FREE_PROCESS_TERMINATING) != 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    if (count == 0) {
+        return TRUE;
     }
 
-    // commit memory for headers
-    headers = (unsigned char *)allocMemory(code,
-        old_header->OptionalHeader.SizeOfHeaders,
-        MEM_COMMIT,
-        PAGE_READWRITE,
-        userdata);
+    modules = (PMEMORYMODULE *) malloc(count * sizeof(PMEMORYMODULE));
+    if (modules == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return FALSE;
+    }
+    for (i=0; i<count; i++) {
+        // shared modules are only freed with their last reference
+        if (mods[i] != NULL && ReleaseSharedModule((PMEMORYMODULE) mods[i])) {
+            modules[numModules++] = (PMEMORYMODULE) mods[i];
+        }
+    }
 
-    // copy PE header to code
-    memcpy(headers, dos_header, old_header->OptionalHeader.SizeOfHeaders);
-    result->headers = (PIMAGE_NT_HEADERS)&((const unsigned char *)(headers))[dos_header->e_lfanew];
+    if (numModules == 0) {
+        free(modules);
+        return TRUE;
+    }
 
-    // update position
-    result->headers->OptionalHeader.ImageBase = (uintptr_t)code;
+    order = (numModules > 1) ? SortForUnload(modules, numModules) : modules;
+    if (order == NULL) {
+        // the references are gone already, free the batch in reverse order
+        for (i=0; i<numModules/2; i++) {
+            PMEMORYMODULE tmp = modules[i];
+            modules[i] = modules[numModules-1-i];
+            modules[numModules-1-i] = tmp;
+        }
+        order = modules;
+    }
 
-    // copy sections from DLL file block to new memory location
-    if (!CopySections((const unsigned char *) data, size, old_header, result)) {
-        goto error;
+    FreeModules(order, numModules, terminating);
+    if (order != modules) {
+        free(order);
     }
+    free(modules);
+    return TRUE;
+}
 
-    // adjust base address of imported data
-    locationDelta = (ptrdiff_t)(result->headers->OptionalHeader.ImageBase - old_header->OptionalHeader.ImageBase);
-    if (locationDelta != 0) {
-        result->isRelocated = PerformBaseRelocation(result, locationDelta);
-    } else {
-        result->isRelocated = TRUE;
+int MemoryCallEntryPoint(HMEMORYMODULE mod)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+
+    if (module == NULL || module->isDLL || module->exeEntry == NULL || !module->isRelocated) {
+        return -1;
     }
 
-    // load required dlls and adjust function table of imports
-    if (!BuildImportTable(result)) {
-        goto error;
+    return module->exeEntry();
+}
+
+HMEMORYMODULE MemoryModuleFromAddress(LPCVOID address, DWORD *rva)
+{
+    uintptr_t value = (uintptr_t) address;
+    const MODULE_INDEX *index;
+    PMEMORYMODULE result = NULL;
+    DWORD start, end, middle;
+
+    index = AcquireModuleIndex();
+    if (index != NULL) {
+        // find last range that starts at or before the address
+        start = 0;
+        end = index->count;
+        while (end > start) {
+            middle = (start + end) >> 1;
+            if (index->ranges[middle].start <= value) {
+                start = middle + 1;
+            } else {
+                end = middle;
+            }
+        }
+        if (start > 0 && value < index->ranges[start-1].end) {
+            result = index->ranges[start-1].module;
+            if (result != NULL && rva != NULL) {
+                *rva = (DWORD) (value - index->ranges[start-1].start);
+            }
+        }
     }
+    ReleaseModuleIndex(index);
 
-    // register exception handling table so "try { } catch ( ) { }"" works
-    if (!RegisterExceptionHandling(result)) {
-        goto error;
+    if (result == NULL) {
+        SetLastError(ERROR_MOD_NOT_FOUND);
     }
+    return (HMEMORYMODULE) result;
+}
 
-    // mark memory pages depending on section headers and release
-    // sections that are marked as "discardable"
-    if (!FinalizeSections(result)) {
-        goto error;
+BOOL MemoryGetPlacementInfo(HMEMORYMODULE mod, MEMORYPLACEMENTINFO *info)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    if (module == NULL || info == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
 
-    // TLS callbacks are executed BEFORE the main loading
-    if (!ExecuteTLS(result)) {
-        goto error;
+    info->placement = module->placement;
+    info->base = module->codeBase;
+    info->delta = (LONG_PTR) module->locationDelta;
+    info->relocations = module->numRelocations;
+    return TRUE;
+}
+
+BOOL MemoryGetLoadStats(HMEMORYMODULE mod, MEMORYLOADSTATS *stats)
+{
+#ifdef LOADSTATS
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    LARGE_INTEGER frequency;
+    if (stats == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
 
-    // get entry point of loaded library
-    if (result->headers->OptionalHeader.AddressOfEntryPoint != 0) {
-        if (result->isDLL) {
-            DllEntryProc DllEntry = (DllEntryProc)(LPVOID)(code + result->headers->OptionalHeader.AddressOfEntryPoint);
-            // notify library about attaching to process
-            BOOL successfull = (*DllEntry)((HINSTANCE)code, DLL_PROCESS_ATTACH, 0);
-            if (!successfull) {
-                SetLastError(ERROR_DLL_INIT_FAILED);
-                goto error;
-            }
-            result->initialized = TRUE;
-        } else {
-            result->exeEntry = (ExeEntryProc)(LPVOID)(code + result->headers->OptionalHeader.AddressOfEntryPoint);
-        }
+    if (module != NULL) {
+        *stats = module->loadStats;
     } else {
-        result->exeEntry = NULL;
+        AcquireSpinLock(&processLoadStatsLock);
+        *stats = processLoadStats;
+        ReleaseSpinLock(&processLoadStatsLock);
     }
+    QueryPerformanceFrequency(&frequency);
+    stats->frequency = frequency.QuadPart;
+    return TRUE;
+#else
+    UNREFERENCED_PARAMETER(mod);
+    UNREFERENCED_PARAMETER(stats);
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+#endif
+}
 
-    return (HMEMORYMODULE)result;
+DWORD MemoryGetLoadFlags(HMEMORYMODULE mod)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    if (module == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
 
-error:
-    // cleanup
-    MemoryFreeLibrary(result);
-    return NULL;
+    return module->flags;
 }
 
-static int _compare(const void *a, const void *b)
+SIZE_T MemoryTrimModule(HMEMORYMODULE mod)
 {
-    const struct ExportNameEntry *p1 = (const struct ExportNameEntry*) a;
-    const struct ExportNameEntry *p2 = (const struct ExportNameEntry*) b;
-    return strcmp(p1->name, p2->name);
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    if (module == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    TrimModule(module);
+    return module->trimmedBytes;
 }
 
-static int _find(const void *a, const void *b)
+DWORD MemoryGetProtectionMap(HMEMORYMODULE mod, MEMORYPROTECTIONRANGE *ranges, DWORD count)
 {
-    LPCSTR *name = (LPCSTR *) a;
-    const struct ExportNameEntry *p = (const struct ExportNameEntry*) b;
-    return strcmp(*name, p->name);
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    if (module == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return 0;
+    }
+
+    if (count > module->numProtectionRanges) {
+        count = module->numProtectionRanges;
+    }
+    if (ranges != NULL && count > 0) {
+        memcpy(ranges, module->protectionMap, count * sizeof(MEMORYPROTECTIONRANGE));
+    }
+    return module->numProtectionRanges;
 }
 
-FARPROC MemoryGetProcAddress(HMEMORYMODULE mod, LPCSTR name)
+BOOL MemoryHibernateModule(HMEMORYMODULE mod, const void *data, size_t size, SIZE_T *released)
 {
     PMEMORYMODULE module = (PMEMORYMODULE)mod;
-    unsigned char *codeBase = module->codeBase;
-    DWORD idx = 0;
-    PIMAGE_EXPORT_DIRECTORY exports;
-    PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY(module, IMAGE_DIRECTORY_ENTRY_EXPORT);
-    if (directory->Size == 0) {
-        // no export table found
-        SetLastError(ERROR_PROC_NOT_FOUND);
-        return NULL;
+    SIZE_T tmp = 0;
+    BOOL result;
+    if (module == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
     }
 
-    exports = (PIMAGE_EXPORT_DIRECTORY) (codeBase + directory->VirtualAddress);
-    if (exports->NumberOfNames == 0 || exports->NumberOfFunctions == 0) {
-        // DLL doesn't export anything
-        SetLastError(ERROR_PROC_NOT_FOUND);
-        return NULL;
+    if (module->flags & MEMORY_LOAD_LARGE_PAGES) {
+        // large pages can't be decommitted
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return FALSE;
     }
 
-    if (HIWORD(name) == 0) {
-        // load function by ordinal value
-        if (LOWORD(name) < exports->Base) {
-            SetLastError(ERROR_PROC_NOT_FOUND);
-            return NULL;
-        }
-
-        idx = LOWORD(name) - exports->Base;
-    } else if (!exports->NumberOfNames) {
-        SetLastError(ERROR_PROC_NOT_FOUND);
-        return NULL;
+    AcquireSpinLock(&module->hibernationLock);
+    if (module->hibernation != NULL) {
+        // already hibernating
+        result = TRUE;
     } else {
-        const struct ExportNameEntry *found;
+        result = HibernateModule(module, data, size, &tmp);
+    }
+    ReleaseSpinLock(&module->hibernationLock);
+    if (released != NULL) {
+        *released = tmp;
+    }
+    return result;
+}
+
+BOOL MemoryWakeModule(HMEMORYMODULE mod)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    BOOL result;
+    if (module == NULL) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    AcquireSpinLock(&module->hibernationLock);
+    result = WakeModule(module);
+    ReleaseSpinLock(&module->hibernationLock);
+    return result;
+}
+
+BOOL MemoryPrefetchModule(HMEMORYMODULE mod, const MEMORYRVARANGE *hotRanges, DWORD numHotRanges)
+{
+    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    if (module == NULL || (hotRanges == NULL && numHotRanges > 0)) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    // Hibernated pages are restored by the exception handler when they are
+    // touched, so the hibernation lock must not be held here.
+    return PrefetchModule(module, hotRanges, numHotRanges);
+}
 
-        // Lazily build name table and sort it by names
-        if (!module->nameExportsTable) {
-            DWORD i;
-            DWORD *nameRef = (DWORD *) (codeBase + exports->AddressOfNames);
-            WORD *ordinal = (WORD *) (codeBase + exports->AddressOfNameOrdinals);
-            struct ExportNameEntry *entry = (struct ExportNameEntry*) malloc(exports->NumberOfNames * sizeof(struct ExportNameEntry));
-            module->nameExportsTable = entry;
-            if (!entry) {
-                SetLastError(ERROR_OUTOFMEMORY);
-                return NULL;
+BOOL MemorySetEventCallback(MemoryEventCallback callback, void *userdata)
+{
+    EVENT_SINK *sink = NULL;
+    if (callback != NULL) {
+        AcquireSpinLock(&eventSinksLock);
+        for (sink=eventSinks; sink!=NULL; sink=sink->next) {
+            if (sink->callback == callback && sink->userdata == userdata) {
+                break;
             }
-            for (i=0; i<exports->NumberOfNames; i++, nameRef++, ordinal++, entry++) {
-                entry->name = (const char *) (codeBase + (*nameRef));
-                entry->idx = *ordinal;
+        }
+        if (sink == NULL) {
+            sink = (EVENT_SINK *) HeapAlloc(GetProcessHeap(), 0, sizeof(EVENT_SINK));
+            if (sink == NULL) {
+                ReleaseSpinLock(&eventSinksLock);
+                SetLastError(ERROR_OUTOFMEMORY);
+                return FALSE;
             }
-            qsort(module->nameExportsTable,
-                    exports->NumberOfNames,
-                    sizeof(struct ExportNameEntry), _compare);
+            sink->callback = callback;
+            sink->userdata = userdata;
+            sink->next = eventSinks;
+            eventSinks = sink;
         }
+        ReleaseSpinLock(&eventSinksLock);
+    }
 
-        // search function name in list of exported names with binary search
-        found = (const struct ExportNameEntry*) bsearch(&name,
-                module->nameExportsTable,
-                exports->NumberOfNames,
-                sizeof(struct ExportNameEntry), _find);
-        if (!found) {
-            // exported symbol not found
-            SetLastError(ERROR_PROC_NOT_FOUND);
-            return NULL;
-        }
+    InterlockedExchangePointer((PVOID volatile *) &eventSink, sink);
+    return TRUE;
+}
 
-        idx = found->idx;
+typedef struct {
+    volatile LONG lock;
+    DWORD capacity;
+    DWORD start;
+    DWORD count;
+    DWORD dropped;
+    MEMORYEVENTRECORD records[1];
+} MEMORY_EVENT_RING;
+
+HMEMORYEVENTRING MemoryCreateEventRing(DWORD capacity)
+{
+    MEMORY_EVENT_RING *ring;
+    if (capacity == 0) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
     }
 
-    if (idx > exports->NumberOfFunctions) {
-        // name <-> ordinal number don't match
-        SetLastError(ERROR_PROC_NOT_FOUND);
+    ring = (MEMORY_EVENT_RING *) calloc(1, sizeof(MEMORY_EVENT_RING) + (capacity - 1) * sizeof(MEMORYEVENTRECORD));
+    if (ring == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
         return NULL;
     }
 
-    // AddressOfFunctions contains the RVAs to the "real" functions
-    return (FARPROC)(LPVOID)(codeBase + (*(DWORD *) (codeBase + exports->AddressOfFunctions + (idx*4))));
+    ring->capacity = capacity;
+    return (HMEMORYEVENTRING) ring;
 }
 
-void MemoryFreeLibrary(HMEMORYMODULE mod)
+void MemoryDestroyEventRing(HMEMORYEVENTRING handle)
 {
-    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    free(handle);
+}
 
-    if (module == NULL) {
-        return;
+void MemoryEventRingCallback(const MEMORYEVENT *event, void *userdata)
+{
+    MEMORY_EVENT_RING *ring = (MEMORY_EVENT_RING *) userdata;
+    MEMORYEVENTRECORD *record;
+
+    AcquireSpinLock(&ring->lock);
+    if (ring->count == ring->capacity) {
+        // overwrite the oldest event
+        ring->start = (ring->start + 1) % ring->capacity;
+        ring->count--;
+        ring->dropped++;
     }
-    if (module->initialized) {
-        // notify library about detaching from process
-        DllEntryProc DllEntry = (DllEntryProc)(LPVOID)(module->codeBase + module->headers->OptionalHeader.AddressOfEntryPoint);
-        (*DllEntry)((HINSTANCE)module->codeBase, DLL_PROCESS_DETACH, 0);
+    record = &ring->records[(ring->start + ring->count) % ring->capacity];
+    record->event = *event;
+    record->name[0] = '\0';
+    if (event->name != NULL) {
+        size_t length = strlen(event->name);
+        if (length >= sizeof(record->name)) {
+            length = sizeof(record->name) - 1;
+        }
+        memcpy(record->name, event->name, length);
+        record->name[length] = '\0';
+        record->event.name = record->name;
     }
+    ring->count++;
+    ReleaseSpinLock(&ring->lock);
+}
 
-    UnregisterExceptionHandling(module);
+DWORD MemoryReadEventRing(HMEMORYEVENTRING handle, MEMORYEVENTRECORD *records, DWORD count, DWORD *dropped)
+{
+    MEMORY_EVENT_RING *ring = (MEMORY_EVENT_RING *) handle;
+    DWORD i;
 
-    free(module->nameExportsTable);
-    if (module->modules != NULL) {
-        // free previously opened libraries
-        int i;
-        for (i=0; i<module->numModules; i++) {
-            if (module->modules[i] != NULL) {
-                module->freeLibrary(module->modules[i], module->userdata);
-            }
+    AcquireSpinLock(&ring->lock);
+    if (count > ring->count) {
+        count = ring->count;
+    }
+    for (i=0; i<count; i++) {
+        records[i] = ring->records[ring->start];
+        if (records[i].event.name != NULL) {
+            records[i].event.name = records[i].name;
         }
-
-        free(module->modules);
+        ring->start = (ring->start + 1) % ring->capacity;
     }
-
-    if (module->codeBase != NULL) {
-        // release memory of library
-        module->free(module->codeBase, 0, MEM_RELEASE, module->userdata);
+    ring->count -= count;
+    if (dropped != NULL) {
+        *dropped = ring->dropped;
     }
+    ring->dropped = 0;
+    ReleaseSpinLock(&ring->lock);
+    return count;
+}
 
-#ifdef _WIN64
-    FreePointerList(module->blockedMemory, module->free, module->userdata);
-#endif
-    HeapFree(GetProcessHeap(), 0, module);
+static BOOL
+WriteString(HANDLE file, const char *data)
+{
+    DWORD written;
+    DWORD length = (DWORD) strlen(data);
+    return WriteFile(file, data, length, &written, NULL) && written == length;
 }
 
-int MemoryCallEntryPoint(HMEMORYMODULE mod)
+BOOL MemoryWriteEventTrace(HMEMORYEVENTRING handle, HANDLE file)
 {
-    PMEMORYMODULE module = (PMEMORYMODULE)mod;
+    static const char *eventNames[] = {
+        "load", "load", "dependency", "GetProcAddress", "FindResource", "free"
+    };
+    MEMORYEVENTRECORD record;
+    LARGE_INTEGER frequency;
+    DWORD pid = GetCurrentProcessId();
+    BOOL first = TRUE;
+    char line[512];
+
+    QueryPerformanceFrequency(&frequency);
+    if (!WriteString(file, "{\"traceEvents\":[\n")) {
+        return FALSE;
+    }
 
-    if (module == NULL || module->isDLL || module->exeEntry == NULL || !module->isRelocated) {
-        return -1;
+    while (MemoryReadEventRing(handle, &record, 1, NULL) == 1) {
+        const MEMORYEVENT *event = &record.event;
+        char name[2 * sizeof(record.name)];
+        const char *src;
+        char *dest = name;
+        const char *phase;
+
+        // escape the name for JSON
+        for (src = record.name; event->name != NULL && *src; src++) {
+            if (*src == '"' || *src == '\\') {
+                *dest++ = '\\';
+                *dest++ = *src;
+            } else if ((unsigned char) *src >= 0x20) {
+                *dest++ = *src;
+            }
+        }
+        *dest = '\0';
+
+        switch (event->type) {
+        case MEMORY_EVENT_LOAD_BEGIN:
+            phase = "B";
+            break;
+        case MEMORY_EVENT_LOAD_END:
+            phase = "E";
+            break;
+        default:
+            phase = "i";
+            break;
+        }
+
+        sprintf(line, "%s{\"name\":\"%s\",\"cat\":\"MemoryModule\",\"ph\":\"%s\",%s\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu,"
+            "\"args\":{\"module\":\"%p\",\"name\":\"%s\",\"value\":%I64u,\"address\":\"%p\",\"status\":%lu}}",
+            first ? "" : ",\n",
+            event->type < sizeof(eventNames) / sizeof(eventNames[0]) ? eventNames[event->type] : "event",
+            phase,
+            phase[0] == 'i' ? "\"s\":\"t\"," : "",
+            (double) event->timestamp * 1000000.0 / (double) frequency.QuadPart,
+            (unsigned long) pid,
+            (unsigned long) event->threadId,
+            event->module,
+            name,
+            (ULONGLONG) event->value,
+            event->address,
+            (unsigned long) event->status);
+        if (!WriteString(file, line)) {
+            return FALSE;
+        }
+        first = FALSE;
     }
 
-    return module->exeEntry();
+    return WriteString(file, "\n]}\n");
 }
 
 #define DEFAULT_LANGUAGE        MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL)
@@ -1064,7 +6350,8 @@ static PIMAGE_RESOURCE_DIRECTORY_ENTRY _MemorySearchResourceEntry(
     return result;
 }
 
-HMEMORYRSRC MemoryFindResourceEx(HMEMORYMODULE module, LPCTSTR name, LPCTSTR type, WORD language)
+static HMEMORYRSRC
+_MemoryFindResourceEx(HMEMORYMODULE module, LPCTSTR name, LPCTSTR type, WORD language)
 {
     unsigned char *codeBase = ((PMEMORYMODULE) module)->codeBase;
     PIMAGE_DATA_DIRECTORY directory = GET_HEADER_DICTIONARY((PMEMORYMODULE) module, IMAGE_DIRECTORY_ENTRY_RESOURCE);
@@ -1118,6 +6405,24 @@ HMEMORYRSRC MemoryFindResourceEx(HMEMORYMODULE module, LPCTSTR name, LPCTSTR typ
     return (codeBase + directory->VirtualAddress + (foundLanguage->OffsetToData & 0x7fffffff));
 }
 
+HMEMORYRSRC MemoryFindResourceEx(HMEMORYMODULE module, LPCTSTR name, LPCTSTR type, WORD language)
+{
+    HMEMORYRSRC result = _MemoryFindResourceEx(module, name, type, language);
+    if (eventSink != NULL) {
+        LPCSTR eventName = NULL;
+#if !defined(UNICODE)
+        if (!IS_INTRESOURCE(name)) {
+            eventName = name;
+        }
+#endif
+        EmitEvent(MEMORY_EVENT_RESOURCE_LOOKUP, module, eventName,
+            IS_INTRESOURCE(name) ? (ULONG_PTR) name : 0,
+            result,
+            result != NULL ? ERROR_SUCCESS : GetLastError());
+    }
+    return result;
+}
+
 DWORD MemorySizeofResource(HMEMORYMODULE module, HMEMORYRSRC resource)
 {
     PIMAGE_RESOURCE_DATA_ENTRY entry;
@@ -1187,8 +6492,6 @@ MemoryLoadStringEx(HMEMORYMODULE module, UINT id, LPTSTR buffer, int maxsize, WO
 }
 
 #ifdef TESTSUITE
-#include <stdio.h>
-
 #ifndef PRIxPTR
 #ifdef _WIN64
 #define PRIxPTR "I64x"
@@ -1221,6 +6524,569 @@ static const uintptr_t AlignValueUpTests[][3] = {
     {0, 0, 0},
 };
 
+static const MEMORYPROTECTIONRANGE ProtectionMapExpected[] = {
+    {0x1000, 0x1000, PAGE_EXECUTE_READ, FALSE},
+    // page shared by end of ".text" and start of ".data"
+    {0x2000, 0x1000, PAGE_EXECUTE_READWRITE, FALSE},
+    {0x3000, 0x2000, PAGE_READWRITE, FALSE},
+    {0x5000, 0x1000, PAGE_NOACCESS, TRUE},
+};
+
+static BOOL
+ProtectionMapTest(void) {
+    struct {
+        IMAGE_NT_HEADERS headers;
+        IMAGE_SECTION_HEADER sections[3];
+    } image;
+    MEMORYPROTECTIONRANGE *map;
+    DWORD count;
+    DWORD i;
+    BOOL success = TRUE;
+
+    memset(&image, 0, sizeof(image));
+    image.headers.FileHeader.NumberOfSections = 3;
+    image.headers.FileHeader.SizeOfOptionalHeader = sizeof(image.headers.OptionalHeader);
+    image.sections[0].VirtualAddress = 0x1000;
+    image.sections[0].SizeOfRawData = 0x1200;
+    image.sections[0].Characteristics = IMAGE_SCN_CNT_CODE | IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ;
+    image.sections[1].VirtualAddress = 0x2200;
+    image.sections[1].SizeOfRawData = 0x2e00;
+    image.sections[1].Characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE;
+    image.sections[2].VirtualAddress = 0x5000;
+    image.sections[2].SizeOfRawData = 0x200;
+    image.sections[2].Characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_DISCARDABLE;
+
+    if (!BuildProtectionMap(&image.headers, 0x1000, 0x6000, TRUE, &map, &count)) {
+        printf("BuildProtectionMap failed\n");
+        return FALSE;
+    }
+
+    if (count != sizeof(ProtectionMapExpected) / sizeof(ProtectionMapExpected[0])) {
+        printf("BuildProtectionMap returned %lu ranges\n", (unsigned long) count);
+        success = FALSE;
+    } else {
+        for (i = 0; i < count; i++) {
+            const MEMORYPROTECTIONRANGE *expected = &ProtectionMapExpected[i];
+            if (memcmp(&map[i], expected, sizeof(*expected)) != 0) {
+                printf("BuildProtectionMap failed for range %lu: expected 0x%lx/0x%lx/0x%lx, got 0x%lx/0x%lx/0x%lx\n",
+                    (unsigned long) i, expected->rva, expected->size, expected->protect,
+                    map[i].rva, map[i].size, map[i].protect);
+                success = FALSE;
+            }
+        }
+    }
+    free(map);
+    return success;
+}
+
+static const MEMORYPROTECTIONRANGE MarkDecommittedExpected[] = {
+    {0x1000, 0x1000, PAGE_READONLY, FALSE},
+    {0x2000, 0x1000, PAGE_NOACCESS, TRUE},
+    {0x3000, 0x2000, PAGE_READONLY, FALSE},
+    {0x5000, 0x1000, PAGE_READWRITE, FALSE},
+};
+
+static BOOL
+MarkDecommittedTest(void) {
+    MEMORYMODULE module;
+    DWORD i;
+    BOOL success = TRUE;
+
+    memset(&module, 0, sizeof(module));
+    module.protectionMap = (MEMORYPROTECTIONRANGE *) malloc(2 * sizeof(MEMORYPROTECTIONRANGE));
+    module.protectionMap[0].rva = 0x1000;
+    module.protectionMap[0].size = 0x4000;
+    module.protectionMap[0].protect = PAGE_READONLY;
+    module.protectionMap[0].decommitted = FALSE;
+    module.protectionMap[1].rva = 0x5000;
+    module.protectionMap[1].size = 0x1000;
+    module.protectionMap[1].protect = PAGE_READWRITE;
+    module.protectionMap[1].decommitted = FALSE;
+    module.numProtectionRanges = 2;
+
+    if (!MarkDecommitted(&module, 0x2000, 0x1000)) {
+        printf("MarkDecommitted failed\n");
+        free(module.protectionMap);
+        return FALSE;
+    }
+
+    if (module.numProtectionRanges != sizeof(MarkDecommittedExpected) / sizeof(MarkDecommittedExpected[0])) {
+        printf("MarkDecommitted returned %lu ranges\n", (unsigned long) module.numProtectionRanges);
+        success = FALSE;
+    } else {
+        for (i = 0; i < module.numProtectionRanges; i++) {
+            const MEMORYPROTECTIONRANGE *expected = &MarkDecommittedExpected[i];
+            if (memcmp(&module.protectionMap[i], expected, sizeof(*expected)) != 0) {
+                printf("MarkDecommitted failed for range %lu: expected 0x%lx/0x%lx, got 0x%lx/0x%lx\n",
+                    (unsigned long) i, expected->rva, expected->size,
+                    module.protectionMap[i].rva, module.protectionMap[i].size);
+                success = FALSE;
+            }
+        }
+    }
+    free(module.protectionMap);
+    return success;
+}
+
+static BOOL
+ReadImagePageTest(void) {
+    struct {
+        IMAGE_NT_HEADERS headers;
+        IMAGE_SECTION_HEADER section;
+    } image;
+    // the first relocation crosses the page boundary
+    DWORD relocations[] = {0x1ffe, 0x2100};
+    unsigned char data[0x2000];
+    unsigned char page[0x1000];
+    HIBERNATIONDATA hibernation;
+    MEMORYMODULE module;
+    DWORD value;
+    BOOL success = TRUE;
+
+    memset(&image, 0, sizeof(image));
+    image.headers.FileHeader.NumberOfSections = 1;
+    image.headers.FileHeader.SizeOfOptionalHeader = sizeof(image.headers.OptionalHeader);
+    image.section.VirtualAddress = 0x1000;
+    image.section.SizeOfRawData = sizeof(data);
+    memset(data, 0x11, sizeof(data));
+    memset(&hibernation, 0, sizeof(hibernation));
+    hibernation.data = data;
+    hibernation.size = sizeof(data);
+    memset(&module, 0, sizeof(module));
+    module.headers = &image.headers;
+    module.pageSize = 0x1000;
+    module.locationDelta = 0x01010101;
+    module.relocations = relocations;
+    module.numRelocations32 = 2;
+
+    ReadImagePage(&module, &hibernation, 0x1000, page);
+    if (page[0xffd] != 0x11 || page[0xffe] != 0x12 || page[0xfff] != 0x12) {
+        printf("ReadImagePage didn't relocate the end of the first page\n");
+        success = FALSE;
+    }
+    ReadImagePage(&module, &hibernation, 0x2000, page);
+    memcpy(&value, page + 0x100, sizeof(value));
+    if (page[0] != 0x12 || page[1] != 0x12 || page[2] != 0x11 || value != 0x12121212) {
+        printf("ReadImagePage didn't relocate the second page\n");
+        success = FALSE;
+    }
+    return success;
+}
+
+static BOOL
+EventRingTest(void) {
+    static const char *names[] = {"first", "second", "third"};
+    HMEMORYEVENTRING ring = MemoryCreateEventRing(2);
+    MEMORYEVENTRECORD records[3];
+    MEMORYEVENT event;
+    DWORD count, dropped, i;
+    BOOL success = TRUE;
+
+    memset(&event, 0, sizeof(event));
+    for (i=0; i<3; i++) {
+        event.type = MEMORY_EVENT_PROC_LOOKUP;
+        event.name = names[i];
+        event.value = i;
+        MemoryEventRingCallback(&event, ring);
+    }
+
+    count = MemoryReadEventRing(ring, records, 3, &dropped);
+    if (count != 2 || dropped != 1) {
+        printf("MemoryReadEventRing returned %lu events, %lu dropped (expected 2, 1)\n",
+            (unsigned long) count, (unsigned long) dropped);
+        success = FALSE;
+    } else {
+        for (i=0; i<2; i++) {
+            if (records[i].event.value != i + 1 || records[i].event.name != records[i].name ||
+                strcmp(records[i].name, names[i + 1]) != 0) {
+                printf("MemoryReadEventRing returned wrong event %lu: %s\n", (unsigned long) i, records[i].name);
+                success = FALSE;
+            }
+        }
+    }
+    if (MemoryReadEventRing(ring, records, 3, NULL) != 0) {
+        printf("MemoryReadEventRing didn't remove events\n");
+        success = FALSE;
+    }
+    MemoryDestroyEventRing(ring);
+    return success;
+}
+
+#ifdef HAVE_STREAMING_COPY
+static BOOL
+StreamCopyTest(void) {
+    static const size_t sizes[] = {0, 1, 15, 16, 63, 64, 65, 1000, 4099};
+    unsigned char src[4200];
+    unsigned char dest[4200 + 16];
+    size_t i, offset;
+    BOOL success = TRUE;
+
+    for (i=0; i<sizeof(src); i++) {
+        src[i] = (unsigned char) (i * 7 + 3);
+    }
+    // all alignments of the destination
+    for (offset=0; offset<16; offset++) {
+        for (i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++) {
+            memset(dest, 0xcc, sizeof(dest));
+            StreamCopy(dest + offset, src + 1, sizes[i]);
+            if (memcmp(dest + offset, src + 1, sizes[i]) != 0 ||
+                (offset > 0 && dest[offset - 1] != 0xcc) ||
+                dest[offset + sizes[i]] != 0xcc) {
+                printf("StreamCopy failed for %lu bytes at offset %lu\n", (unsigned long) sizes[i], (unsigned long) offset);
+                success = FALSE;
+            }
+        }
+    }
+    return success;
+}
+#endif
+
+static LPVOID
+NoAlloc(LPVOID address, SIZE_T size, DWORD allocationType, DWORD protect, void *userdata)
+{
+    UNREFERENCED_PARAMETER(address);
+    UNREFERENCED_PARAMETER(size);
+    UNREFERENCED_PARAMETER(allocationType);
+    UNREFERENCED_PARAMETER(protect);
+    UNREFERENCED_PARAMETER(userdata);
+    return NULL;
+}
+
+static BOOL
+CopySectionsTest(void) {
+    struct {
+        IMAGE_NT_HEADERS headers;
+        IMAGE_SECTION_HEADER sections[3];
+    } image;
+    unsigned char data[0x500];
+    unsigned char codeBase[0x2400];
+    MEMORYMODULE module;
+    VERIFYSTATE state;
+    ULONGLONG sum;
+    size_t i;
+    BOOL success = TRUE;
+
+    for (i=0; i<sizeof(data); i++) {
+        data[i] = (unsigned char) (i * 11 + 1);
+    }
+    ((PIMAGE_DOS_HEADER) data)->e_lfanew = 0x40;
+    memset(&image, 0, sizeof(image));
+    image.headers.FileHeader.NumberOfSections = 3;
+    image.headers.FileHeader.SizeOfOptionalHeader = sizeof(image.headers.OptionalHeader);
+    image.headers.OptionalHeader.SectionAlignment = 0x100;
+    image.headers.OptionalHeader.SizeOfImage = sizeof(codeBase);
+    // the first two sections are copied as one run, the last one has
+    // uninitialized data at its end
+    image.sections[0].VirtualAddress = 0x1000;
+    image.sections[0].PointerToRawData = 0x200;
+    image.sections[0].SizeOfRawData = 0x100;
+    image.sections[1].VirtualAddress = 0x1100;
+    image.sections[1].PointerToRawData = 0x300;
+    image.sections[1].SizeOfRawData = 0x100;
+    image.sections[2].VirtualAddress = 0x2000;
+    image.sections[2].PointerToRawData = 0x400;
+    image.sections[2].SizeOfRawData = 0x100;
+    image.sections[2].Misc.VirtualSize = 0x300;
+
+    // the whole file is verified, in order of the file offsets
+    memset(&state, 0, sizeof(state));
+    state.checksum = TRUE;
+    state.checksumOffset = 0x40 + FIELD_OFFSET(IMAGE_NT_HEADERS, OptionalHeader.CheckSum);
+    VerifyRange(&state, data, sizeof(data));
+    for (sum=state.checksumSum; sum >> 16; ) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    image.headers.OptionalHeader.CheckSum = (DWORD) (sum + sizeof(data));
+
+    // memory of custom allocators is not zero
+    memset(codeBase, 0xcc, sizeof(codeBase));
+    memset(&module, 0, sizeof(module));
+    module.headers = &image.headers;
+    module.codeBase = codeBase;
+    module.alloc = NoAlloc;
+    module.flags = MEMORY_LOAD_VERIFY_CHECKSUM;
+    if (!CopySections(data, sizeof(data), &module, NULL)) {
+        printf("CopySections failed: %lu\n", (unsigned long) GetLastError());
+        return FALSE;
+    }
+
+    if (memcmp(codeBase + 0x1000, data + 0x200, 0x200) != 0 ||
+        memcmp(codeBase + 0x2000, data + 0x400, 0x100) != 0) {
+        printf("CopySections didn't copy the section data\n");
+        success = FALSE;
+    }
+    for (i=0x2100; i<0x2300; i++) {
+        if (codeBase[i] != 0) {
+            printf("CopySections didn't clear uninitialized data at 0x%lx\n", (unsigned long) i);
+            success = FALSE;
+            break;
+        }
+    }
+    if (codeBase[0xfff] != 0xcc || codeBase[0x1200] != 0xcc || codeBase[0x2300] != 0xcc) {
+        printf("CopySections wrote outside of the sections\n");
+        success = FALSE;
+    }
+    return success;
+}
+
+static BOOL
+ParallelCopyTest(void) {
+    size_t size = PARALLEL_COPY_THRESHOLD + PARALLEL_COPY_CHUNK / 2 + 1;
+    unsigned char *src = (unsigned char *) malloc(size);
+    unsigned char *dest = (unsigned char *) malloc(size);
+    unsigned char expectedHash[MEMORY_SHA256_SIZE];
+    VERIFYSTATE copied, expected;
+    size_t i;
+    BOOL success = TRUE;
+
+    if (src == NULL || dest == NULL) {
+        free(src);
+        free(dest);
+        return FALSE;
+    }
+
+    for (i=0; i<size; i++) {
+        src[i] = (unsigned char) (i * 7 + i / 4093);
+    }
+    memset(dest, 0, size);
+    memset(&copied, 0, sizeof(copied));
+    copied.hash = TRUE;
+    copied.checksum = TRUE;
+    copied.checksumOffset = 100;
+    Sha256Init(&copied.sha);
+    expected = copied;
+
+    CopyRange(dest, src, 0, size, &copied);
+    VerifyRange(&expected, src, size);
+    Sha256Final(&copied.sha, copied.digest);
+    Sha256Final(&expected.sha, expectedHash);
+    if (memcmp(dest, src, size) != 0) {
+        printf("Parallel copy failed\n");
+        success = FALSE;
+    }
+    if (copied.verified != size || copied.checksumSum != expected.checksumSum ||
+        memcmp(copied.digest, expectedHash, MEMORY_SHA256_SIZE) != 0) {
+        printf("Parallel copy wasn't verified in order\n");
+        success = FALSE;
+    }
+    free(src);
+    free(dest);
+    return success;
+}
+
+static BOOL
+Sha256Test(void) {
+    static const char *inputs[] = {
+        "",
+        "abc",
+        "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    };
+    static const char *expected[] = {
+        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+    };
+    SHA256CONTEXT ctx;
+    unsigned char hash[MEMORY_SHA256_SIZE];
+    char hex[MEMORY_SHA256_SIZE * 2 + 1];
+    size_t i, j, length;
+    BOOL success = TRUE;
+
+    for (i=0; i<sizeof(inputs) / sizeof(inputs[0]); i++) {
+        // process the input in pieces of different sizes
+        length = strlen(inputs[i]);
+        Sha256Init(&ctx);
+        for (j=0; j<length; j+=j+1) {
+            Sha256Update(&ctx, (const unsigned char *) inputs[i] + j, (j + j + 1 < length ? j + 1 : length - j));
+        }
+        Sha256Final(&ctx, hash);
+        for (j=0; j<MEMORY_SHA256_SIZE; j++) {
+            sprintf(hex + j * 2, "%02x", hash[j]);
+        }
+        if (strcmp(hex, expected[i]) != 0) {
+            printf("SHA-256 of \"%s\" failed: expected %s, got %s\n", inputs[i], expected[i], hex);
+            success = FALSE;
+        }
+    }
+    return success;
+}
+
+static BOOL
+ChecksumTest(void) {
+    unsigned char data[301];
+    VERIFYSTATE whole, pieces;
+    size_t i;
+    BOOL success = TRUE;
+
+    for (i=0; i<sizeof(data); i++) {
+        data[i] = (unsigned char) (i * 13 + 5);
+    }
+    memset(&whole, 0, sizeof(whole));
+    whole.checksum = TRUE;
+    whole.checksumOffset = 100;
+    pieces = whole;
+
+    VerifyRange(&whole, data, sizeof(data));
+    // odd boundaries and one inside the ignored field
+    VerifyRange(&pieces, data, 33);
+    VerifyRange(&pieces, data + pieces.verified, 102);
+    VerifyRange(&pieces, data + pieces.verified, 177);
+    VerifyRange(&pieces, data + pieces.verified, sizeof(data));
+    if (whole.checksumSum != pieces.checksumSum) {
+        printf("Checksum of pieces differs: expected %lu, got %lu\n",
+            (unsigned long) whole.checksumSum, (unsigned long) pieces.checksumSum);
+        success = FALSE;
+    }
+
+    // the field at "checksumOffset" must not change the sum
+    data[101] ^= 0xff;
+    memset(&pieces, 0, sizeof(pieces));
+    pieces.checksum = TRUE;
+    pieces.checksumOffset = 100;
+    VerifyRange(&pieces, data, sizeof(data));
+    if (whole.checksumSum != pieces.checksumSum) {
+        printf("Checksum includes the checksum field\n");
+        success = FALSE;
+    }
+    return success;
+}
+
+static BOOL
+SortForUnloadTest(void) {
+    MEMORYMODULE modules[4];
+    PMEMORYMODULE input[4];
+    PMEMORYMODULE *order;
+    HCUSTOMMODULE imports[2][1];
+    // "a" imports "c", "c" and "d" import each other
+    static const int inputOrder[4] = {2, 0, 1, 3};
+    static const int expected[4] = {1, 0, 3, 2};
+    BOOL success = TRUE;
+    int i;
+
+    memset(modules, 0, sizeof(modules));
+    imports[0][0] = (HCUSTOMMODULE) &modules[2];
+    modules[0].modules = imports[0];
+    modules[0].numModules = 1;
+    imports[1][0] = (HCUSTOMMODULE) &modules[3];
+    modules[2].modules = imports[1];
+    modules[2].numModules = 1;
+    modules[3].modules = imports[0];
+    modules[3].numModules = 1;
+
+    for (i=0; i<4; i++) {
+        input[i] = &modules[inputOrder[i]];
+    }
+    order = SortForUnload(input, 4);
+    if (order == NULL) {
+        printf("SortForUnload failed\n");
+        return FALSE;
+    }
+    for (i=0; i<4; i++) {
+        if (order[i] != &modules[expected[i]]) {
+            printf("SortForUnload: expected module %d at %d, got %d\n", expected[i], i, (int) (order[i] - modules));
+            success = FALSE;
+        }
+    }
+    free(order);
+    return success;
+}
+
+static BOOL
+ModuleIndexTest(void) {
+    MEMORYMODULE modules[2];
+    PMEMORYMODULE module;
+    const MODULE_INDEX *pinned;
+    BOOL success = TRUE;
+    int i;
+
+    memset(modules, 0, sizeof(modules));
+    for (i=0; i<2; i++) {
+        modules[i].codeBase = (unsigned char *) (uintptr_t) (0x10000000 * (i + 1));
+        if (!RegisterModuleRange(&modules[i], 0x1000)) {
+            printf("Can't register module range\n");
+            return FALSE;
+        }
+    }
+
+    // a notification of this thread frees the first module
+    pinned = AcquireModuleIndex();
+    TlsSetValue(moduleIndexHeldSlot, (LPVOID) pinned);
+    module = &modules[0];
+    if (UnregisterModuleRanges(&module, 1)) {
+        printf("Range was removed in place\n");
+        success = FALSE;
+    }
+    WaitForModuleIndexReaders(&module, NULL, 1, FALSE);
+    if (pinned == moduleIndex || pinned->count != 2 || retiredModuleIndexes != pinned) {
+        printf("Pinned snapshot was changed or released\n");
+        success = FALSE;
+    }
+    if (MemoryModuleFromAddress(modules[0].codeBase, NULL) != NULL ||
+        MemoryModuleFromAddress(modules[1].codeBase, NULL) != (HMEMORYMODULE) &modules[1]) {
+        printf("Lookup returned wrong module after unregistering\n");
+        success = FALSE;
+    }
+    TlsSetValue(moduleIndexHeldSlot, NULL);
+    ReleaseModuleIndex(pinned);
+
+    module = &modules[1];
+    UnregisterModuleRanges(&module, 1);
+    if (retiredModuleIndexes != NULL || moduleIndex == NULL || moduleIndex->count != 0) {
+        printf("Retired snapshots were not released\n");
+        success = FALSE;
+    }
+    return success;
+}
+
+static int
+TrampolineTarget1(int value) {
+    return value + 1;
+}
+
+static int
+TrampolineTarget2(int value) {
+    return value + 2;
+}
+
+static BOOL
+TrampolineTest(void) {
+    typedef int (*TestProc)(int);
+    FARPROC first[2], second[2];
+    FARPROC * volatile *table;
+    unsigned char *code;
+    TestProc stub;
+    BOOL success = TRUE;
+
+    code = (unsigned char *) VirtualAlloc(NULL, 4096, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+    if (code == NULL) {
+        printf("Can't allocate trampoline memory\n");
+        return FALSE;
+    }
+
+    first[0] = (FARPROC) TrampolineTarget1;
+    first[1] = (FARPROC) TrampolineTarget2;
+    second[0] = (FARPROC) TrampolineTarget2;
+    second[1] = (FARPROC) TrampolineTarget1;
+    table = (FARPROC * volatile *) (code + 2048);
+    *table = first;
+    WriteTrampoline(code, table, 0);
+    WriteTrampoline(code + TRAMPOLINE_SIZE, table, 1);
+    FlushInstructionCache(GetCurrentProcess(), code, 2 * TRAMPOLINE_SIZE);
+
+    stub = (TestProc) (code + TRAMPOLINE_SIZE);
+    if (stub(10) != 12) {
+        printf("Trampoline called wrong target\n");
+        success = FALSE;
+    }
+    *table = second;
+    if (stub(10) != 11) {
+        printf("Trampoline didn't follow the new table\n");
+        success = FALSE;
+    }
+    VirtualFree(code, 0, MEM_RELEASE);
+    return success;
+}
+
 BOOL MemoryModuleTestsuite() {
     BOOL success = TRUE;
     size_t idx;
@@ -1242,6 +7108,44 @@ BOOL MemoryModuleTestsuite() {
             success = FALSE;
         }
     }
+    if (!ProtectionMapTest()) {
+        success = FALSE;
+    }
+    if (!MarkDecommittedTest()) {
+        success = FALSE;
+    }
+    if (!ReadImagePageTest()) {
+        success = FALSE;
+    }
+    if (!EventRingTest()) {
+        success = FALSE;
+    }
+#ifdef HAVE_STREAMING_COPY
+    if (!StreamCopyTest()) {
+        success = FALSE;
+    }
+#endif
+    if (!Sha256Test()) {
+        success = FALSE;
+    }
+    if (!CopySectionsTest()) {
+        success = FALSE;
+    }
+    if (!ParallelCopyTest()) {
+        success = FALSE;
+    }
+    if (!ChecksumTest()) {
+        success = FALSE;
+    }
+    if (!SortForUnloadTest()) {
+        success = FALSE;
+    }
+    if (!ModuleIndexTest()) {
+        success = FALSE;
+    }
+    if (!TrampolineTest()) {
+        success = FALSE;
+    }
     if (success) {
         printf("OK\n");
     }
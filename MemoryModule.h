@@ -35,16 +35,236 @@ typedef void *HMEMORYRSRC;
 
 typedef void *HCUSTOMMODULE;
 
+typedef void *HMEMORYPOOL;
+
+typedef void *HMEMORYEVENTRING;
+
+typedef void *HMEMORYIMAGE;
+
+typedef void *HMEMORYLOAD;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Back the image with large pages if the image fills at least one large
+ * page and the process may use them ("SeLockMemoryPrivilege" has been
+ * granted). Falls back to normal pages otherwise.
+ *
+ * Page protections can only be applied to complete large pages, so all
+ * sections sharing a large page get the combined access flags.
+ *
+ * The first load with this flag enables "SeLockMemoryPrivilege" in the
+ * process token if it has been granted. It stays enabled for the lifetime
+ * of the process and applies to all threads using the process token.
+ */
+#define MEMORY_LOAD_LARGE_PAGES     0x00000001
+
+/**
+ * Release pages that only contain data needed while loading after the
+ * imports have been bound, see MemoryTrimModule.
+ */
+#define MEMORY_LOAD_TRIM            0x00000002
+
+/**
+ * If the preferred image base is not available, reserve the free range
+ * closest to it. On 64bit only ranges within rel32 range (+/- 2 GB) of
+ * "nearAddress" (the executable of the process if NULL) are used, so code
+ * of the host can reach the image with 32bit displacements.
+ */
+#define MEMORY_LOAD_PLACE_NEARBY    0x00000004
+
+/**
+ * Prefetch the module after the sections have been protected, see
+ * MemoryPrefetchModule. Uses the "hotRanges" of the load options.
+ */
+#define MEMORY_LOAD_PREFETCH        0x00000008
+
+/**
+ * Verify the "CheckSum" of the optional header while the sections are
+ * copied. Images without checksum fail to load with ERROR_INVALID_IMAGE_HASH
+ * like images whose checksum doesn't match.
+ *
+ * Parts of the image (e.g. the headers) are verified from the data passed
+ * to the load instead of the loaded copy, the data must not be changed
+ * until the load returns.
+ */
+#define MEMORY_LOAD_VERIFY_CHECKSUM 0x00000010
+
+/**
+ * Share the module with other loads of the same image. If a module was
+ * loaded from identical data with the same callbacks, userdata and
+ * MEMORY_LOAD_VERIFY_CHECKSUM flag, its reference count is incremented and
+ * it is returned instead of loading the image again. The module is only
+ * freed when MemoryFreeLibrary has been called for every load.
+ *
+ * Candidates are found by a hash of the headers, the SHA-256 of the whole
+ * image is compared if the headers match. Loads of the same image that run
+ * concurrently may still return separate modules.
+ */
+#define MEMORY_LOAD_SHARED          0x00000020
+
+/**
+ * Return exported functions from MemoryGetProcAddress as trampolines with
+ * stable addresses, so they stay valid across MemoryReloadModule. Exported
+ * data is returned directly. Can't be combined with MEMORY_LOAD_SHARED.
+ */
+#define MEMORY_LOAD_TRAMPOLINES     0x00000040
+
+typedef struct {
+    DWORD rva;
+    DWORD size;
+} MEMORYRVARANGE;
+
+#define MEMORY_SHA256_SIZE  32
+
+typedef struct {
+    BYTE hash[MEMORY_SHA256_SIZE];
+} MEMORYIMAGEHASH;
+
+/**
+ * Options for MemoryLoadLibraryEx2, unused fields must be zero. "cbSize"
+ * must be set to sizeof(MEMORYLOADOPTIONS), loads fail with
+ * ERROR_INVALID_PARAMETER otherwise.
+ *
+ * The image is placed at the first of these locations that is available:
+ * the preferred image base, a nearby range (MEMORY_LOAD_PLACE_NEARBY), one
+ * of the "numCandidateBases" addresses in "candidateBases" or any address.
+ *
+ * If "numAllowedHashes" is not 0, the SHA-256 of the image data (see
+ * MemoryHashImage) must match one of the "allowedHashes". It is computed
+ * while the sections are copied and a mismatch fails the load with
+ * ERROR_INVALID_IMAGE_HASH before any imports are loaded or code runs. Like
+ * with MEMORY_LOAD_VERIFY_CHECKSUM, the data must not be changed until the
+ * load returns.
+ */
+typedef struct {
+    DWORD cbSize;
+    DWORD flags;
+    LPCVOID nearAddress;
+    const ULONG_PTR *candidateBases;
+    DWORD numCandidateBases;
+    const MEMORYRVARANGE *hotRanges;
+    DWORD numHotRanges;
+    const MEMORYIMAGEHASH *allowedHashes;
+    DWORD numAllowedHashes;
+} MEMORYLOADOPTIONS;
+
+#define MEMORY_PLACEMENT_PREFERRED  0
+#define MEMORY_PLACEMENT_NEARBY     1
+#define MEMORY_PLACEMENT_CANDIDATE  2
+#define MEMORY_PLACEMENT_ANY        3
+
+typedef struct {
+    DWORD placement;
+    LPVOID base;
+    LONG_PTR delta;
+    DWORD relocations;
+} MEMORYPLACEMENTINFO;
+
+typedef struct {
+    DWORD rva;
+    DWORD size;
+    DWORD protect;
+    BOOL decommitted;
+} MEMORYPROTECTIONRANGE;
+
+#define MEMORY_LOAD_PHASE_HEADERS       0
+#define MEMORY_LOAD_PHASE_COPY          1
+#define MEMORY_LOAD_PHASE_RELOCATE      2
+#define MEMORY_LOAD_PHASE_IMPORTS       3
+#define MEMORY_LOAD_PHASE_EXCEPTIONS    4
+#define MEMORY_LOAD_PHASE_FINALIZE      5
+#define MEMORY_LOAD_PHASE_TLS           6
+#define MEMORY_LOAD_PHASE_ENTRYPOINT    7
+#define MEMORY_LOAD_PHASE_COUNT         8
+
+typedef struct {
+    // ticks per second of "phaseTicks"
+    ULONGLONG frequency;
+    ULONGLONG phaseTicks[MEMORY_LOAD_PHASE_COUNT];
+    ULONGLONG numLoads;
+    ULONGLONG bytesCopied;
+    ULONGLONG relocations;
+    ULONGLONG importsResolved;
+    ULONGLONG protectCalls;
+    ULONGLONG pagesDecommitted;
+} MEMORYLOADSTATS;
+
+typedef struct {
+    DWORD numRegions;
+    DWORD numSlots;
+    DWORD numFreeBlocks;
+    SIZE_T reservedBytes;
+    SIZE_T usedBytes;
+    SIZE_T committedBytes;
+    SIZE_T freeBytes;
+    SIZE_T largestFreeBlock;
+    ULONGLONG syscalls;
+    ULONGLONG syscallsAvoided;
+} MEMORYPOOLSTATS;
+
+#define MEMORY_EVENT_LOAD_BEGIN         0
+#define MEMORY_EVENT_LOAD_END           1
+#define MEMORY_EVENT_DEPENDENCY         2
+#define MEMORY_EVENT_PROC_LOOKUP        3
+#define MEMORY_EVENT_RESOURCE_LOOKUP    4
+#define MEMORY_EVENT_FREE               5
+
+/**
+ * Loader event. "timestamp" is a QueryPerformanceCounter value, "status" is
+ * ERROR_SUCCESS or the error of a failed operation. The other fields depend
+ * on "type":
+ *
+ * LOAD_BEGIN:      "value" is the image size, "address" the image data
+ * LOAD_END:        "module" is the loaded module, "address" its base
+ * DEPENDENCY:      "name" is the imported library, "address" its handle
+ * PROC_LOOKUP:     "name" or "value" (ordinal) is the symbol, "address" the
+ *                  function that was found
+ * RESOURCE_LOOKUP: "name" (ANSI builds) or "value" (integer id) is the
+ *                  resource name, "address" the resource that was found
+ * FREE:            "module" is the module being freed, "address" its base
+ *
+ * "name" is only valid while the callback runs.
+ */
+typedef struct {
+    DWORD type;
+    DWORD threadId;
+    LONGLONG timestamp;
+    HMEMORYMODULE module;
+    LPCSTR name;
+    ULONG_PTR value;
+    LPCVOID address;
+    DWORD status;
+} MEMORYEVENT;
+
+typedef struct {
+    MEMORYEVENT event;
+    // copy of the name, "event.name" points here
+    char name[64];
+} MEMORYEVENTRECORD;
+
+typedef void (*MemoryEventCallback)(const MEMORYEVENT *, void *);
+
 typedef LPVOID (*CustomAllocFunc)(LPVOID, SIZE_T, DWORD, DWORD, void*);
 typedef BOOL (*CustomFreeFunc)(LPVOID, SIZE_T, DWORD, void*);
 typedef HCUSTOMMODULE (*CustomLoadLibraryFunc)(LPCSTR, void *);
 typedef FARPROC (*CustomGetProcAddressFunc)(HCUSTOMMODULE, LPCSTR, void *);
 typedef void (*CustomFreeLibraryFunc)(HCUSTOMMODULE, void *);
 
+/**
+ * Called on the worker thread when an asynchronous load is done with the
+ * module (NULL if the load failed) and the error code.
+ */
+typedef void (*MemoryLoadCallback)(HMEMORYLOAD, HMEMORYMODULE, DWORD, void *);
+
+/**
+ * Don't run TLS callbacks and the entry point on the worker thread, they are
+ * run by MemoryFinishLoad on the thread that calls it.
+ */
+#define MEMORY_ASYNC_DEFER_ENTRY_POINT  0x00000001
+
 /**
  * Load EXE/DLL from memory location with the given size.
  *
@@ -67,17 +287,201 @@ HMEMORYMODULE MemoryLoadLibraryEx(const void *, size_t,
     CustomFreeLibraryFunc,
     void *);
 
+/**
+ * Load EXE/DLL from memory location with the given size using custom dependency
+ * resolvers and additional options.
+ *
+ * "options" can be NULL, which behaves like MemoryLoadLibraryEx.
+ */
+HMEMORYMODULE MemoryLoadLibraryEx2(const void *, size_t,
+    const MEMORYLOADOPTIONS *,
+    CustomAllocFunc,
+    CustomFreeFunc,
+    CustomLoadLibraryFunc,
+    CustomGetProcAddressFunc,
+    CustomFreeLibraryFunc,
+    void *);
+
+/**
+ * Start loading an EXE/DLL on the system thread pool, the arguments are the
+ * same as for MemoryLoadLibraryEx2. "data" and the arrays referenced by
+ * "options" must stay valid until the load is done.
+ *
+ * "flags" are MEMORY_ASYNC_* values. If "callback" is not NULL, it is called
+ * when the worker is done. Every load must be completed with
+ * MemoryFinishLoad, which may also be called from the callback.
+ */
+HMEMORYLOAD MemoryLoadLibraryAsync(const void *, size_t,
+    const MEMORYLOADOPTIONS *,
+    CustomAllocFunc,
+    CustomFreeFunc,
+    CustomLoadLibraryFunc,
+    CustomGetProcAddressFunc,
+    CustomFreeLibraryFunc,
+    void *,
+    DWORD,
+    MemoryLoadCallback,
+    void *);
+
+/**
+ * Get a manual-reset event that is signaled when the worker is done with the
+ * load. It is owned by the load and must not be used after MemoryFinishLoad.
+ */
+HANDLE MemoryGetLoadEvent(HMEMORYLOAD);
+
+/**
+ * Request cancellation of a load, it stops at the next step and
+ * MemoryFinishLoad fails with ERROR_CANCELLED. A module that has been loaded
+ * completely before the request is freed by MemoryFinishLoad.
+ */
+BOOL MemoryCancelLoad(HMEMORYLOAD);
+
+/**
+ * Wait for loads, the arguments and result are the same as for
+ * WaitForMultipleObjects but any number of loads is supported. Waiting for
+ * any of more than MAXIMUM_WAIT_OBJECTS loads polls them in groups, which
+ * adds a millisecond of latency per group.
+ */
+DWORD MemoryWaitForLoads(const HMEMORYLOAD *, DWORD, BOOL, DWORD);
+
+/**
+ * Wait for a load to complete and release it. Runs the entry point if it has
+ * been deferred. Returns the loaded module or NULL if the load failed or was
+ * cancelled.
+ */
+HMEMORYMODULE MemoryFinishLoad(HMEMORYLOAD);
+
+/**
+ * Validate an EXE/DLL and precompute everything that doesn't depend on the
+ * address it is loaded to: the layout, page protections, base relocations,
+ * imports and the sorted export names. The data is copied and can be
+ * released after the call.
+ *
+ * The returned image is read-only and can be used from multiple threads.
+ */
+HMEMORYIMAGE MemoryParseImage(const void *, size_t);
+
+/**
+ * Load a module from an image returned by MemoryParseImage. Behaves like
+ * MemoryLoadLibraryEx2 but skips parsing the image again, it can be called
+ * any number of times.
+ */
+HMEMORYMODULE MemoryLoadFromImage(HMEMORYIMAGE,
+    const MEMORYLOADOPTIONS *,
+    CustomAllocFunc,
+    CustomFreeFunc,
+    CustomLoadLibraryFunc,
+    CustomGetProcAddressFunc,
+    CustomFreeLibraryFunc,
+    void *);
+
+/**
+ * Release an image returned by MemoryParseImage. Modules loaded from it keep
+ * it alive until they are freed.
+ */
+void MemoryFreeImage(HMEMORYIMAGE);
+
+/**
+ * Compute the SHA-256 of image data to be used in the "allowedHashes" of
+ * the load options.
+ */
+BOOL MemoryHashImage(const void *, size_t, MEMORYIMAGEHASH *);
+
 /**
  * Get address of exported method. Supports loading both by name and by
  * ordinal value.
+ *
+ * Can be called concurrently from multiple threads for the same module.
  */
 FARPROC MemoryGetProcAddress(HMEMORYMODULE, LPCSTR);
 
+/**
+ * Hash of an export name as used by MemoryGetProcAddressHash (32bit FNV-1a
+ * of the bytes of the name). C++ code can compute it at compile time with
+ * MemoryModule::HashSymbol from MemoryModule.hpp.
+ */
+DWORD MemoryHashSymbolName(LPCSTR);
+
+/**
+ * Look up an export by name and its MemoryHashSymbolName hash. Probes a hash
+ * index of the exports instead of searching the sorted names, only names
+ * with the same hash are compared.
+ */
+FARPROC MemoryGetProcAddressHash(HMEMORYMODULE, DWORD, LPCSTR);
+
+/**
+ * Cache for the address of an export, usually a static variable at the call
+ * site that is zero initialized. While "module" is the module of a call,
+ * "proc" can be used without a lookup.
+ */
+typedef struct MEMORYPROCSLOT {
+    HMEMORYMODULE volatile module;
+    FARPROC volatile proc;
+    struct MEMORYPROCSLOT *next;
+} MEMORYPROCSLOT;
+
+/**
+ * Look up an export like MemoryGetProcAddressHash and bind the slot to the
+ * module if it is unbound. Slots bound to another module are left alone.
+ * When the module is freed, all its slots are reset to zero, so a reused
+ * handle can't match a stale slot.
+ *
+ * A bound slot must stay valid until its module is freed, static variables
+ * are fine.
+ */
+FARPROC MemoryBindProc(HMEMORYMODULE, MEMORYPROCSLOT *, DWORD, LPCSTR);
+
+/**
+ * Load a new version of a module loaded with MEMORY_LOAD_TRAMPOLINES, using
+ * the same flags and callbacks, and point the trampolines returned so far
+ * to the exports of the new version. Returns the handle of the new module,
+ * which owns the trampolines from now on.
+ *
+ * The new module is started before any trampoline is switched, calls that
+ * are made afterwards run in it. Calls that are still running in the old
+ * module are not affected, free the old handle with MemoryFreeLibrary once
+ * they have completed. It must not be used otherwise.
+ *
+ * Fails with ERROR_PROC_NOT_FOUND, leaving the old module active, if the new
+ * version doesn't export all functions that have trampolines.
+ */
+HMEMORYMODULE MemoryReloadModule(HMEMORYMODULE, const void *, size_t);
+
 /**
  * Free previously loaded EXE/DLL.
+ *
+ * May be called from the DllMain or TLS callbacks of another memory module,
+ * also while it is handling DLL_THREAD_ATTACH or DLL_THREAD_DETACH. A module
+ * must not free itself from these notifications.
  */
 void MemoryFreeLibrary(HMEMORYMODULE);
 
+/**
+ * Flag for MemoryFreeLibraries: the process is about to exit. The modules
+ * receive DLL_PROCESS_DETACH with a non-NULL "lpReserved", but their memory
+ * is not released and imported libraries are not freed. The handles must
+ * not be used afterwards.
+ */
+#define MEMORY_FREE_PROCESS_TERMINATING 0x00000001
+
+/**
+ * Free multiple modules at once, NULL entries are ignored. Modules are
+ * detached before modules of the batch they import from, otherwise in
+ * reverse order of the array. Libraries imported by the modules are freed
+ * after all modules have been released. Each entry releases one reference
+ * of a MEMORY_LOAD_SHARED module.
+ *
+ * If a custom "loadLibrary" callback resolved an import of a module to
+ * another module that is freed by the same batch, that import is not passed
+ * to the "freeLibrary" callback: the entry of the batch releases the module
+ * and the import must not hold a reference of its own. Imports that still
+ * hold a reference (e.g. a shared module that stays loaded after the batch
+ * released its entry) are passed to "freeLibrary" as usual.
+ *
+ * Same restrictions as MemoryFreeLibrary.
+ */
+BOOL MemoryFreeLibraries(const HMEMORYMODULE *, DWORD, DWORD);
+
 /**
  * Execute entry point (EXE only). The entry point can only be executed
  * if the EXE has been loaded to the correct base address or it could
@@ -91,6 +495,103 @@ void MemoryFreeLibrary(HMEMORYMODULE);
  */
 int MemoryCallEntryPoint(HMEMORYMODULE);
 
+/**
+ * Find the module that contains the given address, e.g. an instruction
+ * pointer from a crash handler or sampling profiler. If "rva" is not NULL,
+ * it receives the offset of the address relative to the module base.
+ *
+ * The lookup is lock-free and can be used from any thread, including
+ * exception handlers. Returns NULL if no memory module contains the address.
+ * The caller must ensure the returned module is not freed while it uses it.
+ */
+HMEMORYMODULE MemoryModuleFromAddress(LPCVOID, DWORD *);
+
+/**
+ * Release the pages of a loaded module that only contain data required while
+ * loading: base relocations, import descriptors, the names of imported
+ * libraries and functions and the "OriginalFirstThunk" arrays. Only pages
+ * completely covered by such data are released, the import address table
+ * is kept. The RVAs of the applied relocations and the import address
+ * table ranges are kept in a compact list, MemoryHibernateModule uses them
+ * to recreate pages.
+ *
+ * Returns the number of bytes that have been released for the module. It's
+ * safe to call this multiple times, the pages are only released once.
+ */
+SIZE_T MemoryTrimModule(HMEMORYMODULE);
+
+/**
+ * Hibernate an idle module: pages that are unchanged from the original image
+ * or only contain zeros are dropped, all other pages are compressed. The
+ * pages are decommitted afterwards and restored on first access.
+ *
+ * "data" and "size" should point to the image the module was loaded from, the
+ * data must stay valid until the module has been woken up or freed. If "data"
+ * is NULL, all non-zero pages are compressed. If "released" is not NULL, it
+ * receives the number of bytes saved.
+ *
+ * Relocated pages are compared against the relocated image contents. Pages
+ * that contain an import address table always differ from the image and
+ * are compressed without comparing them.
+ *
+ * No thread may execute code of the module while it is being hibernated.
+ * Passing hibernated memory to system calls (e.g. ReadFile) fails instead
+ * of restoring the pages, call MemoryWakeModule before doing so.
+ * Not supported for modules backed by large pages.
+ */
+BOOL MemoryHibernateModule(HMEMORYMODULE, const void *, size_t, SIZE_T *);
+
+/**
+ * Restore all pages of a hibernated module. Does nothing if the module is
+ * not hibernated.
+ */
+BOOL MemoryWakeModule(HMEMORYMODULE);
+
+/**
+ * Bring pages of a module into memory, so first calls don't stall on page
+ * faults. If "numHotRanges" is 0, all code and read-only data is prefetched,
+ * otherwise only the given ranges (e.g. recorded in a previous run).
+ *
+ * Uses PrefetchVirtualMemory where available and reads every page otherwise.
+ * Pages of hibernated modules are restored.
+ */
+BOOL MemoryPrefetchModule(HMEMORYMODULE, const MEMORYRVARANGE *, DWORD);
+
+/**
+ * Get where a module has been placed: the MEMORY_PLACEMENT_* strategy that
+ * was used, the base address, the difference to the preferred image base
+ * and the number of base relocations that had to be applied.
+ */
+BOOL MemoryGetPlacementInfo(HMEMORYMODULE, MEMORYPLACEMENTINFO *);
+
+/**
+ * Get the time spent in each MEMORY_LOAD_PHASE_* while loading a module and
+ * the work done: bytes copied, relocations applied, imports resolved,
+ * VirtualProtect calls and pages decommitted. Pass NULL to get the totals of
+ * all modules loaded by the process.
+ *
+ * Only available if compiled with LOADSTATS defined, fails with
+ * ERROR_NOT_SUPPORTED otherwise.
+ */
+BOOL MemoryGetLoadStats(HMEMORYMODULE, MEMORYLOADSTATS *);
+
+/**
+ * Get the MEMORY_LOAD_* flags that are in effect for a module. Optional
+ * features that were requested but could not be used (e.g. large pages)
+ * are not included.
+ */
+DWORD MemoryGetLoadFlags(HMEMORYMODULE);
+
+/**
+ * Get the page protections that were applied to the sections of a module.
+ * Pages with equal protection are combined to ranges, only pages that are
+ * shared by multiple sections combine their access flags. Ranges that only
+ * contained discardable sections are marked as "decommitted".
+ *
+ * Copies at most "count" ranges and returns the total number of ranges.
+ */
+DWORD MemoryGetProtectionMap(HMEMORYMODULE, MEMORYPROTECTIONRANGE *, DWORD);
+
 /**
  * Find the location of a resource with the specified type and name.
  */
@@ -137,6 +638,91 @@ LPVOID MemoryDefaultAlloc(LPVOID, SIZE_T, DWORD, DWORD, void *);
 */
 BOOL MemoryDefaultFree(LPVOID, SIZE_T, DWORD, void *);
 
+/**
+ * Create a pool that places images in slots of large reserved regions of
+ * "regionSize" bytes (64 MB if 0). Pass MemoryPoolAlloc / MemoryPoolFree
+ * and the pool as "userdata" to MemoryLoadLibraryEx to use it.
+ *
+ * Slots of freed modules are decommitted and reused for later loads, the
+ * reserved regions are only released by MemoryDestroyPool.
+ */
+HMEMORYPOOL MemoryCreatePool(SIZE_T);
+
+/**
+ * Release all memory of a pool. Fails with ERROR_BUSY if modules using
+ * the pool have not been freed yet.
+ */
+BOOL MemoryDestroyPool(HMEMORYPOOL);
+
+/**
+ * Implementation of CustomAllocFunc that allocates from the pool passed as
+ * "userdata". Commits of pages that are committed already are skipped and
+ * ignore "protect": the pages keep their current protection, callers that
+ * need a different one must use VirtualProtect. Reservations at a fixed
+ * address fail unless the address is free inside the pool, so images are
+ * usually relocated. Large pages are forwarded to VirtualAlloc.
+ */
+LPVOID MemoryPoolAlloc(LPVOID, SIZE_T, DWORD, DWORD, void *);
+
+/**
+ * Implementation of CustomFreeFunc that returns memory to the pool passed
+ * as "userdata". A MEM_DECOMMIT with size 0 decommits up to the end of the
+ * slot containing the address, larger sizes must not cross the end of the
+ * slot.
+ */
+BOOL MemoryPoolFree(LPVOID, SIZE_T, DWORD, void *);
+
+/**
+ * Get usage statistics of a pool. "numFreeBlocks" and "largestFreeBlock"
+ * describe the fragmentation of the reserved regions, "syscalls" counts the
+ * VirtualAlloc / VirtualFree calls made by the pool and "syscallsAvoided" the
+ * calls that were served from the pool instead.
+ */
+void MemoryGetPoolStats(HMEMORYPOOL, MEMORYPOOLSTATS *);
+
+/**
+ * Install a callback that receives all loader events, pass NULL to remove
+ * it. Only a pointer comparison is done if no callback is installed.
+ *
+ * The callback can be invoked from multiple threads at once and must not
+ * call MemoryModule functions. It always receives the userdata that was
+ * installed with it, a removed callback may still be running in other
+ * threads. Fails with ERROR_OUTOFMEMORY if the sink can't be allocated,
+ * the previous callback stays installed then.
+ */
+BOOL MemorySetEventCallback(MemoryEventCallback, void *);
+
+/**
+ * Create a ring buffer that stores up to "capacity" events, the oldest
+ * events are overwritten when it is full. Install it by passing
+ * MemoryEventRingCallback and the ring to MemorySetEventCallback.
+ */
+HMEMORYEVENTRING MemoryCreateEventRing(DWORD);
+
+/**
+ * Release a ring buffer, it must not be installed as event callback.
+ */
+void MemoryDestroyEventRing(HMEMORYEVENTRING);
+
+/**
+ * Event callback that appends events to the ring passed as "userdata".
+ */
+void MemoryEventRingCallback(const MEMORYEVENT *, void *);
+
+/**
+ * Remove up to "count" of the oldest events from a ring and return the number
+ * of events copied. If "dropped" is not NULL, it receives the number of events
+ * that were overwritten since the last call.
+ */
+DWORD MemoryReadEventRing(HMEMORYEVENTRING, MEMORYEVENTRECORD *, DWORD, DWORD *);
+
+/**
+ * Remove all events from a ring and write them to a file in the Chrome trace
+ * event format (JSON), which can be opened with chrome://tracing or Perfetto.
+ * Loads are written as duration events, all other events as instant events.
+ */
+BOOL MemoryWriteEventTrace(HMEMORYEVENTRING, HANDLE);
+
 /**
  * Default implementation of CustomLoadLibraryFunc that calls LoadLibraryA
  * internally to load an additional libary.
@@ -0,0 +1,346 @@
+/*
+ * Memory DLL loading code
+ * Version 0.0.4
+ *
+ * Copyright (c) 2004-2015 by Joachim Bauch / mail@joachim-bauch.de
+ * http://www.joachim-bauch.de
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 2.0 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is MemoryModule.hpp
+ *
+ * The Initial Developer of the Original Code is Joachim Bauch.
+ *
+ * Portions created by Joachim Bauch are Copyright (C) 2004-2015
+ * Joachim Bauch. All Rights Reserved.
+ *
+ */
+
+#ifndef __MEMORY_MODULE_HPP_HEADER
+#define __MEMORY_MODULE_HPP_HEADER
+
+#if defined(_MSC_VER) ? (_MSC_VER < 1900) : (__cplusplus < 201103L)
+#error MemoryModule.hpp requires C++11
+#endif
+
+#include <stddef.h>
+#include <type_traits>
+
+#include "MemoryModule.h"
+
+/**
+ * Header-only C++ wrappers for the MemoryModule API.
+ *
+ * The handle classes own the underlying C handle and release it when they
+ * are destroyed. They can be moved but not copied. Like the C API they
+ * don't throw: failed operations return an empty object or NULL, the error
+ * is available through GetLastError.
+ */
+namespace MemoryModule {
+
+/**
+ * Hash of an export name, same as MemoryHashSymbolName but can be computed
+ * at compile time.
+ */
+constexpr DWORD HashSymbol(const char *name, DWORD hash = 2166136261u) {
+    return *name ? HashSymbol(name + 1, static_cast<DWORD>((hash ^ static_cast<unsigned char>(*name)) * 16777619u)) : hash;
+}
+
+/**
+ * Cached binding of an export with signature "Sig", see MemoryBindProc.
+ * Meant to be a static variable at a call site, see MEMORYMODULE_PROC.
+ */
+template <typename Sig>
+class ProcSlot {
+public:
+    constexpr ProcSlot() : slot_() {}
+
+    ProcSlot(const ProcSlot &) = delete;
+    ProcSlot &operator=(const ProcSlot &) = delete;
+
+    Sig *get(HMEMORYMODULE module, DWORD hash, LPCSTR name) {
+        FARPROC proc;
+        if (slot_.module == module && module != NULL) {
+            proc = slot_.proc;
+        } else {
+            proc = MemoryBindProc(module, &slot_, hash, name);
+        }
+        return reinterpret_cast<Sig *>(reinterpret_cast<LPVOID>(proc));
+    }
+
+private:
+    MEMORYPROCSLOT slot_;
+};
+
+/**
+ * Move-only owner of a C handle. "Traits::Release" frees a handle that is
+ * not NULL.
+ */
+template <typename Traits>
+class UniqueHandle {
+public:
+    typedef typename Traits::Handle Handle;
+
+    UniqueHandle() noexcept : handle_(NULL) {}
+    explicit UniqueHandle(Handle handle) noexcept : handle_(handle) {}
+    UniqueHandle(UniqueHandle &&other) noexcept : handle_(other.release()) {}
+    ~UniqueHandle() { reset(); }
+
+    UniqueHandle &operator=(UniqueHandle &&other) noexcept {
+        if (this != &other) {
+            reset(other.release());
+        }
+        return *this;
+    }
+
+    UniqueHandle(const UniqueHandle &) = delete;
+    UniqueHandle &operator=(const UniqueHandle &) = delete;
+
+    Handle native_handle() const noexcept { return handle_; }
+    explicit operator bool() const noexcept { return handle_ != NULL; }
+
+    /**
+     * Give up ownership of the handle without releasing it.
+     */
+    Handle release() noexcept {
+        Handle handle = handle_;
+        handle_ = NULL;
+        return handle;
+    }
+
+    void reset(Handle handle = NULL) noexcept {
+        Handle old = handle_;
+        handle_ = handle;
+        if (old != NULL) {
+            Traits::Release(old);
+        }
+    }
+
+protected:
+    Handle handle_;
+};
+
+struct ImageTraits {
+    typedef HMEMORYIMAGE Handle;
+    static void Release(Handle handle) { MemoryFreeImage(handle); }
+};
+
+struct PoolTraits {
+    typedef HMEMORYPOOL Handle;
+    static void Release(Handle handle) { MemoryDestroyPool(handle); }
+};
+
+struct EventRingTraits {
+    typedef HMEMORYEVENTRING Handle;
+    static void Release(Handle handle) { MemoryDestroyEventRing(handle); }
+};
+
+struct ModuleTraits {
+    typedef HMEMORYMODULE Handle;
+    static void Release(Handle handle) { MemoryFreeLibrary(handle); }
+};
+
+/**
+ * Parsed image, see MemoryParseImage.
+ */
+class Image : public UniqueHandle<ImageTraits> {
+public:
+    Image() noexcept {}
+    explicit Image(HMEMORYIMAGE handle) noexcept : UniqueHandle<ImageTraits>(handle) {}
+
+    static Image parse(const void *data, size_t size) {
+        return Image(MemoryParseImage(data, size));
+    }
+};
+
+/**
+ * Address space pool, see MemoryCreatePool. Must outlive the modules that
+ * were loaded from it.
+ */
+class Pool : public UniqueHandle<PoolTraits> {
+public:
+    Pool() noexcept {}
+    explicit Pool(HMEMORYPOOL handle) noexcept : UniqueHandle<PoolTraits>(handle) {}
+
+    static Pool create(SIZE_T reserveSize = 0) {
+        return Pool(MemoryCreatePool(reserveSize));
+    }
+};
+
+/**
+ * Event ring, see MemoryCreateEventRing.
+ */
+class EventRing : public UniqueHandle<EventRingTraits> {
+public:
+    EventRing() noexcept {}
+    explicit EventRing(HMEMORYEVENTRING handle) noexcept : UniqueHandle<EventRingTraits>(handle) {}
+
+    static EventRing create(DWORD capacity) {
+        return EventRing(MemoryCreateEventRing(capacity));
+    }
+
+    DWORD read(MEMORYEVENTRECORD *records, DWORD count, DWORD *dropped = NULL) const {
+        return MemoryReadEventRing(handle_, records, count, dropped);
+    }
+};
+
+/**
+ * View of the data of a resource. It points into the image of the module
+ * and is only valid as long as the module is loaded.
+ */
+class ResourceView {
+public:
+    ResourceView() noexcept : data_(NULL), size_(0) {}
+    ResourceView(const void *data, size_t size) noexcept
+        : data_(static_cast<const unsigned char *>(data)), size_(data != NULL ? size : 0) {}
+
+    const unsigned char *data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+    explicit operator bool() const noexcept { return data_ != NULL; }
+
+    const unsigned char *begin() const noexcept { return data_; }
+    const unsigned char *end() const noexcept { return data_ + size_; }
+    unsigned char operator[](size_t idx) const noexcept { return data_[idx]; }
+
+    /**
+     * Interpret the start of the data as "T", NULL if the resource is too
+     * small.
+     */
+    template <typename T>
+    const T *as() const noexcept {
+        return size_ >= sizeof(T) ? reinterpret_cast<const T *>(data_) : NULL;
+    }
+
+private:
+    const unsigned char *data_;
+    size_t size_;
+};
+
+/**
+ * Module loaded from memory, freed with MemoryFreeLibrary.
+ */
+class Module : public UniqueHandle<ModuleTraits> {
+public:
+    Module() noexcept {}
+    explicit Module(HMEMORYMODULE handle) noexcept : UniqueHandle<ModuleTraits>(handle) {}
+
+    static Module load(const void *data, size_t size) {
+        return Module(MemoryLoadLibrary(data, size));
+    }
+
+    static Module load(const void *data, size_t size,
+        const MEMORYLOADOPTIONS *options,
+        CustomAllocFunc allocMemory = MemoryDefaultAlloc,
+        CustomFreeFunc freeMemory = MemoryDefaultFree,
+        CustomLoadLibraryFunc loadLibrary = MemoryDefaultLoadLibrary,
+        CustomGetProcAddressFunc getProcAddress = MemoryDefaultGetProcAddress,
+        CustomFreeLibraryFunc freeLibrary = MemoryDefaultFreeLibrary,
+        void *userdata = NULL) {
+        return Module(MemoryLoadLibraryEx2(data, size, options,
+            allocMemory, freeMemory, loadLibrary, getProcAddress, freeLibrary, userdata));
+    }
+
+    static Module load(const Image &image,
+        const MEMORYLOADOPTIONS *options = NULL,
+        CustomAllocFunc allocMemory = MemoryDefaultAlloc,
+        CustomFreeFunc freeMemory = MemoryDefaultFree,
+        CustomLoadLibraryFunc loadLibrary = MemoryDefaultLoadLibrary,
+        CustomGetProcAddressFunc getProcAddress = MemoryDefaultGetProcAddress,
+        CustomFreeLibraryFunc freeLibrary = MemoryDefaultFreeLibrary,
+        void *userdata = NULL) {
+        return Module(MemoryLoadFromImage(image.native_handle(), options,
+            allocMemory, freeMemory, loadLibrary, getProcAddress, freeLibrary, userdata));
+    }
+
+    /**
+     * Load the image into the address space reserved by "pool".
+     */
+    static Module load(const void *data, size_t size, const Pool &pool) {
+        return Module(MemoryLoadLibraryEx(data, size,
+            MemoryPoolAlloc, MemoryPoolFree, MemoryDefaultLoadLibrary,
+            MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, pool.native_handle()));
+    }
+
+    FARPROC proc(LPCSTR name) const {
+        return MemoryGetProcAddress(handle_, name);
+    }
+
+    FARPROC proc(WORD ordinal) const {
+        return MemoryGetProcAddress(handle_, MAKEINTRESOURCEA(ordinal));
+    }
+
+    /**
+     * Look up an exported function with the signature "Sig", e.g.
+     * "module.get<int(int, int)>("addNumbers")".
+     */
+    template <typename Sig>
+    Sig *get(LPCSTR name) const {
+        return reinterpret_cast<Sig *>(reinterpret_cast<LPVOID>(proc(name)));
+    }
+
+    template <typename Sig>
+    Sig *get(WORD ordinal) const {
+        return reinterpret_cast<Sig *>(reinterpret_cast<LPVOID>(proc(ordinal)));
+    }
+
+    ResourceView resource(LPCTSTR name, LPCTSTR type) const {
+        return view(MemoryFindResource(handle_, name, type));
+    }
+
+    ResourceView resource(LPCTSTR name, LPCTSTR type, WORD language) const {
+        return view(MemoryFindResourceEx(handle_, name, type, language));
+    }
+
+    template <int N>
+    int loadString(UINT id, TCHAR (&buffer)[N]) const {
+        return MemoryLoadString(handle_, id, buffer, N);
+    }
+
+    template <int N>
+    int loadString(UINT id, TCHAR (&buffer)[N], WORD language) const {
+        return MemoryLoadStringEx(handle_, id, buffer, N, language);
+    }
+
+    /**
+     * Load a new version of a module loaded with MEMORY_LOAD_TRAMPOLINES,
+     * see MemoryReloadModule. This object keeps the old module, reset it
+     * once no calls are running in it anymore.
+     */
+    Module reload(const void *data, size_t size) const {
+        return Module(MemoryReloadModule(handle_, data, size));
+    }
+
+private:
+    ResourceView view(HMEMORYRSRC resource) const {
+        if (resource == NULL) {
+            return ResourceView();
+        }
+        return ResourceView(MemoryLoadResource(handle_, resource), MemorySizeofResource(handle_, resource));
+    }
+};
+
+}  // namespace MemoryModule
+
+/**
+ * Look up the export "name" (a string literal) with signature "..." in
+ * "module" (a HMEMORYMODULE). The hash of the name is computed at compile
+ * time and the result is cached at the call site until the module is freed,
+ * e.g. "MEMORYMODULE_PROC(handle, "addNumbers", int(int, int))(1, 2)".
+ */
+#define MEMORYMODULE_PROC(module, name, ...) \
+    ([](HMEMORYMODULE memoryModule) -> std::add_pointer<__VA_ARGS__>::type { \
+        static MemoryModule::ProcSlot<__VA_ARGS__> slot; \
+        return slot.get(memoryModule, \
+            std::integral_constant<DWORD, MemoryModule::HashSymbol(name)>::value, name); \
+    }(module))
+
+#endif  // __MEMORY_MODULE_HPP_HEADER
@@ -0,0 +1,193 @@
+#define WIN32_LEAN_AND_MEAN
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <windows.h>
+#include <tchar.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../MemoryModule.h"
+#include "ReadLibrary.h"
+
+#define DEFAULT_ITERATIONS 200
+
+static LARGE_INTEGER frequency;
+
+static double ElapsedMicroseconds(const LARGE_INTEGER *start)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double) (now.QuadPart - start->QuadPart) * 1000000.0 / (double) frequency.QuadPart;
+}
+
+static int _compareSamples(const void *a, const void *b)
+{
+    double d1 = *(const double *) a;
+    double d2 = *(const double *) b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+static double Percentile(const double *sorted, int count, int percent)
+{
+    int idx = (count * percent + 99) / 100 - 1;
+    if (idx < 0) {
+        idx = 0;
+    }
+    return sorted[idx];
+}
+
+// Print one line per benchmark, see the header printed in main.
+static void Report(const char *benchmark, const char *filename, BOOL relocated, double *samples, int count)
+{
+    double sum = 0;
+    int i;
+
+    qsort(samples, count, sizeof(double), _compareSamples);
+    for (i=0; i<count; i++) {
+        sum += samples[i];
+    }
+    printf("%s,%s,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+        benchmark, filename, relocated ? 1 : 0, count,
+        sum / count,
+        Percentile(samples, count, 50),
+        Percentile(samples, count, 90),
+        Percentile(samples, count, 99),
+        samples[count - 1]);
+}
+
+static BOOL BenchmarkLibrary(const char *filename, int iterations)
+{
+    void *data;
+    size_t size;
+    double *samples;
+    HMEMORYMODULE handle = NULL;
+    MEMORYPLACEMENTINFO placement;
+    LARGE_INTEGER start;
+    TCHAR buffer[100];
+    BOOL relocated;
+    BOOL result = FALSE;
+    int i;
+
+    data = ReadLibrary(filename, &size);
+    if (data == NULL) {
+        return FALSE;
+    }
+
+    samples = (double *) malloc(iterations * sizeof(double));
+    if (samples == NULL) {
+        free(data);
+        return FALSE;
+    }
+
+    // check once where the library is placed, test-relocate.dll uses the
+    // image base of this executable
+    handle = MemoryLoadLibrary(data, size);
+    if (handle == NULL || !MemoryGetPlacementInfo(handle, &placement)) {
+        fprintf(stderr, "Can't load library from memory.\n");
+        goto exit;
+    }
+    relocated = placement.delta != 0;
+    MemoryFreeLibrary(handle);
+    handle = NULL;
+
+    // a failed load would only measure the error path
+    for (i=0; i<iterations; i++) {
+        QueryPerformanceCounter(&start);
+        handle = MemoryLoadLibrary(data, size);
+        if (handle == NULL) {
+            fprintf(stderr, "Can't load library from memory in iteration %d.\n", i);
+            goto exit;
+        }
+        MemoryFreeLibrary(handle);
+        samples[i] = ElapsedMicroseconds(&start);
+    }
+    handle = NULL;
+    Report("load_free", filename, relocated, samples, iterations);
+
+    // first lookup builds the sorted export name table
+    for (i=0; i<iterations; i++) {
+        handle = MemoryLoadLibrary(data, size);
+        if (handle == NULL) {
+            fprintf(stderr, "Can't load library from memory in iteration %d.\n", i);
+            goto exit;
+        }
+        QueryPerformanceCounter(&start);
+        MemoryGetProcAddress(handle, "addNumbers");
+        samples[i] = ElapsedMicroseconds(&start);
+        MemoryFreeLibrary(handle);
+    }
+    handle = NULL;
+    Report("getproc_first", filename, relocated, samples, iterations);
+
+    handle = MemoryLoadLibrary(data, size);
+    if (handle == NULL) {
+        fprintf(stderr, "Can't load library from memory.\n");
+        goto exit;
+    }
+    if (MemoryGetProcAddress(handle, "addNumbers") == NULL) {
+        fprintf(stderr, "Can't find \"addNumbers\" in %s.\n", filename);
+        goto exit;
+    }
+    for (i=0; i<iterations; i++) {
+        QueryPerformanceCounter(&start);
+        MemoryGetProcAddress(handle, "addNumbers");
+        samples[i] = ElapsedMicroseconds(&start);
+    }
+    Report("getproc_steady", filename, relocated, samples, iterations);
+
+    // named entry that exists in SampleDLL and all generated corpus DLLs
+    if (MemoryFindResource(handle, _T("STRINGRES"), RT_RCDATA) == NULL) {
+        fprintf(stderr, "Can't find resource \"STRINGRES\" in %s.\n", filename);
+        goto exit;
+    }
+    for (i=0; i<iterations; i++) {
+        QueryPerformanceCounter(&start);
+        MemoryFindResource(handle, _T("STRINGRES"), RT_RCDATA);
+        samples[i] = ElapsedMicroseconds(&start);
+    }
+    Report("findresource", filename, relocated, samples, iterations);
+
+    for (i=0; i<iterations; i++) {
+        QueryPerformanceCounter(&start);
+        MemoryLoadString(handle, 1, buffer, sizeof(buffer) / sizeof(buffer[0]));
+        samples[i] = ElapsedMicroseconds(&start);
+    }
+    Report("loadstring", filename, relocated, samples, iterations);
+    result = TRUE;
+
+exit:
+    MemoryFreeLibrary(handle);
+    free(samples);
+    free(data);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    int iterations = DEFAULT_ITERATIONS;
+    int first = 1;
+    int i;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+    if (argc <= first || iterations <= 0) {
+        fprintf(stderr, "USAGE: %s [-n iterations] <filename.dll> [<filename.dll> ...]\n", argv[0]);
+        return 1;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    // all times are in microseconds
+    printf("benchmark,dll,relocated,iterations,mean_us,p50_us,p90_us,p99_us,max_us\n");
+    for (i=first; i<argc; i++) {
+        if (!BenchmarkLibrary(argv[i], iterations)) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
@@ -5,11 +5,14 @@
 
 #include <assert.h>
 #include <windows.h>
+#include <imagehlp.h>
 #include <tchar.h>
 #include <stdio.h>
 #include <malloc.h>
+#include <utility>
 
-#include "../MemoryModule.h"
+#include "../MemoryModule.hpp"
+#include "ReadLibrary.h"
 
 typedef int (*addProc)(int);
 typedef int (*addNumberProc)(int, int);
@@ -75,6 +78,816 @@ BOOL CheckResourceStrings(LPVOID data, DWORD size, const char *first, const wcha
     return TRUE;
 }
 
+void PrintLoadStats(HMEMORYMODULE handle)
+{
+    static const TCHAR *phases[MEMORY_LOAD_PHASE_COUNT] = {
+        _T("headers"), _T("copy"), _T("relocate"), _T("imports"),
+        _T("exceptions"), _T("finalize"), _T("tls"), _T("entrypoint")
+    };
+    MEMORYLOADSTATS stats;
+    int i;
+
+    if (!MemoryGetLoadStats(handle, &stats)) {
+        // not compiled with LOADSTATS
+        return;
+    }
+
+    for (i=0; i<MEMORY_LOAD_PHASE_COUNT; i++) {
+        _tprintf(_T("Phase %s: %.1f us\n"), phases[i], stats.phaseTicks[i] * 1000000.0 / stats.frequency);
+    }
+    _tprintf(_T("Copied %lu bytes, %lu relocations, %lu imports, %lu protect calls, %lu pages decommitted\n"),
+        (unsigned long) stats.bytesCopied, (unsigned long) stats.relocations,
+        (unsigned long) stats.importsResolved, (unsigned long) stats.protectCalls,
+        (unsigned long) stats.pagesDecommitted);
+}
+
+// Load with the default callbacks, the size of "options" is filled in.
+HMEMORYMODULE LoadWithOptions(const void *data, size_t size, MEMORYLOADOPTIONS *options)
+{
+    options->cbSize = sizeof(*options);
+    return MemoryLoadLibraryEx2(data, size, options,
+        MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+        MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL);
+}
+
+BOOL CheckAddNumbers(HMEMORYMODULE handle, const TCHAR *description)
+{
+    addNumberProc addNumber = (addNumberProc)MemoryGetProcAddress(handle, "addNumbers");
+    if (!addNumber || addNumber(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed for %s\n"), description);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL LoadWithFlags(const void *data, size_t size, DWORD flags)
+{
+    MEMORYLOADOPTIONS options;
+    HMEMORYMODULE handle;
+    addNumberProc addNumber;
+    BOOL result = TRUE;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = flags;
+    handle = MemoryLoadLibraryEx2(data, size, &options,
+        MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+        MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL);
+    if (handle != NULL || GetLastError() != ERROR_INVALID_PARAMETER) {
+        _tprintf(_T("Options without size should be rejected.\n"));
+        MemoryFreeLibrary(handle);
+        return FALSE;
+    }
+
+    handle = LoadWithOptions(data, size, &options);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library with flags 0x%lx.\n"), flags);
+        return FALSE;
+    }
+
+    // The test DLLs are smaller than a large page, so this always
+    // exercises the fallback to normal pages.
+    if (MemoryGetLoadFlags(handle) & MEMORY_LOAD_LARGE_PAGES) {
+        _tprintf(_T("Small library reported to be loaded with large pages.\n"));
+        result = FALSE;
+    }
+
+    if (flags & MEMORY_LOAD_TRIM) {
+        SIZE_T trimmed = MemoryTrimModule(handle);
+        _tprintf(_T("Trimmed %lu bytes\n"), (unsigned long) trimmed);
+        if (MemoryTrimModule(handle) != trimmed) {
+            _tprintf(_T("MemoryTrimModule is not idempotent.\n"));
+            result = FALSE;
+        }
+    }
+
+    if ((flags & MEMORY_LOAD_PREFETCH) && !MemoryPrefetchModule(handle, NULL, 0)) {
+        _tprintf(_T("MemoryPrefetchModule failed: %lu\n"), GetLastError());
+        result = FALSE;
+    }
+
+    addNumber = (addNumberProc)MemoryGetProcAddress(handle, "addNumbers");
+    if (!addNumber || addNumber(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed after loading with flags 0x%lx.\n"), flags);
+        result = FALSE;
+    }
+
+    MemoryFreeLibrary(handle);
+    return result;
+}
+
+BOOL LoadNearby(const void *data, size_t size)
+{
+    MEMORYLOADOPTIONS options;
+    MEMORYPLACEMENTINFO info;
+    HMEMORYMODULE handle;
+    BOOL result = TRUE;
+
+    // the preferred base is usually taken by the module loaded before
+    memset(&options, 0, sizeof(options));
+    options.flags = MEMORY_LOAD_PLACE_NEARBY;
+    handle = LoadWithOptions(data, size, &options);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library nearby\n"));
+        return FALSE;
+    }
+
+    if (!MemoryGetPlacementInfo(handle, &info)) {
+        _tprintf(_T("MemoryGetPlacementInfo failed\n"));
+        result = FALSE;
+    } else {
+        _tprintf(_T("Placed at %p (strategy %lu), delta %ld, %lu relocations\n"),
+            info.base, info.placement, (long) info.delta, info.relocations);
+        if (info.placement != MEMORY_PLACEMENT_PREFERRED && info.placement != MEMORY_PLACEMENT_NEARBY) {
+            _tprintf(_T("Library was not placed nearby\n"));
+            result = FALSE;
+        }
+#ifdef _WIN64
+        LONG_PTR distance = (LONG_PTR) info.base - (LONG_PTR) GetModuleHandle(NULL);
+        if (distance > 0x7fff0000 || distance < -0x7fff0000) {
+            _tprintf(_T("Library is out of rel32 range of the executable\n"));
+            result = FALSE;
+        }
+#endif
+    }
+
+    MemoryFreeLibrary(handle);
+    return result;
+}
+
+BOOL LoadWithPool(const void *data, size_t size)
+{
+    HMEMORYPOOL pool;
+    HMEMORYMODULE handles[2];
+    MEMORYPOOLSTATS stats;
+    addNumberProc addNumber;
+    unsigned char *slot;
+    BOOL result = TRUE;
+    int i;
+
+    pool = MemoryCreatePool(0);
+    if (pool == NULL) {
+        _tprintf(_T("Can't create pool\n"));
+        return FALSE;
+    }
+
+    // load twice so the second image reuses the reserved region
+    for (i=0; i<2; i++) {
+        handles[i] = MemoryLoadLibraryEx(data, size,
+            MemoryPoolAlloc, MemoryPoolFree, MemoryDefaultLoadLibrary,
+            MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, pool);
+        if (handles[i] == NULL) {
+            _tprintf(_T("Can't load library from pool\n"));
+            result = FALSE;
+            continue;
+        }
+
+        addNumber = (addNumberProc)MemoryGetProcAddress(handles[i], "addNumbers");
+        if (!addNumber || addNumber(1, 2) != 3) {
+            _tprintf(_T("addNumbers failed for library from pool\n"));
+            result = FALSE;
+        }
+    }
+
+    MemoryGetPoolStats(pool, &stats);
+    _tprintf(_T("Pool: %lu regions, %lu slots, %lu free blocks, %lu syscalls, %lu avoided\n"),
+        stats.numRegions, stats.numSlots, stats.numFreeBlocks,
+        (unsigned long) stats.syscalls, (unsigned long) stats.syscallsAvoided);
+    if (result && (stats.numRegions != 1 || stats.numSlots != 2 || stats.syscallsAvoided == 0)) {
+        _tprintf(_T("Unexpected pool statistics\n"));
+        result = FALSE;
+    }
+
+    for (i=0; i<2; i++) {
+        if (handles[i] != NULL) {
+            MemoryFreeLibrary(handles[i]);
+        }
+    }
+
+    MemoryGetPoolStats(pool, &stats);
+    if (stats.numSlots != 0 || stats.numFreeBlocks != stats.numRegions) {
+        _tprintf(_T("Pool slots were not recycled\n"));
+        result = FALSE;
+    }
+
+    // a decommit without size stops at the end of the slot
+    slot = (unsigned char *) MemoryPoolAlloc(NULL, 0x10000, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, pool);
+    if (slot == NULL) {
+        _tprintf(_T("Can't allocate from pool: %lu\n"), GetLastError());
+        result = FALSE;
+    } else {
+        if (!MemoryPoolFree(slot + 0x1000, 0, MEM_DECOMMIT, pool)) {
+            _tprintf(_T("Can't decommit rest of pool slot: %lu\n"), GetLastError());
+            result = FALSE;
+        }
+        MemoryGetPoolStats(pool, &stats);
+        if (stats.committedBytes != 0x1000) {
+            _tprintf(_T("Unexpected committed size after decommit: %lu\n"), (unsigned long) stats.committedBytes);
+            result = FALSE;
+        }
+        if (MemoryPoolFree(slot + 0x1000, 0x10000, MEM_DECOMMIT, pool)) {
+            _tprintf(_T("Decommit past the end of a pool slot should fail\n"));
+            result = FALSE;
+        }
+        MemoryPoolFree(slot, 0, MEM_RELEASE, pool);
+    }
+    if (!MemoryDestroyPool(pool)) {
+        _tprintf(_T("Can't destroy pool: %lu\n"), GetLastError());
+        result = FALSE;
+    }
+    return result;
+}
+
+BOOL LoadFromImage(const void *data, size_t size)
+{
+    HMEMORYIMAGE image;
+    HMEMORYMODULE handles[2];
+    addNumberProc addNumber;
+    TCHAR buffer[100];
+    BOOL result = TRUE;
+    int i;
+
+    image = MemoryParseImage(data, size);
+    if (image == NULL) {
+        _tprintf(_T("Can't parse image: %lu\n"), GetLastError());
+        return FALSE;
+    }
+
+    // the second module is relocated, both share the parsed image
+    for (i=0; i<2; i++) {
+        handles[i] = MemoryLoadFromImage(image, NULL,
+            MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+            MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL);
+        if (handles[i] == NULL) {
+            _tprintf(_T("Can't load library from image\n"));
+            result = FALSE;
+        }
+    }
+
+    // modules keep the image alive
+    MemoryFreeImage(image);
+
+    for (i=0; i<2; i++) {
+        if (handles[i] == NULL) {
+            continue;
+        }
+
+        addNumber = (addNumberProc)MemoryGetProcAddress(handles[i], "addNumbers");
+        if (!addNumber || addNumber(1, 2) != 3) {
+            _tprintf(_T("addNumbers failed for library from image\n"));
+            result = FALSE;
+        }
+        if (MemoryLoadString(handles[i], 1, buffer, sizeof(buffer) / sizeof(buffer[0])) == 0) {
+            _tprintf(_T("MemoryLoadString failed for library from image\n"));
+            result = FALSE;
+        }
+        MemoryFreeLibrary(handles[i]);
+    }
+    return result;
+}
+
+BOOL LoadShared(const void *data, size_t size)
+{
+    MEMORYLOADOPTIONS options;
+    HMEMORYMODULE handles[2];
+    BOOL result = TRUE;
+    int i;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = MEMORY_LOAD_SHARED;
+    for (i=0; i<2; i++) {
+        handles[i] = LoadWithOptions(data, size, &options);
+        if (handles[i] == NULL) {
+            _tprintf(_T("Can't load shared library: %lu\n"), GetLastError());
+            result = FALSE;
+        }
+    }
+    if (result && handles[0] != handles[1]) {
+        _tprintf(_T("Identical image was loaded twice\n"));
+        result = FALSE;
+    }
+
+    // the module must survive until the last reference is gone
+    MemoryFreeLibrary(handles[0]);
+    if (result && !CheckAddNumbers(handles[1], _T("shared library"))) {
+        result = FALSE;
+    }
+    MemoryFreeLibrary(handles[1]);
+    return result;
+}
+
+// Returns the function a trampoline currently jumps to, the stub loads the
+// target table and jumps through the entry of its slot.
+static FARPROC TrampolineTarget(FARPROC proc)
+{
+    const unsigned char *stub = (const unsigned char *) (LPVOID) proc;
+    FARPROC * volatile *table;
+    DWORD disp;
+#ifdef _WIN64
+    LONG offset;
+    memcpy(&offset, stub + 3, sizeof(offset));
+    table = (FARPROC * volatile *) (stub + 7 + offset);
+    memcpy(&disp, stub + 9, sizeof(disp));
+#else
+    memcpy(&table, stub + 1, sizeof(table));
+    memcpy(&disp, stub + 7, sizeof(disp));
+#endif
+    return (*table)[disp / sizeof(FARPROC)];
+}
+
+// Read another test library from the directory of "filename".
+static void *ReadOtherLibrary(const char *filename, size_t *size)
+{
+    const char *other = strstr(filename, "test-relocate") ? "test-align-4096.dll" : "test-relocate.dll";
+    const char *base = filename;
+    const char *pos;
+    char path[MAX_PATH];
+
+    for (pos = filename; *pos; pos++) {
+        if (*pos == '\\' || *pos == '/') {
+            base = pos + 1;
+        }
+    }
+    if ((size_t) (base - filename) + strlen(other) >= sizeof(path)) {
+        return NULL;
+    }
+    memcpy(path, filename, base - filename);
+    strcpy(path + (base - filename), other);
+    return ReadLibrary(path, size);
+}
+
+BOOL ReloadWithTrampolines(const void *data, size_t size, const char *filename)
+{
+    MEMORYLOADOPTIONS options;
+    HMEMORYMODULE handle, reloaded;
+    addNumberProc addNumber;
+    void *otherData;
+    size_t otherSize;
+    BOOL result = TRUE;
+
+    otherData = ReadOtherLibrary(filename, &otherSize);
+    if (otherData == NULL) {
+        _tprintf(_T("Can't read library to reload\n"));
+        return FALSE;
+    }
+
+    memset(&options, 0, sizeof(options));
+    options.flags = MEMORY_LOAD_TRAMPOLINES;
+    handle = LoadWithOptions(data, size, &options);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library with trampolines: %lu\n"), GetLastError());
+        free(otherData);
+        return FALSE;
+    }
+
+    addNumber = (addNumberProc)MemoryGetProcAddress(handle, "addNumbers");
+    if (!addNumber || addNumber(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed through trampoline\n"));
+        MemoryFreeLibrary(handle);
+        free(otherData);
+        return FALSE;
+    }
+    if (MemoryModuleFromAddress((LPCVOID) addNumber, NULL) != NULL) {
+        _tprintf(_T("Function was returned without trampoline\n"));
+        result = FALSE;
+    }
+    if (MemoryModuleFromAddress((LPCVOID) TrampolineTarget((FARPROC) addNumber), NULL) != handle) {
+        _tprintf(_T("Trampoline doesn't point into the loaded module\n"));
+        result = FALSE;
+    }
+
+    // a different image, placed at another address
+    reloaded = MemoryReloadModule(handle, otherData, otherSize);
+    free(otherData);
+    if (reloaded == NULL) {
+        _tprintf(_T("Can't reload library: %lu\n"), GetLastError());
+        MemoryFreeLibrary(handle);
+        return FALSE;
+    }
+    if (MemoryModuleFromAddress((LPCVOID) TrampolineTarget((FARPROC) addNumber), NULL) != reloaded) {
+        _tprintf(_T("Trampoline doesn't point into the reloaded module\n"));
+        result = FALSE;
+    }
+
+    // the cached pointer must survive the old module
+    MemoryFreeLibrary(handle);
+    if (addNumber(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed after reload\n"));
+        result = FALSE;
+    }
+    if ((addNumberProc)MemoryGetProcAddress(reloaded, "addNumbers") != addNumber) {
+        _tprintf(_T("Trampoline changed after reload\n"));
+        result = FALSE;
+    }
+    MemoryFreeLibrary(reloaded);
+    return result;
+}
+
+BOOL LoadWithWrapper(const void *data, size_t size)
+{
+    MemoryModule::Module module = MemoryModule::Module::load(data, size);
+    if (!module) {
+        _tprintf(_T("Can't load library with wrapper: %lu\n"), GetLastError());
+        return FALSE;
+    }
+
+    // ownership moves, the module is freed exactly once
+    MemoryModule::Module owner(std::move(module));
+    if (module || !owner) {
+        _tprintf(_T("Module handle was not moved\n"));
+        return FALSE;
+    }
+
+    int (*add)(int, int) = owner.get<int(int, int)>("addNumbers");
+    if (!add || add(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed through wrapper\n"));
+        return FALSE;
+    }
+
+    MemoryModule::ResourceView version = owner.resource(MAKEINTRESOURCE(VS_VERSION_INFO), RT_VERSION);
+    if (version.empty() || version.data() != MemoryLoadResource(owner.native_handle(),
+            MemoryFindResource(owner.native_handle(), MAKEINTRESOURCE(VS_VERSION_INFO), RT_VERSION))) {
+        _tprintf(_T("Resource view doesn't point to the resource data\n"));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int AddHashed(HMEMORYMODULE handle, int a, int b)
+{
+    int (*add)(int, int) = MEMORYMODULE_PROC(handle, "addNumbers", int(int, int));
+    return add != NULL ? add(a, b) : -1;
+}
+
+BOOL LookupHashed(const void *data, size_t size)
+{
+    MEMORYPROCSLOT slot;
+    HMEMORYMODULE handle;
+    FARPROC proc;
+    BOOL result = TRUE;
+    int i;
+
+    if (MemoryModule::HashSymbol("addNumbers") != MemoryHashSymbolName("addNumbers")) {
+        _tprintf(_T("Compile time hash doesn't match MemoryHashSymbolName\n"));
+        return FALSE;
+    }
+
+    handle = MemoryLoadLibrary(data, size);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library for hashed lookups: %lu\n"), GetLastError());
+        return FALSE;
+    }
+
+    proc = MemoryGetProcAddress(handle, "addNumbers");
+    if (MemoryGetProcAddressHash(handle, MemoryHashSymbolName("addNumbers"), "addNumbers") != proc) {
+        _tprintf(_T("MemoryGetProcAddressHash returned a different address\n"));
+        result = FALSE;
+    }
+    if (MemoryGetProcAddressHash(handle, MemoryHashSymbolName("notExported"), "notExported") != NULL) {
+        _tprintf(_T("MemoryGetProcAddressHash found a missing export\n"));
+        result = FALSE;
+    }
+
+    // the second call uses the cached slot of the call site
+    for (i=0; i<2; i++) {
+        if (AddHashed(handle, 1, 2) != 3) {
+            _tprintf(_T("addNumbers failed through hashed call site\n"));
+            result = FALSE;
+        }
+    }
+
+    memset(&slot, 0, sizeof(slot));
+    if (MemoryBindProc(handle, &slot, MemoryHashSymbolName("addNumbers"), "addNumbers") != proc ||
+            slot.module != handle || slot.proc != proc) {
+        _tprintf(_T("MemoryBindProc didn't bind the slot\n"));
+        result = FALSE;
+    }
+
+    MemoryFreeLibrary(handle);
+    if (slot.module != NULL || slot.proc != NULL) {
+        _tprintf(_T("Slot is still bound after the module was freed\n"));
+        result = FALSE;
+    }
+    return result;
+}
+
+BOOL FreeBatch(const void *data, size_t size)
+{
+    HMEMORYMODULE handles[4];
+    MEMORYPLACEMENTINFO info[4];
+    BOOL result = TRUE;
+    int i;
+
+    // freeing with the process terminating flag would leak the modules, so
+    // only the regular batch is tested here
+    memset(handles, 0, sizeof(handles));
+    for (i=0; i<4; i++) {
+        if (i == 2) {
+            // NULL entries are skipped
+            continue;
+        }
+        handles[i] = MemoryLoadLibrary(data, size);
+        if (handles[i] == NULL || !MemoryGetPlacementInfo(handles[i], &info[i])) {
+            _tprintf(_T("Can't load library for batch free\n"));
+            result = FALSE;
+        }
+    }
+    if (!MemoryFreeLibraries(handles, 4, 0)) {
+        _tprintf(_T("MemoryFreeLibraries failed: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    for (i=0; i<4; i++) {
+        if (handles[i] != NULL && MemoryModuleFromAddress(info[i].base, NULL) != NULL) {
+            _tprintf(_T("Freed module is still registered\n"));
+            result = FALSE;
+        }
+    }
+    return result;
+}
+
+// The first library imported by the dependent module is resolved to the
+// provider module, its functions are still taken from the real library.
+struct BATCH_IMPORTS {
+    HMEMORYMODULE provider;
+    HCUSTOMMODULE library;
+    int freed;
+};
+
+static HCUSTOMMODULE BatchLoadLibrary(LPCSTR filename, void *userdata)
+{
+    BATCH_IMPORTS *imports = (BATCH_IMPORTS *) userdata;
+    if (imports->library != NULL) {
+        return MemoryDefaultLoadLibrary(filename, NULL);
+    }
+    imports->library = MemoryDefaultLoadLibrary(filename, NULL);
+    return imports->library != NULL ? (HCUSTOMMODULE) imports->provider : NULL;
+}
+
+static FARPROC BatchGetProcAddress(HCUSTOMMODULE module, LPCSTR name, void *userdata)
+{
+    BATCH_IMPORTS *imports = (BATCH_IMPORTS *) userdata;
+    if (module == (HCUSTOMMODULE) imports->provider) {
+        module = imports->library;
+    }
+    return MemoryDefaultGetProcAddress(module, name, NULL);
+}
+
+static void BatchFreeLibrary(HCUSTOMMODULE module, void *userdata)
+{
+    BATCH_IMPORTS *imports = (BATCH_IMPORTS *) userdata;
+    if (module == (HCUSTOMMODULE) imports->provider) {
+        // the provider is freed by the batch
+        imports->freed++;
+        return;
+    }
+    MemoryDefaultFreeLibrary(module, NULL);
+}
+
+BOOL FreeDependentBatch(const void *data, size_t size)
+{
+    BATCH_IMPORTS imports;
+    HMEMORYMODULE handles[2];
+    MEMORYPLACEMENTINFO info[2];
+    BOOL result = TRUE;
+    int i;
+
+    memset(&imports, 0, sizeof(imports));
+    imports.provider = MemoryLoadLibrary(data, size);
+    if (imports.provider == NULL) {
+        _tprintf(_T("Can't load provider library: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    handles[0] = imports.provider;
+    handles[1] = MemoryLoadLibraryEx(data, size, MemoryDefaultAlloc, MemoryDefaultFree,
+        BatchLoadLibrary, BatchGetProcAddress, BatchFreeLibrary, &imports);
+    if (handles[1] == NULL) {
+        _tprintf(_T("Can't load dependent library: %lu\n"), GetLastError());
+        MemoryFreeLibrary(imports.provider);
+        if (imports.library != NULL) {
+            MemoryDefaultFreeLibrary(imports.library, NULL);
+        }
+        return FALSE;
+    }
+    for (i=0; i<2; i++) {
+        if (!MemoryGetPlacementInfo(handles[i], &info[i])) {
+            _tprintf(_T("Can't get placement of batch library: %lu\n"), GetLastError());
+            result = FALSE;
+        }
+    }
+
+    // the provider comes first, so it is released before its dependent
+    // unless the batch is sorted by imports
+    if (!MemoryFreeLibraries(handles, 2, 0)) {
+        _tprintf(_T("MemoryFreeLibraries failed: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    if (imports.freed != 0) {
+        _tprintf(_T("Provider was released %d times through freeLibrary\n"), imports.freed);
+        result = FALSE;
+    }
+    for (i=0; i<2; i++) {
+        if (MemoryModuleFromAddress(info[i].base, NULL) != NULL) {
+            _tprintf(_T("Freed module is still registered\n"));
+            result = FALSE;
+        }
+    }
+    MemoryDefaultFreeLibrary(imports.library, NULL);
+    return result;
+}
+
+BOOL LoadVerified(const void *data, size_t size)
+{
+    MEMORYLOADOPTIONS options;
+    MEMORYIMAGEHASH hashes[2];
+    HMEMORYMODULE handle;
+    BOOL result = TRUE;
+
+    if (!MemoryHashImage(data, size, &hashes[1])) {
+        _tprintf(_T("Can't hash image: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    memset(&hashes[0], 0, sizeof(hashes[0]));
+
+    // the image must match any of the allowed hashes
+    memset(&options, 0, sizeof(options));
+    options.allowedHashes = hashes;
+    options.numAllowedHashes = 2;
+    handle = LoadWithOptions(data, size, &options);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library with matching hash: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    result = CheckAddNumbers(handle, _T("verified library"));
+    MemoryFreeLibrary(handle);
+
+    options.numAllowedHashes = 1;
+    handle = LoadWithOptions(data, size, &options);
+    if (handle != NULL) {
+        _tprintf(_T("Library with unknown hash was loaded\n"));
+        MemoryFreeLibrary(handle);
+        result = FALSE;
+    } else if (GetLastError() != ERROR_INVALID_IMAGE_HASH) {
+        _tprintf(_T("Expected ERROR_INVALID_IMAGE_HASH, got %lu\n"), GetLastError());
+        result = FALSE;
+    }
+    return result;
+}
+
+BOOL LoadChecksum(const void *data, size_t size)
+{
+    MEMORYLOADOPTIONS options;
+    PIMAGE_NT_HEADERS headers;
+    PIMAGE_SECTION_HEADER section;
+    HMEMORYMODULE handle;
+    unsigned char *copy;
+    DWORD headerSum, checkSum;
+    BOOL result = TRUE;
+
+    // the test DLLs have no checksum, store the one computed by the system
+    copy = (unsigned char *) malloc(size);
+    if (copy == NULL) {
+        return FALSE;
+    }
+    memcpy(copy, data, size);
+    headers = CheckSumMappedFile(copy, (DWORD) size, &headerSum, &checkSum);
+    if (headers == NULL) {
+        _tprintf(_T("CheckSumMappedFile failed: %lu\n"), GetLastError());
+        free(copy);
+        return FALSE;
+    }
+    headers->OptionalHeader.CheckSum = checkSum;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = MEMORY_LOAD_VERIFY_CHECKSUM;
+    handle = LoadWithOptions(copy, size, &options);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load library with valid checksum: %lu\n"), GetLastError());
+        free(copy);
+        return FALSE;
+    }
+    result = CheckAddNumbers(handle, _T("library with checksum"));
+    MemoryFreeLibrary(handle);
+
+    // corrupt the data of the first section
+    section = IMAGE_FIRST_SECTION(headers);
+    copy[section->PointerToRawData] ^= 0xff;
+    handle = LoadWithOptions(copy, size, &options);
+    if (handle != NULL) {
+        _tprintf(_T("Library with wrong checksum was loaded\n"));
+        MemoryFreeLibrary(handle);
+        result = FALSE;
+    } else if (GetLastError() != ERROR_INVALID_IMAGE_HASH) {
+        _tprintf(_T("Expected ERROR_INVALID_IMAGE_HASH, got %lu\n"), GetLastError());
+        result = FALSE;
+    }
+    free(copy);
+    return result;
+}
+
+static volatile LONG asyncCallbacks;
+
+static void FinishInCallback(HMEMORYLOAD load, HMEMORYMODULE module, DWORD error, void *userdata)
+{
+    UNREFERENCED_PARAMETER(module);
+    UNREFERENCED_PARAMETER(error);
+    UNREFERENCED_PARAMETER(userdata);
+    // the worker keeps the load valid until the callback returns
+    MemoryFreeLibrary(MemoryFinishLoad(load));
+    InterlockedIncrement(&asyncCallbacks);
+}
+
+BOOL LoadAsync(const void *data, size_t size)
+{
+    HMEMORYLOAD loads[MAXIMUM_WAIT_OBJECTS + 1];
+    HMEMORYMODULE handle;
+    addNumberProc addNumber;
+    BOOL result = TRUE;
+    int i;
+
+    // the second load runs the entry point on this thread
+    for (i=0; i<2; i++) {
+        loads[i] = MemoryLoadLibraryAsync(data, size, NULL,
+            MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+            MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL,
+            i == 0 ? 0 : MEMORY_ASYNC_DEFER_ENTRY_POINT, NULL, NULL);
+        if (loads[i] == NULL) {
+            _tprintf(_T("Can't start asynchronous load: %lu\n"), GetLastError());
+            return FALSE;
+        }
+    }
+
+    if (MemoryWaitForLoads(loads, 2, TRUE, INFINITE) == WAIT_FAILED) {
+        _tprintf(_T("MemoryWaitForLoads failed: %lu\n"), GetLastError());
+        result = FALSE;
+    }
+
+    for (i=0; i<2; i++) {
+        handle = MemoryFinishLoad(loads[i]);
+        if (handle == NULL) {
+            _tprintf(_T("Asynchronous load failed: %lu\n"), GetLastError());
+            result = FALSE;
+            continue;
+        }
+
+        addNumber = (addNumberProc)MemoryGetProcAddress(handle, "addNumbers");
+        if (!addNumber || addNumber(1, 2) != 3) {
+            _tprintf(_T("addNumbers failed for asynchronous load\n"));
+            result = FALSE;
+        }
+        MemoryFreeLibrary(handle);
+    }
+
+    loads[0] = MemoryLoadLibraryAsync(data, size, NULL,
+        MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+        MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL,
+        0, NULL, NULL);
+    if (loads[0] == NULL) {
+        _tprintf(_T("Can't start asynchronous load: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    MemoryCancelLoad(loads[0]);
+    handle = MemoryFinishLoad(loads[0]);
+    if (handle != NULL || GetLastError() != ERROR_CANCELLED) {
+        _tprintf(_T("Cancelled load didn't fail with ERROR_CANCELLED\n"));
+        MemoryFreeLibrary(handle);
+        result = FALSE;
+    }
+
+    // more loads than WaitForMultipleObjects supports
+    for (i=0; i<MAXIMUM_WAIT_OBJECTS + 1; i++) {
+        loads[i] = MemoryLoadLibraryAsync(data, size, NULL,
+            MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+            MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL,
+            0, NULL, NULL);
+        if (loads[i] == NULL) {
+            _tprintf(_T("Can't start asynchronous load: %lu\n"), GetLastError());
+            return FALSE;
+        }
+    }
+    if (MemoryWaitForLoads(loads, MAXIMUM_WAIT_OBJECTS + 1, FALSE, INFINITE) > WAIT_OBJECT_0 + MAXIMUM_WAIT_OBJECTS ||
+        MemoryWaitForLoads(loads, MAXIMUM_WAIT_OBJECTS + 1, TRUE, INFINITE) != WAIT_OBJECT_0) {
+        _tprintf(_T("MemoryWaitForLoads failed for %d loads: %lu\n"), MAXIMUM_WAIT_OBJECTS + 1, GetLastError());
+        result = FALSE;
+    }
+    for (i=0; i<MAXIMUM_WAIT_OBJECTS + 1; i++) {
+        MemoryFreeLibrary(MemoryFinishLoad(loads[i]));
+    }
+
+    // the callback may finish the load itself
+    asyncCallbacks = 0;
+    loads[0] = MemoryLoadLibraryAsync(data, size, NULL,
+        MemoryDefaultAlloc, MemoryDefaultFree, MemoryDefaultLoadLibrary,
+        MemoryDefaultGetProcAddress, MemoryDefaultFreeLibrary, NULL,
+        0, FinishInCallback, NULL);
+    if (loads[0] == NULL) {
+        _tprintf(_T("Can't start asynchronous load: %lu\n"), GetLastError());
+        return FALSE;
+    }
+    while (asyncCallbacks == 0) {
+        Sleep(1);
+    }
+    return result;
+}
+
 BOOL LoadFromMemory(char *filename)
 {
     FILE *fp;
@@ -84,10 +897,12 @@ BOOL LoadFromMemory(char *filename)
     HMEMORYMODULE handle = NULL;
     addNumberProc addNumber;
     addNumberProc addNumber2;
+    SIZE_T released;
     HMEMORYRSRC resourceInfo;
     DWORD resourceSize;
     LPVOID resourceData;
     TCHAR buffer[100];
+    DWORD rva = 0;
     BOOL result = TRUE;
 
     fp = fopen(filename, "rb");
@@ -137,6 +952,23 @@ BOOL LoadFromMemory(char *filename)
         goto exit;
     }
     _tprintf(_T("From memory: %d\n"), addNumber(1, 2));
+    PrintLoadStats(handle);
+
+    if (MemoryModuleFromAddress((LPCVOID) addNumber, &rva) != handle) {
+        _tprintf(_T("MemoryModuleFromAddress(%p) didn't return the module\n"), addNumber);
+        result = FALSE;
+        goto exit;
+    }
+    if (rva == 0) {
+        _tprintf(_T("MemoryModuleFromAddress(%p) returned invalid RVA 0x%lx\n"), addNumber, rva);
+        result = FALSE;
+        goto exit;
+    }
+    if (MemoryModuleFromAddress((LPCVOID) &LoadFromMemory, NULL) != NULL) {
+        _tprintf(_T("MemoryModuleFromAddress found a module for host code\n"));
+        result = FALSE;
+        goto exit;
+    }
 
     // the DLL only exports one function, try to load by ordinal value
     addNumber2 = (addNumberProc)MemoryGetProcAddress(handle, reinterpret_cast<LPCSTR>(0x01));
@@ -221,12 +1053,137 @@ BOOL LoadFromMemory(char *filename)
         result = FALSE;
     }
 
+    if (!MemoryHibernateModule(handle, data, size, &released)) {
+        _tprintf(_T("MemoryHibernateModule failed: %lu\n"), GetLastError());
+        result = FALSE;
+        goto exit;
+    }
+    _tprintf(_T("Hibernated module, released %lu bytes\n"), (unsigned long) released);
+    // first call restores the pages on demand
+    if (addNumber(1, 2) != 3) {
+        _tprintf(_T("addNumbers failed while hibernated\n"));
+        result = FALSE;
+        goto exit;
+    }
+    if (!MemoryWakeModule(handle)) {
+        _tprintf(_T("MemoryWakeModule failed: %lu\n"), GetLastError());
+        result = FALSE;
+        goto exit;
+    }
+
+    if (!LoadWithFlags(data, size, MEMORY_LOAD_LARGE_PAGES)) {
+        result = FALSE;
+    }
+    if (!LoadWithFlags(data, size, MEMORY_LOAD_TRIM)) {
+        result = FALSE;
+    }
+    if (!LoadWithFlags(data, size, MEMORY_LOAD_PREFETCH)) {
+        result = FALSE;
+    }
+    if (!LoadWithPool(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadNearby(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadFromImage(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadAsync(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadVerified(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadChecksum(data, size)) {
+        result = FALSE;
+    }
+    if (!FreeBatch(data, size)) {
+        result = FALSE;
+    }
+    if (!FreeDependentBatch(data, size)) {
+        result = FALSE;
+    }
+    if (!LoadShared(data, size)) {
+        result = FALSE;
+    }
+    if (!ReloadWithTrampolines(data, size, filename)) {
+        result = FALSE;
+    }
+    if (!LoadWithWrapper(data, size)) {
+        result = FALSE;
+    }
+
+    if (!LookupHashed(data, size)) {
+        result = FALSE;
+    }
+
 exit:
     MemoryFreeLibrary(handle);
     free(data);
     return result;
 }
 
+#define LOOKUP_THREADS 8
+#define LOOKUP_ITERATIONS 1000
+
+struct LookupThreadData {
+    HMEMORYMODULE handle;
+    HANDLE start;
+    BOOL result;
+};
+
+DWORD WINAPI LookupExportsThread(LPVOID param)
+{
+    LookupThreadData *data = (LookupThreadData *) param;
+    int i, j;
+
+    WaitForSingleObject(data->start, INFINITE);
+    for (j = 0; j < LOOKUP_ITERATIONS; j++) {
+        for (i = 1; i <= 100; i++) {
+            char name[100];
+            sprintf(name, "add%d", i);
+            addProc addNumber = (addProc)MemoryGetProcAddress(data->handle, name);
+            if (!addNumber || addNumber(1) != 1 + i) {
+                data->result = FALSE;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+BOOL LookupExportsConcurrently(HMEMORYMODULE handle)
+{
+    HANDLE threads[LOOKUP_THREADS];
+    LookupThreadData data[LOOKUP_THREADS];
+    HANDLE start;
+    int i;
+    BOOL result = TRUE;
+
+    // All threads are released at once so they race on building the
+    // lazily created export name table of the freshly loaded module.
+    start = CreateEvent(NULL, TRUE, FALSE, NULL);
+    for (i = 0; i < LOOKUP_THREADS; i++) {
+        data[i].handle = handle;
+        data[i].start = start;
+        data[i].result = TRUE;
+        threads[i] = CreateThread(NULL, 0, LookupExportsThread, &data[i], 0, NULL);
+        assert(threads[i] != NULL);
+    }
+    SetEvent(start);
+    WaitForMultipleObjects(LOOKUP_THREADS, threads, TRUE, INFINITE);
+    for (i = 0; i < LOOKUP_THREADS; i++) {
+        CloseHandle(threads[i]);
+        if (!data[i].result) {
+            _tprintf(_T("Concurrent lookup failed in thread %d\n"), i);
+            result = FALSE;
+        }
+    }
+    CloseHandle(start);
+    return result;
+}
+
 BOOL LoadExportsFromMemory(char *filename)
 {
     FILE *fp;
@@ -263,6 +1220,11 @@ BOOL LoadExportsFromMemory(char *filename)
         goto exit;
     }
 
+    if (!LookupExportsConcurrently(handle)) {
+        result = FALSE;
+        goto exit;
+    }
+
     for (i = 1; i <= 100; i++) {
         char name[100];
         sprintf(name, "add%d", i);
@@ -350,27 +1312,196 @@ exit:
 }
 #endif
 
+BOOL WriteTrace(HMEMORYEVENTRING ring, const char *filename)
+{
+    BOOL result;
+    HANDLE file = CreateFileA(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Can't create trace file %s\n", filename);
+        return FALSE;
+    }
+
+    result = MemoryWriteEventTrace(ring, file);
+    CloseHandle(file);
+    if (!result) {
+        fprintf(stderr, "Can't write trace file %s\n", filename);
+    }
+    return result;
+}
+
+typedef int (*getTlsValueProc)(void);
+typedef void (*setTlsValueProc)(int);
+typedef LONG (*getCountProc)(void);
+
+struct TlsThreadData {
+    getTlsValueProc getTlsValue;
+    setTlsValueProc setTlsValue;
+    int value;
+    BOOL result;
+};
+
+DWORD WINAPI TlsThread(LPVOID param)
+{
+    TlsThreadData *data = (TlsThreadData *) param;
+
+    data->result = data->getTlsValue() == 42;
+    data->setTlsValue(data->value);
+    if (data->getTlsValue() != data->value) {
+        data->result = FALSE;
+    }
+    return 0;
+}
+
+DWORD WINAPI WaitThread(LPVOID param)
+{
+    // runs while the library is loaded, so it doesn't get TLS data and
+    // must not use it
+    WaitForSingleObject((HANDLE) param, INFINITE);
+    return 0;
+}
+
+BOOL LoadTlsFromMemory(char *filename)
+{
+    HMEMORYMODULE handle;
+    TlsThreadData first, second;
+    getTlsValueProc getTlsValue;
+    setTlsValueProc setTlsValue;
+    getCountProc getThreadsAttached, getThreadsDetached, getBadAttachValues;
+    LONG attached, detached;
+    HANDLE threads[3];
+    HANDLE stop;
+    void *data;
+    size_t size;
+    BOOL result = TRUE;
+
+    data = ReadLibrary(filename, &size);
+    if (data == NULL) {
+        return FALSE;
+    }
+
+    stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    assert(stop != NULL);
+    threads[0] = CreateThread(NULL, 0, WaitThread, stop, 0, NULL);
+    assert(threads[0] != NULL);
+
+    handle = MemoryLoadLibrary(data, size);
+    if (handle == NULL) {
+        _tprintf(_T("Can't load TLS library: %lu\n"), GetLastError());
+        result = FALSE;
+        goto exit;
+    }
+
+    getTlsValue = (getTlsValueProc) MemoryGetProcAddress(handle, "getTlsValue");
+    setTlsValue = (setTlsValueProc) MemoryGetProcAddress(handle, "setTlsValue");
+    getThreadsAttached = (getCountProc) MemoryGetProcAddress(handle, "getThreadsAttached");
+    getThreadsDetached = (getCountProc) MemoryGetProcAddress(handle, "getThreadsDetached");
+    getBadAttachValues = (getCountProc) MemoryGetProcAddress(handle, "getBadAttachValues");
+    if (!getTlsValue || !setTlsValue || !getThreadsAttached ||
+        !getThreadsDetached || !getBadAttachValues) {
+        _tprintf(_T("TLS library doesn't export the test functions\n"));
+        result = FALSE;
+        goto exit;
+    }
+
+    if (getTlsValue() != 42) {
+        _tprintf(_T("TLS value has wrong initial value: %d\n"), getTlsValue());
+        result = FALSE;
+    }
+    setTlsValue(7);
+
+    attached = getThreadsAttached();
+    detached = getThreadsDetached();
+    memset(&first, 0, sizeof(first));
+    first.getTlsValue = getTlsValue;
+    first.setTlsValue = setTlsValue;
+    second = first;
+    first.value = 1;
+    second.value = 2;
+    threads[1] = CreateThread(NULL, 0, TlsThread, &first, 0, NULL);
+    assert(threads[1] != NULL);
+    threads[2] = CreateThread(NULL, 0, TlsThread, &second, 0, NULL);
+    assert(threads[2] != NULL);
+    WaitForMultipleObjects(2, threads + 1, TRUE, INFINITE);
+    CloseHandle(threads[1]);
+    CloseHandle(threads[2]);
+
+    if (!first.result || !second.result) {
+        _tprintf(_T("Threads don't have their own TLS values\n"));
+        result = FALSE;
+    }
+    if (getTlsValue() != 7) {
+        _tprintf(_T("TLS value was changed by other threads\n"));
+        result = FALSE;
+    }
+    if (getThreadsAttached() - attached < 2 || getThreadsDetached() - detached < 2) {
+        _tprintf(_T("Thread notifications were not sent to the TLS callback\n"));
+        result = FALSE;
+    }
+    if (getBadAttachValues() != 0) {
+        _tprintf(_T("TLS data was not initialized before the thread was attached\n"));
+        result = FALSE;
+    }
+
+exit:
+    // the thread that was running before the library was loaded detaches
+    // while it is still loaded
+    SetEvent(stop);
+    WaitForSingleObject(threads[0], INFINITE);
+    CloseHandle(threads[0]);
+    CloseHandle(stop);
+    if (handle != NULL) {
+        MemoryFreeLibrary(handle);
+    }
+    free(data);
+    return result;
+}
+
 int main(int argc, char* argv[])
 {
+    HMEMORYEVENTRING ring = NULL;
+    int result = 0;
     if (argc < 2) {
-        fprintf(stderr, "USAGE: %s <filename.dll>\n", argv[0]);
+        fprintf(stderr, "USAGE: %s <filename.dll> [trace.json]\n", argv[0]);
         return 1;
     }
 
-    if (!strstr((const char *) argv[1], "exports")) {
+    if (argc > 2) {
+        // record loader events and dump them as Chrome trace
+        ring = MemoryCreateEventRing(65536);
+        if (ring == NULL) {
+            return 1;
+        }
+        if (!MemorySetEventCallback(MemoryEventRingCallback, ring)) {
+            MemoryDestroyEventRing(ring);
+            return 1;
+        }
+    }
+
+    if (strstr((const char *) argv[1], "tls")) {
+        if (!LoadTlsFromMemory(argv[1])) {
+            result = 2;
+        }
+    } else if (!strstr((const char *) argv[1], "exports")) {
         if (!LoadFromMemory(argv[1])) {
-            return 2;
+            result = 2;
         }
     } else {
         if (!LoadExportsFromMemory(argv[1])) {
-            return 2;
+            result = 2;
         }
 #ifdef _WIN64
-        if (!LoadExceptionsFromMemory(argv[1])) {
-            return 2;
+        else if (!LoadExceptionsFromMemory(argv[1])) {
+            result = 2;
         }
 #endif
     }
 
-    return 0;
+    if (ring != NULL) {
+        MemorySetEventCallback(NULL, NULL);
+        if (!WriteTrace(ring, argv[2]) && result == 0) {
+            result = 3;
+        }
+        MemoryDestroyEventRing(ring);
+    }
+    return result;
 }
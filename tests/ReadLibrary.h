@@ -0,0 +1,39 @@
+#ifndef __READ_LIBRARY_HEADER
+#define __READ_LIBRARY_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Read a complete file into a buffer that must be released with "free".
+static void *ReadLibrary(const char *filename, size_t *pSize)
+{
+    size_t read;
+    void *result;
+    long size;
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open DLL file \"%s\".", filename);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    result = malloc(size);
+    if (result == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_SET);
+    read = fread(result, 1, size, fp);
+    fclose(fp);
+    if (read != (size_t) size) {
+        free(result);
+        return NULL;
+    }
+
+    *pSize = (size_t) size;
+    return result;
+}
+
+#endif  // __READ_LIBRARY_HEADER
@@ -0,0 +1,98 @@
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#define SAMPLETLS_API extern "C" __declspec(dllexport)
+
+#define TLS_INITIAL_VALUE 42
+
+#if defined(_MSC_VER)
+__declspec(thread) int tlsValue = TLS_INITIAL_VALUE;
+
+static int *GetTlsValue(void)
+{
+    return &tlsValue;
+}
+#else
+// GCC emulates thread local variables through TlsAlloc, so the variable is
+// placed in the TLS template and looked up like code compiled by MSVC does.
+extern "C" ULONG _tls_index;
+extern "C" char _tls_start;
+
+static int tlsValue __attribute__((section(".tls$"))) = TLS_INITIAL_VALUE;
+
+static int *GetTlsValue(void)
+{
+#ifdef _WIN64
+    char **vector = *(char ***) ((char *) NtCurrentTeb() + 0x58);
+#else
+    char **vector = *(char ***) ((char *) NtCurrentTeb() + 0x2C);
+#endif
+    return (int *) (vector[_tls_index] + ((char *) &tlsValue - &_tls_start));
+}
+#endif
+
+static volatile LONG threadsAttached = 0;
+static volatile LONG threadsDetached = 0;
+// threads that didn't see the initial value when they were attached
+static volatile LONG badAttachValues = 0;
+
+static void NTAPI TlsCallback(PVOID handle, DWORD reason, PVOID reserved)
+{
+    UNREFERENCED_PARAMETER(handle);
+    UNREFERENCED_PARAMETER(reserved);
+    switch (reason) {
+    case DLL_THREAD_ATTACH:
+        if (*GetTlsValue() != TLS_INITIAL_VALUE) {
+            InterlockedIncrement(&badAttachValues);
+        }
+        InterlockedIncrement(&threadsAttached);
+        break;
+    case DLL_THREAD_DETACH:
+        InterlockedIncrement(&threadsDetached);
+        break;
+    }
+}
+
+#if defined(_MSC_VER)
+#ifdef _WIN64
+#pragma comment(linker, "/INCLUDE:_tls_used")
+#pragma comment(linker, "/INCLUDE:TlsCallbackEntry")
+#pragma const_seg(".CRT$XLB")
+extern "C" const PIMAGE_TLS_CALLBACK TlsCallbackEntry;
+const PIMAGE_TLS_CALLBACK TlsCallbackEntry = TlsCallback;
+#pragma const_seg()
+#else
+#pragma comment(linker, "/INCLUDE:__tls_used")
+#pragma comment(linker, "/INCLUDE:_TlsCallbackEntry")
+#pragma data_seg(".CRT$XLB")
+extern "C" PIMAGE_TLS_CALLBACK TlsCallbackEntry = TlsCallback;
+#pragma data_seg()
+#endif
+#else
+PIMAGE_TLS_CALLBACK TlsCallbackEntry __attribute__((section(".CRT$XLB"), used)) = TlsCallback;
+#endif
+
+SAMPLETLS_API int getTlsValue(void)
+{
+    return *GetTlsValue();
+}
+
+SAMPLETLS_API void setTlsValue(int value)
+{
+    *GetTlsValue() = value;
+}
+
+SAMPLETLS_API LONG getThreadsAttached(void)
+{
+    return threadsAttached;
+}
+
+SAMPLETLS_API LONG getThreadsDetached(void)
+{
+    return threadsDetached;
+}
+
+SAMPLETLS_API LONG getBadAttachValues(void)
+{
+    return badAttachValues;
+}
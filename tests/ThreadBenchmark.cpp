@@ -0,0 +1,325 @@
+#define WIN32_LEAN_AND_MEAN
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../MemoryModule.h"
+#include "ReadLibrary.h"
+
+#define DEFAULT_DURATION 1000
+// number of modules each thread can keep loaded at the same time
+#define SLOTS_PER_THREAD 4
+#define MAX_THREADS 256
+
+typedef int (*addProc)(int, int);
+
+typedef struct {
+    const char *name;
+    // relative weights of the operations
+    int load;
+    int getproc;
+    int free;
+} OPERATIONMIX;
+
+static const OPERATIONMIX defaultMixes[] = {
+    {"lookup", 0, 100, 0},
+    {"mixed", 10, 80, 10},
+    {"load_free", 50, 0, 50},
+};
+
+typedef struct {
+    const OPERATIONMIX *mix;
+    unsigned int seed;
+    ULONGLONG loads;
+    ULONGLONG getprocs;
+    ULONGLONG frees;
+    ULONGLONG failures;
+    ULONGLONG wrongResults;
+} WORKERDATA;
+
+static LARGE_INTEGER frequency;
+static const void *libraryData;
+static size_t librarySize;
+static HMEMORYMODULE sharedModule;
+static HANDLE startEvent;
+static volatile LONG stopRequested;
+// updated from the resolver callbacks of all threads
+static volatile LONG resolverCalls;
+static int currentThreads;
+
+static HCUSTOMMODULE CountingLoadLibrary(LPCSTR filename, void *userdata)
+{
+    InterlockedIncrement(&resolverCalls);
+    return MemoryDefaultLoadLibrary(filename, userdata);
+}
+
+static FARPROC CountingGetProcAddress(HCUSTOMMODULE module, LPCSTR name, void *userdata)
+{
+    InterlockedIncrement(&resolverCalls);
+    return MemoryDefaultGetProcAddress(module, name, userdata);
+}
+
+static LONG WINAPI CrashHandler(EXCEPTION_POINTERS *info)
+{
+    fflush(stdout);
+    fprintf(stderr, "CRASH: exception 0x%08lx at %p with %d threads\n",
+        (unsigned long) info->ExceptionRecord->ExceptionCode,
+        info->ExceptionRecord->ExceptionAddress,
+        currentThreads);
+    return EXCEPTION_EXECUTE_HANDLER;
+}
+
+static HMEMORYMODULE LoadCounting(void)
+{
+    return MemoryLoadLibraryEx(libraryData, librarySize,
+        MemoryDefaultAlloc, MemoryDefaultFree,
+        CountingLoadLibrary, CountingGetProcAddress, MemoryDefaultFreeLibrary,
+        NULL);
+}
+
+static unsigned int NextRandom(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7fff;
+}
+
+static DWORD WINAPI WorkerThread(LPVOID param)
+{
+    WORKERDATA *data = (WORKERDATA *) param;
+    const OPERATIONMIX *mix = data->mix;
+    int total = mix->load + mix->getproc + mix->free;
+    HMEMORYMODULE slots[SLOTS_PER_THREAD];
+    HMEMORYMODULE module;
+    addProc addNumbers;
+    unsigned int value;
+    int op;
+    int slot;
+
+    memset(slots, 0, sizeof(slots));
+    WaitForSingleObject(startEvent, INFINITE);
+    while (!stopRequested) {
+        value = NextRandom(&data->seed);
+        op = (int) (value % total);
+        slot = (int) ((value / total) % SLOTS_PER_THREAD);
+        if (op < mix->load) {
+            if (slots[slot] != NULL) {
+                MemoryFreeLibrary(slots[slot]);
+                data->frees++;
+            }
+            slots[slot] = LoadCounting();
+            if (slots[slot] == NULL) {
+                data->failures++;
+            } else {
+                data->loads++;
+            }
+        } else if (op < mix->load + mix->getproc) {
+            module = slots[slot] != NULL ? slots[slot] : sharedModule;
+            addNumbers = (addProc) MemoryGetProcAddress(module, "addNumbers");
+            if (addNumbers == NULL) {
+                data->failures++;
+            } else if (addNumbers((int) value, 1) != (int) value + 1 ||
+                    MemoryModuleFromAddress((LPCVOID) addNumbers, NULL) != module) {
+                // the module index must not return stale or foreign entries
+                data->wrongResults++;
+            }
+            data->getprocs++;
+        } else if (slots[slot] != NULL) {
+            MemoryFreeLibrary(slots[slot]);
+            slots[slot] = NULL;
+            data->frees++;
+        }
+    }
+
+    for (slot=0; slot<SLOTS_PER_THREAD; slot++) {
+        if (slots[slot] != NULL) {
+            MemoryFreeLibrary(slots[slot]);
+            data->frees++;
+        }
+    }
+    return 0;
+}
+
+// Run "mix" with "threads" threads for "duration" milliseconds and print one
+// line, see the header printed in main. Returns the number of operations per
+// second or a negative value if an inconsistency was detected.
+static double RunBenchmark(const OPERATIONMIX *mix, int threads, DWORD duration, LONG resolverCallsPerLoad, double baseline)
+{
+    HANDLE handles[MAX_THREADS];
+    WORKERDATA data[MAX_THREADS];
+    ULONGLONG loads = 0, getprocs = 0, frees = 0, failures = 0, wrongResults = 0;
+    ULONGLONG operations, lostUpdates = 0;
+    LARGE_INTEGER start, end;
+    double seconds, throughput;
+    int i;
+
+    currentThreads = threads;
+    stopRequested = 0;
+    resolverCalls = 0;
+    memset(data, 0, sizeof(data));
+    ResetEvent(startEvent);
+    for (i=0; i<threads; i++) {
+        data[i].mix = mix;
+        data[i].seed = (unsigned int) i * 2654435761u + 1;
+        handles[i] = CreateThread(NULL, 0, WorkerThread, &data[i], 0, NULL);
+        if (handles[i] == NULL) {
+            fprintf(stderr, "Can't create thread %d.\n", i);
+            InterlockedExchange(&stopRequested, 1);
+            SetEvent(startEvent);
+            WaitForMultipleObjects(i, handles, TRUE, INFINITE);
+            return -1;
+        }
+    }
+
+    QueryPerformanceCounter(&start);
+    SetEvent(startEvent);
+    Sleep(duration);
+    InterlockedExchange(&stopRequested, 1);
+    QueryPerformanceCounter(&end);
+    // the threads free their remaining modules before exiting
+    WaitForMultipleObjects(threads, handles, TRUE, INFINITE);
+
+    for (i=0; i<threads; i++) {
+        CloseHandle(handles[i]);
+        loads += data[i].loads;
+        getprocs += data[i].getprocs;
+        frees += data[i].frees;
+        failures += data[i].failures;
+        wrongResults += data[i].wrongResults;
+    }
+
+    // Every load must have called the resolvers the same number of times and
+    // every loaded module must have been freed. Differences are caused by
+    // updates that got lost between threads.
+    if ((ULONGLONG) resolverCalls != loads * resolverCallsPerLoad) {
+        lostUpdates++;
+    }
+    if (loads != frees) {
+        lostUpdates++;
+    }
+    if (MemoryModuleFromAddress((LPCVOID) MemoryGetProcAddress(sharedModule, "addNumbers"), NULL) != sharedModule) {
+        lostUpdates++;
+    }
+
+    seconds = (double) (end.QuadPart - start.QuadPart) / (double) frequency.QuadPart;
+    operations = loads + getprocs + frees;
+    throughput = (double) operations / seconds;
+    printf("%s,%d,%lu,%.0f,%.2f,%lu,%lu,%lu,%lu,%lu,%lu\n",
+        mix->name, threads, (unsigned long) operations, throughput,
+        baseline > 0 ? throughput / baseline : 1.0,
+        (unsigned long) loads, (unsigned long) getprocs, (unsigned long) frees,
+        (unsigned long) failures, (unsigned long) wrongResults, (unsigned long) lostUpdates);
+    fflush(stdout);
+    if (failures != 0 || wrongResults != 0 || lostUpdates != 0) {
+        fprintf(stderr, "%s with %d threads: %lu failures, %lu wrong results, %lu lost updates\n",
+            mix->name, threads, (unsigned long) failures, (unsigned long) wrongResults, (unsigned long) lostUpdates);
+        return -1;
+    }
+    return throughput;
+}
+
+// Thread counts are powers of two, followed by "maxThreads". Returns 0 after
+// the last run.
+static int NextThreadCount(int threads, int maxThreads)
+{
+    if (threads >= maxThreads) {
+        return 0;
+    } else if (threads * 2 > maxThreads) {
+        return maxThreads;
+    }
+    return threads * 2;
+}
+
+static BOOL ParseMix(const char *value, OPERATIONMIX *mix)
+{
+    mix->name = "custom";
+    if (sscanf(value, "%d,%d,%d", &mix->load, &mix->getproc, &mix->free) != 3) {
+        return FALSE;
+    }
+    return mix->load >= 0 && mix->getproc >= 0 && mix->free >= 0 &&
+        mix->load + mix->getproc + mix->free > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    SYSTEM_INFO sysInfo;
+    OPERATIONMIX customMix;
+    const OPERATIONMIX *mixes = defaultMixes;
+    int numMixes = sizeof(defaultMixes) / sizeof(defaultMixes[0]);
+    int maxThreads;
+    DWORD duration = DEFAULT_DURATION;
+    LONG resolverCallsPerLoad;
+    HMEMORYMODULE handle;
+    double baseline, throughput;
+    int result = 0;
+    int threads;
+    int i;
+
+    GetSystemInfo(&sysInfo);
+    maxThreads = (int) sysInfo.dwNumberOfProcessors;
+    for (i=1; i + 1<argc && argv[i][0] == '-'; i+=2) {
+        if (strcmp(argv[i], "-t") == 0) {
+            maxThreads = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            duration = (DWORD) atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-m") == 0 && ParseMix(argv[i + 1], &customMix)) {
+            mixes = &customMix;
+            numMixes = 1;
+        } else {
+            break;
+        }
+    }
+    if (i != argc - 1 || maxThreads <= 0 || maxThreads > MAX_THREADS || duration == 0) {
+        fprintf(stderr, "USAGE: %s [-t max_threads] [-d milliseconds] [-m load,getproc,free] <filename.dll>\n", argv[0]);
+        return 1;
+    }
+
+    libraryData = ReadLibrary(argv[i], &librarySize);
+    if (libraryData == NULL) {
+        return 1;
+    }
+
+    SetUnhandledExceptionFilter(CrashHandler);
+    QueryPerformanceFrequency(&frequency);
+    startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+    // a reference load determines how often the resolvers are called per load
+    handle = LoadCounting();
+    if (handle == NULL) {
+        fprintf(stderr, "Can't load library from memory.\n");
+        return 2;
+    }
+    resolverCallsPerLoad = resolverCalls;
+    MemoryFreeLibrary(handle);
+
+    // used for lookups by threads that have no module loaded in a slot
+    sharedModule = MemoryLoadLibrary(libraryData, librarySize);
+    if (sharedModule == NULL) {
+        fprintf(stderr, "Can't load library from memory.\n");
+        return 2;
+    }
+
+    // throughput is in operations per second, speedup is relative to the
+    // single-threaded run of the same mix
+    printf("mix,threads,operations,ops_per_sec,speedup,loads,getprocs,frees,failures,wrong_results,lost_updates\n");
+    for (i=0; i<numMixes; i++) {
+        baseline = 0;
+        for (threads=1; threads!=0; threads=NextThreadCount(threads, maxThreads)) {
+            throughput = RunBenchmark(&mixes[i], threads, duration, resolverCallsPerLoad, baseline);
+            if (throughput < 0) {
+                result = 3;
+            } else if (threads == 1) {
+                baseline = throughput;
+            }
+        }
+    }
+
+    MemoryFreeLibrary(sharedModule);
+    CloseHandle(startEvent);
+    free((void *) libraryData);
+    return result;
+}
@@ -0,0 +1,138 @@
+#!/bin/sh
+##
+## Generate sources for synthetic DLLs that scale along one axis of image
+## complexity.
+##
+## Usage: generate-corpus.sh <name> [--exports N] [--imports N]
+##            [--relocations N] [--sections N] [--resources N] [--provider N]
+##
+## Writes <name>.cpp and <name>.rc. Every DLL exports "addNumbers" and has
+## string resource 1 and the RCDATA resource "STRINGRES" (like SampleDLL),
+## so it can be used with Benchmark.exe. DLLs with imports
+## must be linked against "corpus-provider.dll", which is generated with
+## "--provider N" and exports the functions "provide1" to "provideN".
+##
+set -e
+
+NAME=$1
+if [ -z "$NAME" ]; then
+    echo "USAGE: $0 <name> [--exports N] [--imports N] [--relocations N] [--sections N] [--resources N] [--provider N]" >&2
+    exit 1
+fi
+shift
+
+EXPORTS=0
+IMPORTS=0
+RELOCATIONS=0
+SECTIONS=0
+RESOURCES=0
+PROVIDER=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --exports) EXPORTS=$2 ;;
+        --imports) IMPORTS=$2 ;;
+        --relocations) RELOCATIONS=$2 ;;
+        --sections) SECTIONS=$2 ;;
+        --resources) RESOURCES=$2 ;;
+        --provider) PROVIDER=$2 ;;
+        *) echo "Unknown option $1" >&2; exit 1 ;;
+    esac
+    shift 2
+done
+
+##
+## Generate source file.
+##
+
+SOURCE=$NAME.cpp
+
+cat > $SOURCE << EOF
+// Generated by generate-corpus.sh, do not edit.
+#define SAMPLEDLL_API __declspec(dllexport)
+
+extern "C" {
+
+SAMPLEDLL_API int addNumbers(int a, int b)
+{
+    return a + b;
+}
+EOF
+
+# Exports are emitted in random order, like in generate-exports.sh.
+if [ $EXPORTS -gt 0 ]; then
+    for i in `seq 1 $EXPORTS | sort -R`; do
+        printf 'SAMPLEDLL_API int export%d(int a) { return a + %d; }\n' $i $i
+    done >> $SOURCE
+fi
+
+if [ $PROVIDER -gt 0 ]; then
+    for i in `seq 1 $PROVIDER`; do
+        printf 'SAMPLEDLL_API int provide%d(int a) { return a + %d; }\n' $i $i
+    done >> $SOURCE
+fi
+
+if [ $IMPORTS -gt 0 ]; then
+    for i in `seq 1 $IMPORTS`; do
+        printf '__declspec(dllimport) int provide%d(int a);\n' $i
+    done >> $SOURCE
+    echo 'SAMPLEDLL_API int callImports(int a)' >> $SOURCE
+    echo '{' >> $SOURCE
+    for i in `seq 1 $IMPORTS`; do
+        printf '    a = provide%d(a);\n' $i
+    done >> $SOURCE
+    echo '    return a;' >> $SOURCE
+    echo '}' >> $SOURCE
+fi
+
+# Every pointer in the table needs a base relocation.
+if [ $RELOCATIONS -gt 0 ]; then
+    printf 'static char relocTarget[%d];\n' $RELOCATIONS >> $SOURCE
+    echo 'SAMPLEDLL_API char *relocTable[] = {' >> $SOURCE
+    for i in `seq 0 $((RELOCATIONS - 1))`; do
+        printf '    relocTarget + %d,\n' $i
+    done >> $SOURCE
+    echo '};' >> $SOURCE
+fi
+
+# Alternate between writable and read-only sections of one page each.
+if [ $SECTIONS -gt 0 ]; then
+    for i in `seq 1 $SECTIONS`; do
+        if [ $((i % 2)) -eq 0 ]; then
+            printf 'SAMPLEDLL_API int section%d[1024] __attribute__((section(".cs%d"))) = { %d };\n' $i $i $i
+        else
+            printf 'SAMPLEDLL_API extern const int section%d[1024] __attribute__((section(".cs%d"))) = { %d };\n' $i $i $i
+        fi
+    done >> $SOURCE
+fi
+
+echo '}' >> $SOURCE
+
+##
+## Generate resource file.
+##
+
+RESOURCE=$NAME.rc
+
+cat > $RESOURCE << EOF
+// Generated by generate-corpus.sh, do not edit.
+STRINGTABLE
+BEGIN
+    1, "$NAME"
+EOF
+
+if [ $RESOURCES -gt 0 ]; then
+    for i in `seq 1 $RESOURCES`; do
+        printf '    %d, "string %d"\n' $((i + 100)) $i
+    done >> $RESOURCE
+fi
+
+echo 'END' >> $RESOURCE
+
+if [ $RESOURCES -gt 0 ]; then
+    for i in `seq 1 $RESOURCES`; do
+        printf '%d RCDATA { "data %d\\0" }\n' $i $i
+        printf 'corpus%d RCDATA { "named data %d\\0" }\n' $i $i
+    done >> $RESOURCE
+fi
+
+printf 'STRINGRES RCDATA { "%s\\0" }\n' $NAME >> $RESOURCE